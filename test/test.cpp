@@ -1,9 +1,51 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <memory>    // std::shared_ptr
 #include <format>    // C++20 (C++23でも利用可)
 #include <stdexcept> // std::runtime_error
+#include <typeinfo>
 #include <utility>   // std::move
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <new>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <map>
+#include <mutex>
+#include <span>
+#include <tuple>
+#include <type_traits>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 //-------------------------------------------------
 // 1. クラス前方宣言
@@ -14,6 +56,11 @@ struct Variable;
 struct BinaryOp;
 struct Add;
 struct Multiply;
+struct NaryOp;
+struct Sum;
+struct Product;
+struct Pow;
+struct Derivative;
 
 //-------------------------------------------------
 // 2. 補助関数 (dynamic_cast ラッパー)
@@ -23,16 +70,63 @@ const T* as(const Expression* expr) {
     return dynamic_cast<const T*>(expr);
 }
 
+// f() の実行時間 (ミリ秒)
+template<typename F>
+double measure_ms(F&& f) {
+    auto t0 = std::chrono::steady_clock::now();
+    f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(t1 - t0).count();
+}
+
+// 整数指数のべき乗 (二乗法)
+template<typename T>
+T ipow(T x, unsigned n) {
+    T r(1);
+    while (n) {
+        if (n & 1) r = r * x;
+        x = x * x;
+        n >>= 1;
+    }
+    return r;
+}
+
+// 二乗法で計算する指数か (整数で unsigned に収まる)
+bool is_int_exponent(double e) {
+    return e == std::trunc(e) && std::abs(e) < 2147483648.0;
+}
+
+// b^e: 整数指数は二乗法, それ以外は std::pow (浮動小数点型用. 他のスカラー型は各自で多重定義する)
+template<typename T>
+T power(T b, double e) {
+    if (is_int_exponent(e)) {
+        T r = ipow(b, static_cast<unsigned>(std::abs(e)));
+        return e < 0 ? T(1) / r : r;
+    }
+    return std::pow(b, static_cast<T>(e));
+}
+
 //-------------------------------------------------
 // 3. クラス「宣言」
 //-------------------------------------------------
 
-struct Expression {
+struct Expression : std::enable_shared_from_this<Expression> {
     virtual ~Expression() = default;
     virtual double evaluate(double x_val) const = 0;
     virtual std::shared_ptr<Expression> derivative() const = 0;
-    virtual std::shared_ptr<Expression> simplify() const = 0;
+    // メモ化された簡約: 正規形と記録済みなら自分自身, 簡約済みならキャッシュした結果を返す
+    std::shared_ptr<Expression> simplify() const;
+    // 各ノードの簡約規則 (1 パス). 何も適用できなければ self() を返す
+    virtual std::shared_ptr<Expression> simplify_uncached() const = 0;
     virtual std::string to_string() const = 0;
+
+    std::shared_ptr<Expression> self() const {
+        return std::const_pointer_cast<Expression>(shared_from_this());
+    }
+
+    // 共有される部分木からも参照されるため, 書き込みは atomic に行う
+    mutable std::atomic<bool> in_normal_form{false};
+    mutable std::atomic<std::shared_ptr<Expression>> simplify_cache;
 };
 
 struct Constant : Expression {
@@ -40,15 +134,17 @@ struct Constant : Expression {
     explicit Constant(double v) : value(v) {}
     double evaluate(double x_val) const override;
     std::shared_ptr<Expression> derivative() const override;
-    std::shared_ptr<Expression> simplify() const override;
+    std::shared_ptr<Expression> simplify_uncached() const override;
     std::string to_string() const override;
 };
 
 struct Variable : Expression {
     std::string name = "x";
+    Variable() = default;
+    explicit Variable(std::string n) : name(std::move(n)) {}
     double evaluate(double x_val) const override;
     std::shared_ptr<Expression> derivative() const override;
-    std::shared_ptr<Expression> simplify() const override;
+    std::shared_ptr<Expression> simplify_uncached() const override;
     std::string to_string() const override;
 };
 
@@ -63,7 +159,7 @@ struct Multiply : BinaryOp {
         : BinaryOp(std::move(l), std::move(r)) {}
     double evaluate(double val) const override;
     std::shared_ptr<Expression> derivative() const override;
-    std::shared_ptr<Expression> simplify() const override;
+    std::shared_ptr<Expression> simplify_uncached() const override;
     std::string to_string() const override;
 };
 
@@ -72,15 +168,103 @@ struct Add : BinaryOp {
         : BinaryOp(std::move(l), std::move(r)) {}
     double evaluate(double val) const override;
     std::shared_ptr<Expression> derivative() const override;
-    std::shared_ptr<Expression> simplify() const override;
+    std::shared_ptr<Expression> simplify_uncached() const override;
+    std::string to_string() const override;
+};
+
+// n 項の和・積: 被演算子は連続配列に持ち、定数は coeff 1 つに畳み込む
+//   Sum:     coeff + operands[0] + operands[1] + ...
+//   Product: coeff * operands[0] * operands[1] * ...
+struct NaryOp : Expression {
+    double coeff;
+    std::vector<std::shared_ptr<Expression>> operands;
+    NaryOp(double c, std::vector<std::shared_ptr<Expression>> ops)
+        : coeff(c), operands(std::move(ops)) {}
+};
+
+struct Sum : NaryOp {
+    Sum(double c, std::vector<std::shared_ptr<Expression>> ops)
+        : NaryOp(c, std::move(ops)) {}
+    double evaluate(double val) const override;
+    std::shared_ptr<Expression> derivative() const override;
+    std::shared_ptr<Expression> simplify_uncached() const override;
+    std::string to_string() const override;
+};
+
+struct Product : NaryOp {
+    Product(double c, std::vector<std::shared_ptr<Expression>> ops)
+        : NaryOp(c, std::move(ops)) {}
+    double evaluate(double val) const override;
+    std::shared_ptr<Expression> derivative() const override;
+    std::shared_ptr<Expression> simplify_uncached() const override;
+    std::string to_string() const override;
+};
+
+// べき乗 base ^ exponent (整数・実数の指数)
+struct Pow : Expression {
+    std::shared_ptr<Expression> base;
+    double exponent;
+    Pow(std::shared_ptr<Expression> b, double e) : base(std::move(b)), exponent(e) {}
+    double evaluate(double val) const override;
+    std::shared_ptr<Expression> derivative() const override;
+    std::shared_ptr<Expression> simplify_uncached() const override;
     std::string to_string() const override;
 };
 
+// 遅延微分 d/dx inner. 記号的な展開は要求されるまで行わない (実装は 22 節).
+// 構造ハッシュと二進形式は展開せずに扱う. テープ, ハッシュコンス, count_ops は展開した木を扱うので,
+// そこへ渡すと全体が展開される. ExprStore には入れられない (import が例外を投げる)
+struct Derivative : Expression {
+    std::shared_ptr<Expression> inner;
+    explicit Derivative(std::shared_ptr<Expression> e) : inner(std::move(e)) {}
+    double evaluate(double val) const override;
+    std::shared_ptr<Expression> derivative() const override;
+    std::shared_ptr<Expression> simplify_uncached() const override;
+    std::string to_string() const override;
+    // 微分規則を 1 段だけ適用した式 (子は再び Derivative). 初回に作って覚えておく
+    std::shared_ptr<Expression> expand() const;
+
+private:
+    mutable std::atomic<std::shared_ptr<Expression>> expansion_;
+};
+
 //-------------------------------------------------
 // 4. ファクトリ関数 (★ 名前を変更)
 //-------------------------------------------------
-auto C(double v) { return std::shared_ptr<Constant>(new Constant(v)); }
-auto V() { return std::shared_ptr<Variable>(new Variable()); }
+// 頻出する葉は不死のシングルトンを返す (解放しないので破棄順の問題もない)
+//   C: 0, 1, -1 を含む小さな整数 [-128, 1024] はキャッシュ済みの共有ノード
+//   V: 変数名ごとに 1 つのノード
+constexpr int kSmallIntMin = -128;
+constexpr int kSmallIntMax = 1024;
+
+// C() がキャッシュ済みの共有ノードを返す値か. -0.0 は to_string が異なるのでキャッシュしない
+bool is_cached_small_int(double v) {
+    return v >= kSmallIntMin && v <= kSmallIntMax && v == std::trunc(v) && !(v == 0 && std::signbit(v));
+}
+
+auto C(double v) {
+    using Table = std::array<std::shared_ptr<Constant>, kSmallIntMax - kSmallIntMin + 1>;
+    static const Table* table = [] {
+        auto* t = new Table();
+        for (int i = kSmallIntMin; i <= kSmallIntMax; ++i)
+            (*t)[i - kSmallIntMin] = std::shared_ptr<Constant>(new Constant(i));
+        return t;
+    }();
+    if (is_cached_small_int(v))
+        return (*table)[static_cast<int>(v) - kSmallIntMin];
+    return std::shared_ptr<Constant>(new Constant(v));
+}
+auto V(const std::string& name = "x") {
+    static const auto* x = new std::shared_ptr<Variable>(new Variable("x"));
+    if (name == "x") return *x;
+
+    static std::mutex mtx;
+    static auto* table = new std::unordered_map<std::string, std::shared_ptr<Variable>>();
+    std::lock_guard lock(mtx);
+    auto& slot = (*table)[name];
+    if (!slot) slot = std::shared_ptr<Variable>(new Variable(name));
+    return slot;
+}
 
 // 名前を変更: Add -> make_add
 auto make_add(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) { 
@@ -91,19 +275,171 @@ auto make_mul(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) {
     return std::shared_ptr<Multiply>(new Multiply(std::move(l), std::move(r))); 
 }
 
+// n 項の和・積. 入れ子の Sum/Add (積なら Product/Multiply) は平坦化し,
+// 定数の被演算子は coeff に畳み込む. 深い二分木の鎖も明示スタックで展開する.
+auto make_sum(std::vector<std::shared_ptr<Expression>> ops, double constant = 0) {
+    std::vector<std::shared_ptr<Expression>> flat;
+    flat.reserve(ops.size());
+    std::vector<std::shared_ptr<Expression>> stack(ops.rbegin(), ops.rend());
+    while (!stack.empty()) {
+        auto e = std::move(stack.back());
+        stack.pop_back();
+        if (auto c = as<Constant>(e.get())) {
+            constant += c->value;
+        } else if (auto a = as<Add>(e.get())) {
+            stack.push_back(a->right);
+            stack.push_back(a->left);
+        } else if (auto s = as<Sum>(e.get())) {
+            constant += s->coeff;
+            stack.insert(stack.end(), s->operands.rbegin(), s->operands.rend());
+        } else {
+            flat.push_back(std::move(e));
+        }
+    }
+    return std::shared_ptr<Sum>(new Sum(constant, std::move(flat)));
+}
+auto make_product(std::vector<std::shared_ptr<Expression>> ops, double coeff = 1) {
+    std::vector<std::shared_ptr<Expression>> flat;
+    flat.reserve(ops.size());
+    std::vector<std::shared_ptr<Expression>> stack(ops.rbegin(), ops.rend());
+    while (!stack.empty()) {
+        auto e = std::move(stack.back());
+        stack.pop_back();
+        if (auto c = as<Constant>(e.get())) {
+            coeff *= c->value;
+        } else if (auto m = as<Multiply>(e.get())) {
+            stack.push_back(m->right);
+            stack.push_back(m->left);
+        } else if (auto p = as<Product>(e.get())) {
+            coeff *= p->coeff;
+            stack.insert(stack.end(), p->operands.rbegin(), p->operands.rend());
+        } else {
+            flat.push_back(std::move(e));
+        }
+    }
+    return std::shared_ptr<Product>(new Product(coeff, std::move(flat)));
+}
+
+auto make_pow(std::shared_ptr<Expression> base, double exponent) {
+    return std::shared_ptr<Pow>(new Pow(std::move(base), exponent));
+}
+auto make_derivative(std::shared_ptr<Expression> e) {
+    return std::shared_ptr<Derivative>(new Derivative(std::move(e)));
+}
+
+// 二分木の Add/Multiply を n 項の Sum/Product に変換する
+std::shared_ptr<Expression> flatten(const std::shared_ptr<Expression>& e) {
+    std::shared_ptr<NaryOp> n;
+    if (as<Add>(e.get()) || as<Sum>(e.get())) n = make_sum({e});
+    else if (as<Multiply>(e.get()) || as<Product>(e.get())) n = make_product({e});
+    else return e;
+    for (auto& op : n->operands) op = flatten(op);
+    return n;
+}
+
+// 構造的な等価判定 (同一ノードなら即座に真)
+bool structurally_equal(const Expression* a, const Expression* b) {
+    if (a == b) return true;
+    if (auto ac = as<Constant>(a)) {
+        auto bc = as<Constant>(b);
+        return bc && ac->value == bc->value;
+    }
+    if (auto av = as<Variable>(a)) {
+        auto bv = as<Variable>(b);
+        return bv && av->name == bv->name;
+    }
+    if (auto ap = as<Pow>(a)) {
+        auto bp = as<Pow>(b);
+        return bp && ap->exponent == bp->exponent && structurally_equal(ap->base.get(), bp->base.get());
+    }
+    if (auto ad = as<Derivative>(a)) {
+        auto bd = as<Derivative>(b);
+        return bd && structurally_equal(ad->inner.get(), bd->inner.get());
+    }
+    if (auto ab = as<BinaryOp>(a)) {
+        auto bb = as<BinaryOp>(b);
+        return bb && typeid(*a) == typeid(*b) &&
+               structurally_equal(ab->left.get(), bb->left.get()) &&
+               structurally_equal(ab->right.get(), bb->right.get());
+    }
+    if (auto an = as<NaryOp>(a)) {
+        auto bn = as<NaryOp>(b);
+        if (!bn || typeid(*a) != typeid(*b) || an->coeff != bn->coeff || an->operands.size() != bn->operands.size())
+            return false;
+        for (std::size_t i = 0; i < an->operands.size(); ++i)
+            if (!structurally_equal(an->operands[i].get(), bn->operands[i].get())) return false;
+        return true;
+    }
+    return false;
+}
+
+// 子ノードの列挙と, 子だけを差し替えた同種ノードの生成 (走査用)
+std::vector<std::shared_ptr<Expression>> children_of(const Expression* e) {
+    if (auto b = as<BinaryOp>(e)) return {b->left, b->right};
+    if (auto p = as<Pow>(e)) return {p->base};
+    if (auto n = as<NaryOp>(e)) return n->operands;
+    if (auto d = as<Derivative>(e)) return {d->inner};
+    return {};
+}
+// 遅延微分ノードは 1 段展開した式を子とみなす列挙. Derivative を命令や共有ノードにできない変換
+// (テープ, ハッシュコンス, 演算数) が使う. 展開はノードが覚えているので, 子のポインタは親と同じだけ生きる
+std::vector<std::shared_ptr<Expression>> expanded_children_of(const Expression* e) {
+    if (auto d = as<Derivative>(e)) return {d->expand()};
+    return children_of(e);
+}
+std::shared_ptr<Expression> with_children(const std::shared_ptr<Expression>& e,
+                                          std::vector<std::shared_ptr<Expression>> kids) {
+    if (as<Add>(e.get())) return make_add(std::move(kids[0]), std::move(kids[1]));
+    if (as<Multiply>(e.get())) return make_mul(std::move(kids[0]), std::move(kids[1]));
+    if (auto p = as<Pow>(e.get())) return make_pow(std::move(kids[0]), p->exponent);
+    if (auto s = as<Sum>(e.get())) return std::shared_ptr<Sum>(new Sum(s->coeff, std::move(kids)));
+    if (auto p = as<Product>(e.get())) return std::shared_ptr<Product>(new Product(p->coeff, std::move(kids)));
+    if (as<Derivative>(e.get())) return make_derivative(std::move(kids[0]));
+    return e;
+}
+
+// e を base ^ exponent とみなした分解 (Pow でなければ指数 1)
+std::pair<std::shared_ptr<Expression>, double> base_exponent(const std::shared_ptr<Expression>& e) {
+    if (auto p = as<Pow>(e.get())) return {p->base, p->exponent};
+    return {e, 1.0};
+}
+
+// x^m * x^n -> x^(m+n) が元と同じ値を返すか. 実数の指数は負の底で NaN なのでまとめず,
+// 符号の違う指数は x = 0 での inf * 0 = NaN を消してしまうのでまとめない
+bool can_add_exponents(double m, double n) {
+    return is_int_exponent(m) && is_int_exponent(n) && ((m >= 0 && n >= 0) || (m <= 0 && n <= 0));
+}
+
+// Sum/Product の定数を 2 項の鎖にするとき省けるか. 省けるのは値を変えない定数だけで,
+// 和では -0.0 (0 + -0 = +0 なので 0.0 は省けない), 積では 1.0. 比較はビット列で行う
+bool droppable_coeff(double coeff, bool sum) {
+    return std::bit_cast<std::uint64_t>(coeff) == std::bit_cast<std::uint64_t>(sum ? -0.0 : 1.0);
+}
+
 
 //-------------------------------------------------
 // 5. クラス「定義」 (実装)
 // (実装内部でもファクトリ関数を使用)
 //-------------------------------------------------
 
+// --- Expression ---
+std::shared_ptr<Expression> Expression::simplify() const {
+    if (in_normal_form.load(std::memory_order_acquire)) return self();
+    if (auto cached = simplify_cache.load(std::memory_order_acquire)) return cached;
+    auto r = simplify_uncached();
+    // 規則は 1 パスなので, 結果 r 自身が正規形とは限らない (r->simplify() で改めて判定される)
+    if (r.get() == this) in_normal_form.store(true, std::memory_order_release);
+    else simplify_cache.store(r, std::memory_order_release);
+    return r;
+}
+
 // --- Constant ---
 double Constant::evaluate(double /*x_val*/) const { return value; }
 std::shared_ptr<Expression> Constant::derivative() const {
     return C(0);
 }
-std::shared_ptr<Expression> Constant::simplify() const {
-    return C(value);
+std::shared_ptr<Expression> Constant::simplify_uncached() const {
+    return self();
 }
 std::string Constant::to_string() const {
     return std::format("{}", value);
@@ -116,8 +452,8 @@ double Variable::evaluate(double x_val) const {
 std::shared_ptr<Expression> Variable::derivative() const {
     return C(1);
 }
-std::shared_ptr<Expression> Variable::simplify() const {
-    return V();
+std::shared_ptr<Expression> Variable::simplify_uncached() const {
+    return self();
 }
 std::string Variable::to_string() const {
     return name;
@@ -134,7 +470,7 @@ std::shared_ptr<Expression> Multiply::derivative() const {
         make_mul(left, right->derivative())
     );
 }
-std::shared_ptr<Expression> Multiply::simplify() const {
+std::shared_ptr<Expression> Multiply::simplify_uncached() const {
     auto l = left->simplify();
     auto r = right->simplify();
 
@@ -147,6 +483,12 @@ std::shared_ptr<Expression> Multiply::simplify() const {
     if (rc && rc->value == 1) return l;
     if (lc && lc->value == 1) return r;
 
+    // x * x -> x^2, x^m * x^n -> x^(m+n) (値が変わらないときのみ)
+    auto [lb, le] = base_exponent(l);
+    auto [rb, re] = base_exponent(r);
+    if (can_add_exponents(le, re) && structurally_equal(lb.get(), rb.get())) return make_pow(lb, le + re)->simplify();
+
+    if (l == left && r == right) return self();
     return make_mul(l, r); // ★ make_mul を使用
 }
 std::string Multiply::to_string() const {
@@ -160,7 +502,7 @@ double Add::evaluate(double val) const {
 std::shared_ptr<Expression> Add::derivative() const {
     return make_add(left->derivative(), right->derivative()); // ★ make_add を使用
 }
-std::shared_ptr<Expression> Add::simplify() const {
+std::shared_ptr<Expression> Add::simplify_uncached() const {
     auto l = left->simplify();
     auto r = right->simplify();
 
@@ -205,54 +547,5664 @@ std::shared_ptr<Expression> Add::simplify() const {
         }
     }
     
+    if (l == left && r == right) return self();
     return make_add(l, r); // ★ make_add を使用
 }
 std::string Add::to_string() const {
     return std::format("({} + {})", left->to_string(), right->to_string());
 }
 
+// --- Sum ---
+double Sum::evaluate(double val) const {
+    double acc = coeff;
+    for (auto& op : operands) acc += op->evaluate(val);
+    return acc;
+}
+std::shared_ptr<Expression> Sum::derivative() const {
+    std::vector<std::shared_ptr<Expression>> ds;
+    ds.reserve(operands.size());
+    for (auto& op : operands) ds.push_back(op->derivative());
+    return make_sum(std::move(ds));
+}
+std::shared_ptr<Expression> Sum::simplify_uncached() const {
+    std::vector<std::shared_ptr<Expression>> ops;
+    ops.reserve(operands.size());
+    for (auto& op : operands) ops.push_back(op->simplify());
+    auto flat = make_sum(std::move(ops), coeff);
+
+    // 変数ごとに 1 次の項 (x, C * x) をまとめる. 1 つしかない項は元のノードを残す
+    struct Linear { const Variable* var; double coeff; std::shared_ptr<Expression> only; };
+    std::vector<Linear> linear;
+    std::vector<std::shared_ptr<Expression>> rest;
+    for (auto& op : flat->operands) {
+        const Variable* v = as<Variable>(op.get());
+        double c = 1;
+        if (auto p = as<Product>(op.get()); p && p->operands.size() == 1) {
+            v = as<Variable>(p->operands[0].get());
+            c = p->coeff;
+        } else if (auto m = as<Multiply>(op.get())) {
+            auto mc = as<Constant>(m->left.get());
+            auto mv = as<Variable>(m->right.get());
+            if (mc && mv) { v = mv; c = mc->value; }
+        }
+        if (!v) { rest.push_back(op); continue; }
+        auto it = std::find_if(linear.begin(), linear.end(),
+                               [&](auto& t) { return t.var->name == v->name; });
+        if (it == linear.end()) {
+            linear.push_back({v, c, op});
+        } else {
+            it->coeff += c;
+            it->only = nullptr;
+        }
+    }
+    for (auto& [v, c, only] : linear) {
+        if (c == 0) continue;
+        if (only) rest.push_back(only);
+        else if (c == 1) rest.push_back(V(v->name));
+        else rest.push_back(make_product({V(v->name)}, c));
+    }
+
+    if (rest.empty()) return C(flat->coeff);
+    if (rest.size() == 1 && flat->coeff == 0) return rest[0];
+    if (rest == operands && flat->coeff == coeff) return self();
+    return make_sum(std::move(rest), flat->coeff);
+}
+std::string Sum::to_string() const {
+    std::string s = "(";
+    for (std::size_t i = 0; i < operands.size(); ++i) {
+        if (i) s += " + ";
+        s += operands[i]->to_string();
+    }
+    if (coeff != 0 || operands.empty()) s += std::format("{}{}", operands.empty() ? "" : " + ", coeff);
+    return s + ")";
+}
+
+// --- Product ---
+double Product::evaluate(double val) const {
+    double acc = coeff;
+    for (auto& op : operands) acc *= op->evaluate(val);
+    return acc;
+}
+std::shared_ptr<Expression> Product::derivative() const {
+    // 積の微分: sum_i (f_1 * ... * f_i' * ... * f_n), 微分が 0 の項は省く
+    std::vector<std::shared_ptr<Expression>> terms;
+    for (std::size_t i = 0; i < operands.size(); ++i) {
+        auto d = operands[i]->derivative();
+        if (auto dc = as<Constant>(d.get()); dc && dc->value == 0) continue;
+        auto factors = operands;
+        factors[i] = std::move(d);
+        terms.push_back(make_product(std::move(factors), coeff));
+    }
+    return make_sum(std::move(terms));
+}
+std::shared_ptr<Expression> Product::simplify_uncached() const {
+    std::vector<std::shared_ptr<Expression>> ops;
+    ops.reserve(operands.size());
+    for (auto& op : operands) ops.push_back(op->simplify());
+    auto flat = make_product(std::move(ops), coeff);
+
+    // 底が等しい因子の指数をまとめる (値が変わらないときのみ)
+    std::vector<std::pair<std::shared_ptr<Expression>, double>> powers;
+    for (auto& op : flat->operands) {
+        auto [b, e] = base_exponent(op);
+        auto it = std::find_if(powers.begin(), powers.end(), [&](auto& t) {
+            return can_add_exponents(t.second, e) && structurally_equal(t.first.get(), b.get());
+        });
+        if (it == powers.end()) powers.emplace_back(b, e);
+        else it->second += e;
+    }
+    if (powers.size() < flat->operands.size()) {
+        std::vector<std::shared_ptr<Expression>> merged;
+        for (auto& [b, e] : powers) merged.push_back(e == 1 ? b : make_pow(b, e)->simplify());
+        flat = make_product(std::move(merged), flat->coeff);
+    }
+
+    if (flat->coeff == 0 || flat->operands.empty()) return C(flat->coeff);
+    if (flat->operands.size() == 1 && flat->coeff == 1) return flat->operands[0];
+    if (flat->operands == operands && flat->coeff == coeff) return self();
+    return flat;
+}
+std::string Product::to_string() const {
+    std::string s = "(";
+    if (coeff != 1 || operands.empty()) s += std::format("{}{}", coeff, operands.empty() ? "" : " * ");
+    for (std::size_t i = 0; i < operands.size(); ++i) {
+        if (i) s += " * ";
+        s += operands[i]->to_string();
+    }
+    return s + ")";
+}
+
+
+// --- Pow ---
+double Pow::evaluate(double val) const {
+    return power(base->evaluate(val), exponent);
+}
+std::shared_ptr<Expression> Pow::derivative() const {
+    // (b^n)' = n * b^(n-1) * b'
+    // n = 0 は定数 1 なので 0 (b = 0 で 0 * b^-1 = NaN にしない)
+    if (exponent == 0) return C(0);
+    auto db = base->derivative();
+    if (exponent == 1) return db;
+    return make_product({make_pow(base, exponent - 1), db}, exponent);
+}
+std::shared_ptr<Expression> Pow::simplify_uncached() const {
+    auto b = base->simplify();
+    if (exponent == 0) return C(1);
+    if (exponent == 1) return b;
+    if (auto bc = as<Constant>(b.get())) return C(std::pow(bc->value, exponent));
+    // (b^m)^n -> b^(m*n) は m, n がともに整数のときのみ成り立つ ((x^0.5)^2 は x < 0 で NaN)
+    if (auto bp = as<Pow>(b.get()); bp && is_int_exponent(bp->exponent) && is_int_exponent(exponent))
+        return make_pow(bp->base, bp->exponent * exponent)->simplify();
+    if (b == base) return self();
+    return make_pow(b, exponent);
+}
+std::string Pow::to_string() const {
+    return std::format("({} ^ {})", base->to_string(), exponent);
+}
+
+// 子ノードを順に f へ渡す (children_of と違いベクタを作らない)
+template<typename F>
+void for_each_child(const Expression* e, F&& f) {
+    if (auto b = as<BinaryOp>(e)) {
+        f(b->left);
+        f(b->right);
+    } else if (auto p = as<Pow>(e)) {
+        f(p->base);
+    } else if (auto n = as<NaryOp>(e)) {
+        for (auto& op : n->operands) f(op);
+    } else if (auto d = as<Derivative>(e)) {
+        f(d->inner);
+    }
+}
+
+// 帰りがけ順の畳み込み: f(ノード, 子の値の列) でノードの値を求める. 明示スタックで深い木にも使える.
+// 複数の親から参照されるノード (use_count > 1) だけを覚えておき, それ以外は値のスタックで受け渡す
+template<typename T, typename F>
+T fold_postorder(const std::shared_ptr<Expression>& root, F&& f) {
+    std::unordered_map<const Expression*, T> shared;
+    std::vector<T> values;
+    std::vector<std::pair<const std::shared_ptr<Expression>*, std::size_t>> stack{{&root, SIZE_MAX}};
+    while (!stack.empty()) {
+        auto [node, mark] = stack.back();
+        const Expression* e = node->get();
+        bool is_shared = node->use_count() > 1;
+        if (mark == SIZE_MAX) {
+            if (is_shared) {
+                if (auto it = shared.find(e); it != shared.end()) {
+                    values.push_back(it->second);
+                    stack.pop_back();
+                    continue;
+                }
+            }
+            // 子の値は values の現在の末尾から積まれる. 子は逆順に積んで前から処理する
+            stack.back().second = values.size();
+            std::size_t at = stack.size();
+            for_each_child(e, [&](const std::shared_ptr<Expression>& k) { stack.emplace_back(&k, SIZE_MAX); });
+            std::reverse(stack.begin() + at, stack.end());
+            continue;
+        }
+        stack.pop_back();
+        T v = f(e, std::span<const T>(values).subspan(mark));
+        values.resize(mark);
+        if (is_shared) shared.emplace(e, v);
+        values.push_back(std::move(v));
+    }
+    return values.back();
+}
+
+// 式の構造だけで決まる 128 ビットのハッシュ (独立な 2 つの 64 ビットの混合).
+// ディスクに残すので, 標準ライブラリやビルドによって変わる std::hash は使わない
+struct StructuralHash {
+    std::uint64_t h1 = 0, h2 = 0;
+    bool operator==(const StructuralHash&) const = default;
+    std::string hex() const { return std::format("{:016x}{:016x}", h1, h2); }
+};
+
+StructuralHash structural_hash(const std::shared_ptr<Expression>& root) {
+    auto mix = [](std::uint64_t h, std::uint64_t v) {
+        // splitmix64 の最終段で v をかき混ぜてから畳み込む
+        v += 0x9e3779b97f4a7c15ULL;
+        v = (v ^ (v >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        v = (v ^ (v >> 27)) * 0x94d049bb133111ebULL;
+        v ^= v >> 31;
+        return (h ^ v) * 0x100000001b3ULL + (h >> 29);
+    };
+    return fold_postorder<StructuralHash>(root, [&](const Expression* e, std::span<const StructuralHash> kids) {
+        std::uint64_t tag, scalar = 0;
+        if (auto c = as<Constant>(e)) tag = 1, scalar = std::bit_cast<std::uint64_t>(c->value);
+        else if (auto v = as<Variable>(e)) {
+            // 名前のバイト列の FNV-1a
+            tag = 2, scalar = 0xcbf29ce484222325ULL;
+            for (unsigned char ch : v->name) scalar = (scalar ^ ch) * 0x100000001b3ULL;
+        }
+        else if (as<Add>(e)) tag = 3;
+        else if (as<Multiply>(e)) tag = 4;
+        else if (auto p = as<Pow>(e)) tag = 5, scalar = std::bit_cast<std::uint64_t>(p->exponent);
+        else if (auto s = as<Sum>(e)) tag = 6, scalar = std::bit_cast<std::uint64_t>(s->coeff);
+        else if (auto pr = as<Product>(e)) tag = 7, scalar = std::bit_cast<std::uint64_t>(pr->coeff);
+        else if (as<Derivative>(e)) tag = 8;  // 展開せず, 包んだ式のハッシュから決める
+        else throw std::runtime_error("structural_hash: 未対応のノード: " + e->to_string());
+        StructuralHash h{mix(mix(tag, scalar), kids.size()), mix(mix(tag ^ 0x5bd1e995, scalar), ~kids.size())};
+        for (auto& k : kids) {
+            h.h1 = mix(h.h1, k.h1);
+            h.h2 = mix(h.h2 ^ 0xc2b2ae3d27d4eb4fULL, k.h2);
+        }
+        return h;
+    });
+}
+
 
 //-------------------------------------------------
-// 6. メイン (実行例)
+// 6. 多項式正規形 (1 変数多項式)
 //-------------------------------------------------
-int main() {
-    // f(x) = x + 2x
-    // (x + (2 * x))
-    auto f1 = make_add(V(), make_mul(C(2), V())); // ★ make_add, make_mul
+// 次数が低いか係数が密なら密ベクトル, そうでなければ (次数 -> 係数) の疎な map で持つ.
+// 木の evaluate と同じく, 変数はすべて 1 つの変数 x とみなす.
+struct Polynomial {
+    static constexpr int kDenseMaxDegree = 64;
+    static constexpr int kMaxDegree = 4096;  // from_expression が受け付ける指数の上限
 
-    std::cout << "--- パターン1: (x + 2x) をそのまま微分 -> 簡約化 ---\n";
-    std::cout << "f(x) = " << f1->to_string() << "\n";
+    std::vector<double> dense;      // dense[k] = x^k の係数
+    std::map<int, double> sparse;   // 0 でない係数のみ
+    bool is_sparse = false;
 
-    auto df1 = f1->derivative();
-    std::cout << "f'(x) (微分直後) = " << df1->to_string() << "\n";
+    static Polynomial constant(double c);
+    static Polynomial monomial(double c, int k);
+    static Polynomial from_expression(const Expression& e);
+    std::shared_ptr<Expression> to_expression() const;
 
-    auto df1_simplified = df1->simplify();
-    std::cout << "f'(x) (簡約後)   = " << df1_simplified->to_string() << "\n";
-    
-    std::cout << "\n--- パターン2: (x + 2x) を先に簡約化 -> 微分 ---\n";
-    std::cout << "f(x) = " << f1->to_string() << "\n";
+    int degree() const;
+    std::size_t term_count() const;
+    double coefficient(int k) const;
 
-    auto f1_simplified = f1->simplify();
-    std::cout << "f(x) (簡約後) = " << f1_simplified->to_string() << "\n";
-    
-    auto df1_pre_simplified = f1_simplified->derivative();
-    std::cout << "f'(x) (微分)    = " << df1_pre_simplified->to_string() << "\n";
-    
-    auto df1_final = df1_pre_simplified->simplify();
-    std::cout << "f'(x) (最終簡約) = " << df1_final->to_string() << "\n";
+    Polynomial derivative() const;
+    double evaluate(double x) const;          // Horner 法
+    double evaluate_estrin(double x) const;   // Estrin 法 (依存鎖が log(次数) 段)
+    void evaluate_batch(std::span<const double> xs, std::span<double> out) const;
+    std::string to_string() const;
 
-    std::cout << "\n--- 別の例 (g(x) = x*x) ---\n";
-    // g(x) = x * x
-    auto g = make_mul(V(), V()); // ★ make_mul
-    std::cout << "g(x) = " << g->to_string() << "\n";
-    
-    auto dg = g->derivative();
-    std::cout << "g'(x) (微分直後) = " << dg->to_string() << "\n";
-    
-    auto dg_simplified = dg->simplify();
-    std::cout << "g'(x) (簡約後)   = " << dg_simplified->to_string() << "\n";
-    
-    std::cout << "g'(x) at x=5 (評価): " << dg_simplified->evaluate(5) << "\n";
+    // 次数と非零項の数から表現を選び直す
+    void normalize();
+};
+
+Polynomial operator+(const Polynomial& a, const Polynomial& b);
+Polynomial operator*(const Polynomial& a, const Polynomial& b);
+
+Polynomial Polynomial::constant(double c) { return monomial(c, 0); }
+Polynomial Polynomial::monomial(double c, int k) {
+    Polynomial p;
+    p.is_sparse = true;
+    if (c != 0) p.sparse[k] = c;
+    p.normalize();
+    return p;
+}
+
+void Polynomial::normalize() {
+    std::size_t nonzero = 0;
+    int deg = -1;
+    if (is_sparse) {
+        std::erase_if(sparse, [](auto& t) { return t.second == 0; });
+        nonzero = sparse.size();
+        if (!sparse.empty()) deg = sparse.rbegin()->first;
+    } else {
+        while (!dense.empty() && dense.back() == 0) dense.pop_back();
+        deg = static_cast<int>(dense.size()) - 1;
+        nonzero = static_cast<std::size_t>(std::count_if(dense.begin(), dense.end(), [](double c) { return c != 0; }));
+    }
+    bool want_sparse = deg > kDenseMaxDegree && nonzero * 4 < static_cast<std::size_t>(deg + 1);
+    if (want_sparse && !is_sparse) {
+        for (int k = 0; k <= deg; ++k)
+            if (dense[k] != 0) sparse[k] = dense[k];
+        dense.clear();
+        dense.shrink_to_fit();
+    } else if (!want_sparse && is_sparse) {
+        dense.assign(deg + 1, 0.0);
+        for (auto& [k, c] : sparse) dense[k] = c;
+        sparse.clear();
+    }
+    is_sparse = want_sparse;
+}
+
+int Polynomial::degree() const {
+    if (is_sparse) return sparse.empty() ? -1 : sparse.rbegin()->first;
+    return static_cast<int>(dense.size()) - 1;
+}
+std::size_t Polynomial::term_count() const {
+    if (is_sparse) return sparse.size();
+    return static_cast<std::size_t>(std::count_if(dense.begin(), dense.end(), [](double c) { return c != 0; }));
+}
+double Polynomial::coefficient(int k) const {
+    if (is_sparse) {
+        auto it = sparse.find(k);
+        return it == sparse.end() ? 0.0 : it->second;
+    }
+    return k >= 0 && k < static_cast<int>(dense.size()) ? dense[k] : 0.0;
+}
+
+Polynomial operator+(const Polynomial& a, const Polynomial& b) {
+    Polynomial r;
+    if (!a.is_sparse && !b.is_sparse) {
+        r.dense.assign(std::max(a.dense.size(), b.dense.size()), 0.0);
+        for (std::size_t k = 0; k < a.dense.size(); ++k) r.dense[k] += a.dense[k];
+        for (std::size_t k = 0; k < b.dense.size(); ++k) r.dense[k] += b.dense[k];
+    } else {
+        r.is_sparse = true;
+        for (auto* p : {&a, &b}) {
+            if (p->is_sparse) for (auto& [k, c] : p->sparse) r.sparse[k] += c;
+            else for (std::size_t k = 0; k < p->dense.size(); ++k)
+                if (p->dense[k] != 0) r.sparse[static_cast<int>(k)] += p->dense[k];
+        }
+    }
+    r.normalize();
+    return r;
+}
+
+Polynomial operator*(const Polynomial& a, const Polynomial& b) {
+    Polynomial r;
+    if (a.degree() < 0 || b.degree() < 0) return r;
+    if (!a.is_sparse && !b.is_sparse) {
+        r.dense.assign(a.dense.size() + b.dense.size() - 1, 0.0);
+        for (std::size_t i = 0; i < a.dense.size(); ++i) {
+            if (a.dense[i] == 0) continue;
+            for (std::size_t j = 0; j < b.dense.size(); ++j) r.dense[i + j] += a.dense[i] * b.dense[j];
+        }
+    } else {
+        auto terms = [](const Polynomial& p) {
+            std::vector<std::pair<int, double>> t;
+            if (p.is_sparse) t.assign(p.sparse.begin(), p.sparse.end());
+            else for (std::size_t k = 0; k < p.dense.size(); ++k)
+                if (p.dense[k] != 0) t.emplace_back(static_cast<int>(k), p.dense[k]);
+            return t;
+        };
+        r.is_sparse = true;
+        auto tb = terms(b);
+        for (auto& [i, ci] : terms(a))
+            for (auto& [j, cj] : tb) r.sparse[i + j] += ci * cj;
+    }
+    r.normalize();
+    return r;
+}
+
+Polynomial Polynomial::from_expression(const Expression& e) {
+    if (auto c = as<Constant>(&e)) return constant(c->value);
+    if (as<Variable>(&e)) return monomial(1, 1);
+    if (auto a = as<Add>(&e)) return from_expression(*a->left) + from_expression(*a->right);
+    if (auto m = as<Multiply>(&e)) return from_expression(*m->left) * from_expression(*m->right);
+    if (auto s = as<Sum>(&e)) {
+        auto p = constant(s->coeff);
+        for (auto& op : s->operands) p = p + from_expression(*op);
+        return p;
+    }
+    if (auto pr = as<Product>(&e)) {
+        auto p = constant(pr->coeff);
+        for (auto& op : pr->operands) p = p * from_expression(*op);
+        return p;
+    }
+    if (auto pw = as<Pow>(&e); pw && pw->exponent >= 0 && pw->exponent == std::trunc(pw->exponent)) {
+        // 整数へ変換する前に範囲を確かめる (1e300 などを int にするのは未定義動作)
+        if (pw->exponent > kMaxDegree)
+            throw std::runtime_error("Polynomial::from_expression: 指数が大きすぎる: " + e.to_string());
+        auto b = from_expression(*pw->base);
+        if (b.term_count() == 1 && b.degree() == 1 && b.coefficient(1) == 1)
+            return monomial(1, static_cast<int>(pw->exponent));
+        auto p = constant(1);
+        for (auto n = static_cast<unsigned>(pw->exponent); n; n >>= 1) {
+            if (n & 1) p = p * b;
+            if (n > 1) b = b * b;
+        }
+        return p;
+    }
+    throw std::runtime_error("Polynomial::from_expression: 多項式でない式: " + e.to_string());
+}
+
+// Horner 形の木 c0 + x * (c1 + x * (...)) に戻す. 係数 0 の段は x^k にまとめる.
+std::shared_ptr<Expression> Polynomial::to_expression() const {
+    std::vector<std::pair<int, double>> terms;
+    if (is_sparse) terms.assign(sparse.rbegin(), sparse.rend());
+    else for (int k = degree(); k >= 0; --k)
+        if (dense[k] != 0) terms.emplace_back(k, dense[k]);
+    if (terms.empty()) return C(0);
+
+    std::shared_ptr<Expression> e = C(terms[0].second);
+    for (std::size_t i = 0; i < terms.size(); ++i) {
+        int next = i + 1 < terms.size() ? terms[i + 1].first : 0;
+        int gap = terms[i].first - next;
+        if (gap == 1) e = make_product({V(), e});
+        else if (gap > 1) e = make_product({make_pow(V(), gap), e});
+        if (i + 1 < terms.size()) e = make_sum({e}, terms[i + 1].second);
+    }
+    return e->simplify();
+}
+
+Polynomial Polynomial::derivative() const {
+    Polynomial d;
+    d.is_sparse = is_sparse;
+    if (is_sparse) {
+        for (auto& [k, c] : sparse)
+            if (k > 0) d.sparse[k - 1] = c * k;
+    } else if (dense.size() > 1) {
+        d.dense.resize(dense.size() - 1);
+        for (std::size_t k = 1; k < dense.size(); ++k) d.dense[k - 1] = dense[k] * static_cast<double>(k);
+    }
+    d.normalize();
+    return d;
+}
+
+double Polynomial::evaluate(double x) const {
+    if (is_sparse) {
+        // 疎な Horner: 隣り合う項の次数差ぶんを二乗法で掛ける
+        double acc = 0;
+        int prev = degree();
+        for (auto it = sparse.rbegin(); it != sparse.rend(); ++it) {
+            acc = acc * ipow(x, static_cast<unsigned>(prev - it->first)) + it->second;
+            prev = it->first;
+        }
+        return acc * ipow(x, static_cast<unsigned>(prev));
+    }
+    double acc = 0;
+    for (auto it = dense.rbegin(); it != dense.rend(); ++it) acc = acc * x + *it;
+    return acc;
+}
+
+double Polynomial::evaluate_estrin(double x) const {
+    if (is_sparse) return evaluate(x);
+    // 隣り合う 2 項を b = c[2i] + c[2i+1] * x^(2^level) で畳んでいく
+    std::vector<double> b(dense);
+    double xp = x;
+    while (b.size() > 1) {
+        std::size_t half = (b.size() + 1) / 2;
+        for (std::size_t i = 0; i < half; ++i) {
+            double hi = 2 * i + 1 < b.size() ? b[2 * i + 1] : 0.0;
+            b[i] = b[2 * i] + hi * xp;
+        }
+        b.resize(half);
+        xp *= xp;
+    }
+    return b.empty() ? 0.0 : b[0];
+}
+
+// kLanes 個の点をまとめて Horner で評価する. レーン方向の内側ループは自動ベクトル化される.
+void Polynomial::evaluate_batch(std::span<const double> xs, std::span<double> out) const {
+    constexpr std::size_t kLanes = 8;
+    std::size_t i = 0;
+    if (!is_sparse) {
+        for (; i + kLanes <= xs.size(); i += kLanes) {
+            double acc[kLanes] = {};
+            for (auto it = dense.rbegin(); it != dense.rend(); ++it) {
+                double c = *it;
+                for (std::size_t l = 0; l < kLanes; ++l) acc[l] = acc[l] * xs[i + l] + c;
+            }
+            for (std::size_t l = 0; l < kLanes; ++l) out[i + l] = acc[l];
+        }
+    }
+    for (; i < xs.size(); ++i) out[i] = evaluate(xs[i]);
+}
+
+std::string Polynomial::to_string() const {
+    std::string s;
+    for (int k = degree(); k >= 0; --k) {
+        double c = coefficient(k);
+        if (c == 0) continue;
+        if (!s.empty()) s += " + ";
+        if (k == 0) s += std::format("{}", c);
+        else if (k == 1) s += std::format("{}x", c);
+        else s += std::format("{}x^{}", c, k);
+    }
+    return s.empty() ? "0" : s;
+}
+
+//-------------------------------------------------
+// 7. 不動点までの簡約 (ワークリスト)
+//-------------------------------------------------
+// simplify() は 1 パスなので, 親の規則が子の簡約結果で初めて適用可能になる場合は
+// 呼び出しを繰り返す必要がある. ここでは明示スタックで帰りがけ順に処理し,
+//   - 子がすべて正規形になってから親に規則を適用する
+//   - 規則が新しいノードを返したら, そのノードを (未処理の部分だけ) 処理し直す
+//   - 正規形と記録済みのノード, 処理済みのノードは再訪しない
+// ことで 1 回の呼び出しで不動点に到達する.
+std::shared_ptr<Expression> simplify_fixpoint(const std::shared_ptr<Expression>& root) {
+    // 処理済みノード -> 正規形. 途中で生成したノードのアドレスが再利用されないよう, キーのノードも保持する
+    std::unordered_map<const Expression*, std::pair<std::shared_ptr<Expression>, std::shared_ptr<Expression>>> done;
+    auto lookup = [&](const std::shared_ptr<Expression>& e) -> std::shared_ptr<Expression> {
+        if (e->in_normal_form.load(std::memory_order_acquire)) return e;
+        auto it = done.find(e.get());
+        return it == done.end() ? nullptr : it->second.second;
+    };
+    auto finish = [&](const std::shared_ptr<Expression>& node, const std::shared_ptr<Expression>& r) {
+        done.emplace(node.get(), std::pair{node, r});
+        node->simplify_cache.store(r, std::memory_order_release);
+    };
+
+    struct Frame {
+        std::shared_ptr<Expression> node;
+        bool expanded = false;
+        std::shared_ptr<Expression> replacement = nullptr;  // 規則が返した未処理のノード
+    };
+    std::vector<Frame> work{{root}};
+    while (!work.empty()) {
+        auto& f = work.back();
+        if (f.replacement) {
+            finish(f.node, lookup(f.replacement));
+            work.pop_back();
+            continue;
+        }
+        if (lookup(f.node)) {
+            work.pop_back();
+            continue;
+        }
+        auto kids = children_of(f.node.get());
+        if (!f.expanded) {
+            f.expanded = true;
+            // push_back で f は無効になる
+            for (auto& k : kids)
+                if (!lookup(k)) work.push_back({k});
+            continue;
+        }
+
+        bool changed = false;
+        for (auto& k : kids) {
+            auto nk = lookup(k);
+            changed |= nk != k;
+            k = std::move(nk);
+        }
+        auto n = changed ? with_children(f.node, std::move(kids)) : f.node;
+        auto r = n->simplify_uncached();
+        if (r == n) {
+            n->in_normal_form.store(true, std::memory_order_release);
+            if (n != f.node) finish(f.node, n);
+            work.pop_back();
+        } else if (auto nr = lookup(r)) {
+            finish(f.node, nr);
+            work.pop_back();
+        } else {
+            f.replacement = r;
+            work.push_back({r});
+        }
+    }
+    return lookup(root);
+}
+
+//-------------------------------------------------
+// 8. 書き換え規則 DSL
+//-------------------------------------------------
+// 規則は "(c1 * ?a) + (c2 * ?a) -> (c1 + c2) * ?a" のような文字列で書く.
+//   ?a, ?b ... : 任意の部分式 (同じ名前は構造的に等しくなければならない)
+//   c1, c2 ... : 任意の定数
+//   数値       : その値の定数
+//   その他の名前: その名前の変数
+// 演算子は + と * (左結合) と ^ (右辺は数値のみ). 二分木の Add/Multiply/Pow に照合する.
+// 右辺で定数どうしの + と * はその場で畳み込む.
+struct Pattern {
+    enum class Kind { Any, AnyConst, Literal, Var, Add, Mul, Pow };
+    Kind kind;
+    std::string name;   // Any/AnyConst/Var
+    double value = 0;   // Literal の値, Pow の指数
+    std::vector<Pattern> kids = {};
+
+    static Pattern parse(std::string_view src);
+    std::string to_string() const;
+};
+
+namespace pattern_parser {
+struct Parser {
+    std::string_view src;
+    std::size_t pos = 0;
+
+    [[noreturn]] void fail(const std::string& what) const {
+        throw std::runtime_error(std::format("規則の構文エラー ({} 文字目): {}: {}", pos, what, std::string(src)));
+    }
+    void skip_space() { while (pos < src.size() && src[pos] == ' ') ++pos; }
+    bool eat(char c) {
+        skip_space();
+        if (pos < src.size() && src[pos] == c) { ++pos; return true; }
+        return false;
+    }
+    double number() {
+        skip_space();
+        std::size_t start = pos;
+        if (pos < src.size() && src[pos] == '-') ++pos;
+        while (pos < src.size() && (std::isdigit(static_cast<unsigned char>(src[pos])) || src[pos] == '.')) ++pos;
+        // 字句全体が 1 つの数でなければならない ("1.2.3" や "-." は誤り)
+        auto token = src.substr(start, pos - start);
+        double v = 0;
+        auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), v);
+        if (token.empty() || ec != std::errc() || end != token.data() + token.size()) fail("数値が必要");
+        return v;
+    }
+    std::string ident() {
+        std::size_t start = pos;
+        while (pos < src.size() && (std::isalnum(static_cast<unsigned char>(src[pos])) || src[pos] == '_')) ++pos;
+        if (pos == start) fail("名前が必要");
+        return std::string(src.substr(start, pos - start));
+    }
+    Pattern atom() {
+        skip_space();
+        if (eat('(')) {
+            auto p = sum();
+            if (!eat(')')) fail("')' が必要");
+            return p;
+        }
+        if (eat('?')) return {Pattern::Kind::Any, ident()};
+        if (pos < src.size() && (std::isdigit(static_cast<unsigned char>(src[pos])) || src[pos] == '-'))
+            return {Pattern::Kind::Literal, "", number()};
+        auto name = ident();
+        bool is_const = name.size() > 1 && name[0] == 'c' &&
+                        std::all_of(name.begin() + 1, name.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); });
+        return {is_const ? Pattern::Kind::AnyConst : Pattern::Kind::Var, name};
+    }
+    Pattern power() {
+        auto p = atom();
+        if (eat('^')) return {Pattern::Kind::Pow, "", number(), {std::move(p)}};
+        return p;
+    }
+    Pattern product() {
+        auto p = power();
+        while (eat('*')) p = {Pattern::Kind::Mul, "", 0, {std::move(p), power()}};
+        return p;
+    }
+    Pattern sum() {
+        auto p = product();
+        while (eat('+')) p = {Pattern::Kind::Add, "", 0, {std::move(p), product()}};
+        return p;
+    }
+};
+}  // namespace pattern_parser
+
+Pattern Pattern::parse(std::string_view src) {
+    pattern_parser::Parser p{src};
+    auto pat = p.sum();
+    p.skip_space();
+    if (p.pos != src.size()) p.fail("余分な文字");
+    return pat;
+}
+
+std::string Pattern::to_string() const {
+    switch (kind) {
+    case Kind::Any: return "?" + name;
+    case Kind::AnyConst:
+    case Kind::Var: return name;
+    case Kind::Literal: return std::format("{}", value);
+    case Kind::Add: return std::format("({} + {})", kids[0].to_string(), kids[1].to_string());
+    case Kind::Mul: return std::format("({} * {})", kids[0].to_string(), kids[1].to_string());
+    case Kind::Pow: return std::format("({} ^ {})", kids[0].to_string(), value);
+    }
+    return "";
+}
+
+struct RewriteRule {
+    std::string source;
+    Pattern lhs, rhs;
+    std::vector<std::string> slots;  // 左辺を前順に見たときの束縛位置ごとの名前
+};
+
+// 規則集合. 左辺を前順の記号列にして共有接頭辞をまとめた決定木 (discrimination tree) に
+// コンパイルし, 対象の式の各ノードを木をたどりながら 1 度ずつ調べて照合する.
+// 複数の規則が一致した場合は先に追加した規則を優先する.
+struct RuleSet {
+    struct TrieNode {
+        int add = -1, mul = -1, any = -1, any_const = -1;
+        std::unordered_map<double, int> literal;
+        std::unordered_map<double, int> pow;
+        std::unordered_map<std::string, int> var;
+        std::vector<int> rules;            // ここで左辺が終わる規則 (昇順)
+        int min_rule = INT_MAX;            // この部分木で一致しうる最小の規則番号 (枝刈り用)
+    };
+
+    std::vector<RewriteRule> rules;
+    std::vector<TrieNode> trie{TrieNode{}};
+
+    RuleSet() = default;
+    RuleSet(std::initializer_list<std::string_view> srcs) { for (auto s : srcs) add(s); }
+
+    void add(std::string_view src);
+    // 根で一致する規則を適用した結果. どの規則も一致しなければ nullptr
+    std::shared_ptr<Expression> rewrite(const Expression* e) const;
+    // 比較用: 規則を先頭から 1 つずつ照合する素朴な実装
+    std::shared_ptr<Expression> rewrite_linear(const Expression* e) const;
+    // 帰りがけ順に各ノードで規則がなくなるまで書き換える
+    std::shared_ptr<Expression> rewrite_bottom_up(const std::shared_ptr<Expression>& e) const;
+
+private:
+    using Binds = std::vector<const Expression*>;
+    void match(int node, std::vector<const Expression*>& pending, Binds& binds, int& best, Binds& best_binds) const;
+    bool consistent(const RewriteRule& r, const Binds& binds) const;
+    std::shared_ptr<Expression> instantiate(const RewriteRule& r, const Pattern& p, const Binds& binds) const;
+};
+
+void RuleSet::add(std::string_view src) {
+    auto arrow = src.find("->");
+    if (arrow == std::string_view::npos) throw std::runtime_error("規則に '->' がない: " + std::string(src));
+    RewriteRule r{std::string(src), Pattern::parse(src.substr(0, arrow)), Pattern::parse(src.substr(arrow + 2)), {}};
+    int id = static_cast<int>(rules.size());
+
+    // 右辺の ?a と c1 は左辺で束縛されていなければならない (適用時ではなく追加時に弾く)
+    std::vector<const Pattern*> lhs{&r.lhs}, rhs{&r.rhs};
+    std::vector<std::string> bound;
+    while (!lhs.empty()) {
+        const Pattern* p = lhs.back();
+        lhs.pop_back();
+        if (p->kind == Pattern::Kind::Any || p->kind == Pattern::Kind::AnyConst) bound.push_back(p->name);
+        for (auto& k : p->kids) lhs.push_back(&k);
+    }
+    while (!rhs.empty()) {
+        const Pattern* p = rhs.back();
+        rhs.pop_back();
+        if ((p->kind == Pattern::Kind::Any || p->kind == Pattern::Kind::AnyConst) &&
+            std::find(bound.begin(), bound.end(), p->name) == bound.end())
+            throw std::runtime_error("右辺の " + p->to_string() + " が左辺で束縛されていない: " + r.source);
+        for (auto& k : p->kids) rhs.push_back(&k);
+    }
+
+    // 左辺を前順にたどって決定木に挿入する
+    int node = 0;
+    std::vector<const Pattern*> stack{&r.lhs};
+    while (!stack.empty()) {
+        const Pattern* p = stack.back();
+        stack.pop_back();
+        trie[node].min_rule = std::min(trie[node].min_rule, id);
+        // edge は trie の要素の中を指すので, emplace_back で無効になる前に値を確定させる
+        auto step = [&](int& edge) {
+            if (edge >= 0) return edge;
+            int idx = static_cast<int>(trie.size());
+            edge = idx;
+            trie.emplace_back();
+            return idx;
+        };
+        int next = -1;
+        switch (p->kind) {
+        case Pattern::Kind::Any:      r.slots.push_back(p->name); next = step(trie[node].any); break;
+        case Pattern::Kind::AnyConst: r.slots.push_back(p->name); next = step(trie[node].any_const); break;
+        case Pattern::Kind::Literal:  next = step(trie[node].literal.try_emplace(p->value, -1).first->second); break;
+        case Pattern::Kind::Var:      next = step(trie[node].var.try_emplace(p->name, -1).first->second); break;
+        case Pattern::Kind::Pow:      next = step(trie[node].pow.try_emplace(p->value, -1).first->second); break;
+        case Pattern::Kind::Add:      next = step(trie[node].add); break;
+        case Pattern::Kind::Mul:      next = step(trie[node].mul); break;
+        }
+        for (auto it = p->kids.rbegin(); it != p->kids.rend(); ++it) stack.push_back(&*it);
+        node = next;
+    }
+    trie[node].min_rule = std::min(trie[node].min_rule, id);
+    trie[node].rules.push_back(id);
+    rules.push_back(std::move(r));
+}
+
+void RuleSet::match(int node, std::vector<const Expression*>& pending, Binds& binds, int& best, Binds& best_binds) const {
+    if (node < 0 || trie[node].min_rule >= best) return;
+    const auto& t = trie[node];
+    if (pending.empty()) {
+        for (int id : t.rules) {
+            if (id >= best) break;
+            if (consistent(rules[id], binds)) {
+                best = id;
+                best_binds = binds;
+                break;
+            }
+        }
+        return;
+    }
+
+    const Expression* s = pending.back();
+    pending.pop_back();
+    if (auto b = as<BinaryOp>(s)) {
+        int edge = as<Add>(s) ? t.add : t.mul;
+        if (edge >= 0) {
+            pending.push_back(b->right.get());
+            pending.push_back(b->left.get());
+            match(edge, pending, binds, best, best_binds);
+            pending.resize(pending.size() - 2);
+        }
+    } else if (auto c = as<Constant>(s)) {
+        if (auto it = t.literal.find(c->value); it != t.literal.end()) match(it->second, pending, binds, best, best_binds);
+        if (t.any_const >= 0) {
+            binds.push_back(s);
+            match(t.any_const, pending, binds, best, best_binds);
+            binds.pop_back();
+        }
+    } else if (auto v = as<Variable>(s)) {
+        if (auto it = t.var.find(v->name); it != t.var.end()) match(it->second, pending, binds, best, best_binds);
+    } else if (auto p = as<Pow>(s)) {
+        if (auto it = t.pow.find(p->exponent); it != t.pow.end()) {
+            pending.push_back(p->base.get());
+            match(it->second, pending, binds, best, best_binds);
+            pending.pop_back();
+        }
+    }
+    if (t.any >= 0) {
+        binds.push_back(s);
+        match(t.any, pending, binds, best, best_binds);
+        binds.pop_back();
+    }
+    pending.push_back(s);
+}
+
+bool RuleSet::consistent(const RewriteRule& r, const Binds& binds) const {
+    for (std::size_t i = 0; i < r.slots.size(); ++i)
+        for (std::size_t j = i + 1; j < r.slots.size(); ++j)
+            if (r.slots[i] == r.slots[j] && !structurally_equal(binds[i], binds[j])) return false;
+    return true;
+}
+
+std::shared_ptr<Expression> RuleSet::instantiate(const RewriteRule& r, const Pattern& p, const Binds& binds) const {
+    switch (p.kind) {
+    case Pattern::Kind::Any:
+    case Pattern::Kind::AnyConst: {
+        auto it = std::find(r.slots.begin(), r.slots.end(), p.name);
+        if (it == r.slots.end()) throw std::runtime_error("右辺の " + p.name + " が左辺で束縛されていない: " + r.source);
+        return binds[it - r.slots.begin()]->self();
+    }
+    case Pattern::Kind::Literal: return C(p.value);
+    case Pattern::Kind::Var: return V(p.name);
+    case Pattern::Kind::Pow: return make_pow(instantiate(r, p.kids[0], binds), p.value);
+    case Pattern::Kind::Add:
+    case Pattern::Kind::Mul: {
+        auto l = instantiate(r, p.kids[0], binds);
+        auto rr = instantiate(r, p.kids[1], binds);
+        auto lc = as<Constant>(l.get());
+        auto rc = as<Constant>(rr.get());
+        bool add = p.kind == Pattern::Kind::Add;
+        if (lc && rc) return C(add ? lc->value + rc->value : lc->value * rc->value);
+        if (add) return make_add(l, rr);
+        return make_mul(l, rr);
+    }
+    }
+    return nullptr;
+}
+
+std::shared_ptr<Expression> RuleSet::rewrite(const Expression* e) const {
+    std::vector<const Expression*> pending{e};
+    Binds binds, best_binds;
+    int best = INT_MAX;
+    match(0, pending, binds, best, best_binds);
+    if (best == INT_MAX) return nullptr;
+    return instantiate(rules[best], rules[best].rhs, best_binds);
+}
+
+// 1 つのパターンを 1 つの式に照合し, 束縛を前順で binds に積む
+bool match_pattern(const Pattern& p, const Expression* e, std::vector<const Expression*>& binds) {
+    switch (p.kind) {
+    case Pattern::Kind::Any: binds.push_back(e); return true;
+    case Pattern::Kind::AnyConst:
+        if (!as<Constant>(e)) return false;
+        binds.push_back(e);
+        return true;
+    case Pattern::Kind::Literal: {
+        auto c = as<Constant>(e);
+        return c && c->value == p.value;
+    }
+    case Pattern::Kind::Var: {
+        auto v = as<Variable>(e);
+        return v && v->name == p.name;
+    }
+    case Pattern::Kind::Pow: {
+        auto pw = as<Pow>(e);
+        return pw && pw->exponent == p.value && match_pattern(p.kids[0], pw->base.get(), binds);
+    }
+    case Pattern::Kind::Add:
+    case Pattern::Kind::Mul: {
+        const BinaryOp* b = p.kind == Pattern::Kind::Add ? static_cast<const BinaryOp*>(as<Add>(e))
+                                                         : static_cast<const BinaryOp*>(as<Multiply>(e));
+        return b && match_pattern(p.kids[0], b->left.get(), binds) && match_pattern(p.kids[1], b->right.get(), binds);
+    }
+    }
+    return false;
+}
+
+std::shared_ptr<Expression> RuleSet::rewrite_linear(const Expression* e) const {
+    Binds binds;
+    for (auto& r : rules) {
+        binds.clear();
+        if (match_pattern(r.lhs, e, binds) && consistent(r, binds)) return instantiate(r, r.rhs, binds);
+    }
+    return nullptr;
+}
+
+std::shared_ptr<Expression> RuleSet::rewrite_bottom_up(const std::shared_ptr<Expression>& e) const {
+    auto kids = children_of(e.get());
+    bool changed = false;
+    for (auto& k : kids) {
+        auto nk = rewrite_bottom_up(k);
+        changed |= nk != k;
+        k = std::move(nk);
+    }
+    auto n = changed ? with_children(e, std::move(kids)) : e;
+    // 右辺が新たな一致を生むことがあるので, 根で規則がなくなるまで繰り返す
+    constexpr int kMaxSteps = 64;
+    for (int i = 0; i < kMaxSteps; ++i) {
+        auto r = rewrite(n.get());
+        if (!r) break;
+        n = rewrite_bottom_up(r);
+    }
+    return n;
+}
+
+// 既存の Add::simplify / Multiply::simplify と同等の規則 (を一般化したもの)
+const RuleSet& builtin_rules() {
+    static const RuleSet* rules = new RuleSet{
+        "c1 + c2 -> c1 + c2",
+        "?a + 0 -> ?a",
+        "0 + ?a -> ?a",
+        "(c1 * ?a) + (c2 * ?a) -> (c1 + c2) * ?a",
+        "?a + (c1 * ?a) -> (1 + c1) * ?a",
+        "(c1 * ?a) + ?a -> (c1 + 1) * ?a",
+        "?a + ?a -> 2 * ?a",
+        "c1 * c2 -> c1 * c2",
+        "c1 * (c2 * ?a) -> (c1 * c2) * ?a",
+        "?a * 0 -> 0",
+        "0 * ?a -> 0",
+        "?a * 1 -> ?a",
+        "1 * ?a -> ?a",
+        "?a * ?a -> ?a ^ 2",
+    };
+    return *rules;
+}
+
+//-------------------------------------------------
+// 9. 共通因数のくくり出し (多変数 Horner)
+//-------------------------------------------------
+// 乗算の回数 (整数べきは二乗法の回数, 実数べきは 1 回) と加算の回数
+struct OpCount {
+    std::size_t mul = 0;
+    std::size_t add = 0;
+};
+
+OpCount count_ops(const Expression* root) {
+    OpCount n;
+    std::vector<const Expression*> stack{root};
+    while (!stack.empty()) {
+        auto e = stack.back();
+        stack.pop_back();
+        if (as<Multiply>(e)) ++n.mul;
+        else if (as<Add>(e)) ++n.add;
+        else if (auto p = as<Product>(e)) n.mul += p->operands.size() - 1 + (p->coeff != 1 && !p->operands.empty());
+        else if (auto s = as<Sum>(e)) n.add += s->operands.size() - 1 + (s->coeff != 0 && !s->operands.empty());
+        else if (auto pw = as<Pow>(e)) {
+            if (!is_int_exponent(pw->exponent)) n.mul += 1;
+            else if (auto k = static_cast<unsigned>(std::abs(pw->exponent)); k > 1)
+                n.mul += std::bit_width(k) - 1 + std::popcount(k) - 1;
+        }
+        // 遅延微分は包んだ式ではなく展開した導関数の演算を数える
+        for (auto& k : expanded_children_of(e)) stack.push_back(k.get());
+    }
+    return n;
+}
+
+// 和を 単項 (係数 * prod base^exponent) の並びとして扱い, 最も多くの項に現れる底を
+// 貪欲にくくり出す: sum = b^m * (b を含む項 / b^m) + (残りの項). 両側を再帰的に処理する.
+namespace horner_detail {
+// 底は構造ハッシュで同一視する (項を作るときに 1 度だけ求める. 128 ビットなので偶然の衝突は無視できる)
+struct Factor {
+    std::shared_ptr<Expression> base;
+    double exponent;
+    StructuralHash key;
+};
+struct Term {
+    double coeff = 1;
+    std::vector<Factor> factors;
+};
+struct KeyHash {
+    std::size_t operator()(const StructuralHash& h) const { return static_cast<std::size_t>(h.h1); }
+};
+
+Term to_term(const std::shared_ptr<Expression>& e) {
+    Term t;
+    auto push = [&](const std::shared_ptr<Expression>& f) {
+        auto [b, k] = base_exponent(f);
+        t.factors.push_back({b, k, structural_hash(b)});
+    };
+    if (auto p = as<Product>(e.get())) {
+        t.coeff = p->coeff;
+        for (auto& op : p->operands) push(op);
+    } else if (auto c = as<Constant>(e.get())) {
+        t.coeff = c->value;
+    } else {
+        push(e);
+    }
+    return t;
+}
+
+std::shared_ptr<Expression> from_term(const Term& t) {
+    std::vector<std::shared_ptr<Expression>> fs;
+    for (auto& f : t.factors) fs.push_back(f.exponent == 1 ? f.base : make_pow(f.base, f.exponent));
+    if (fs.empty()) return C(t.coeff);
+    if (fs.size() == 1 && t.coeff == 1) return fs[0];
+    return make_product(std::move(fs), t.coeff);
+}
+
+std::shared_ptr<Expression> horner(std::vector<Term> terms) {
+    if (terms.empty()) return C(0);
+    // 底ごとに, 正の指数で現れる項の数と最小の指数を数える
+    struct Use { std::shared_ptr<Expression> base; StructuralHash key; std::size_t count = 0; double min_exp = 0; };
+    std::vector<Use> uses;
+    std::unordered_map<StructuralHash, std::size_t, KeyHash> index;
+    for (auto& t : terms) {
+        for (auto& f : t.factors) {
+            if (f.exponent <= 0) continue;
+            auto [it, fresh] = index.try_emplace(f.key, uses.size());
+            if (fresh) uses.push_back({f.base, f.key, 0, f.exponent});
+            auto& u = uses[it->second];
+            ++u.count;
+            u.min_exp = std::min(u.min_exp, f.exponent);
+        }
+    }
+    auto best = std::max_element(uses.begin(), uses.end(), [](auto& a, auto& b) { return a.count < b.count; });
+    if (best == uses.end() || best->count < 2) {
+        std::vector<std::shared_ptr<Expression>> ops;
+        for (auto& t : terms) ops.push_back(from_term(t));
+        return ops.size() == 1 ? ops[0] : make_sum(std::move(ops))->simplify();
+    }
+
+    std::vector<Term> with, without;
+    for (auto& t : terms) {
+        auto it = std::find_if(t.factors.begin(), t.factors.end(),
+                               [&](auto& f) { return f.exponent > 0 && f.key == best->key; });
+        if (it == t.factors.end()) {
+            without.push_back(std::move(t));
+            continue;
+        }
+        it->exponent -= best->min_exp;
+        if (it->exponent == 0) t.factors.erase(it);
+        with.push_back(std::move(t));
+    }
+    auto factor = best->min_exp == 1 ? best->base : make_pow(best->base, best->min_exp);
+    auto inner = make_product({factor, horner(std::move(with))})->simplify();
+    if (without.empty()) return inner;
+    return make_sum({inner, horner(std::move(without))})->simplify();
+}
+}  // namespace horner_detail
+
+// 部分木を帰りがけ順に処理し, 和を見つけたら共通因数をくくり出す.
+// 入力は平坦化と簡約をしてから扱う (二分木の Add/Multiply は Sum/Product になる).
+std::shared_ptr<Expression> factor_common(const std::shared_ptr<Expression>& e) {
+    auto rec = [](auto&& self, const std::shared_ptr<Expression>& n) -> std::shared_ptr<Expression> {
+        auto kids = children_of(n.get());
+        for (auto& k : kids) k = self(self, k);
+        auto m = kids.empty() ? n : with_children(n, std::move(kids));
+        auto s = as<Sum>(m.get());
+        if (!s || s->operands.size() < 2) return m;
+        std::vector<horner_detail::Term> terms;
+        for (auto& op : s->operands) terms.push_back(horner_detail::to_term(op));
+        auto h = horner_detail::horner(std::move(terms));
+        if (s->coeff != 0) h = make_sum({h}, s->coeff);
+        return count_ops(h.get()).mul < count_ops(m.get()).mul ? h : m;
+    };
+    return rec(rec, simplify_fixpoint(flatten(e)));
+}
+
+//-------------------------------------------------
+// 10. コストモデルと評価速度のための簡約
+//-------------------------------------------------
+// 木を evaluate() でたどるときの見積もり. 共有された部分木は訪れるたびに数える.
+struct Cost {
+    double latency = 0;              // 予測評価時間 (ns)
+    std::size_t nodes = 0;           // evaluate が訪れるノード数
+    std::size_t depth = 0;           // 最長の依存鎖
+    std::size_t memory_touches = 0;  // 読むノードと被演算子配列の数
+};
+
+// 単位はナノ秒. 既定値は -O2 の x86-64 で calibrate() した値の目安.
+struct CostModel {
+    double per_node = 1.2;      // 仮想呼び出しとポインタ追跡
+    double per_touch = 0.3;     // キャッシュに乗らないメモリ参照の分
+    double per_level = 1.0;     // 依存鎖 1 段 (再帰の戻りと演算の遅延が重ならない分)
+    double constant = 0.3;
+    double variable = 0.3;
+    double add = 0.4;
+    double mul = 0.4;
+    double pow_int_step = 0.8;  // 二乗法の 1 ステップ
+    double pow_real = 15;       // std::pow
+
+    Cost estimate(const Expression* e) const;
+    double operator()(const Expression* e) const { return estimate(e).latency; }
+    // 種類ごとの長い木を評価して係数を測り直す
+    static CostModel calibrate();
+};
+
+Cost CostModel::estimate(const Expression* root) const {
+    std::unordered_map<const Expression*, Cost> memo;
+    auto rec = [&](auto&& self, const Expression* e) -> Cost {
+        if (auto it = memo.find(e); it != memo.end()) return it->second;
+        Cost c{per_node + per_touch, 1, 1, 1};
+        std::size_t depth = 0;
+        for (auto& k : children_of(e)) {
+            auto kc = self(self, k.get());
+            c.latency += kc.latency;
+            c.nodes += kc.nodes;
+            c.memory_touches += kc.memory_touches;
+            depth = std::max(depth, kc.depth);
+        }
+        c.depth += depth;
+        if (as<Constant>(e)) c.latency += constant;
+        else if (as<Variable>(e)) c.latency += variable;
+        else if (as<Add>(e)) c.latency += add;
+        else if (as<Multiply>(e)) c.latency += mul;
+        else if (auto n = as<NaryOp>(e)) {
+            c.latency += (as<Sum>(e) ? add : mul) * static_cast<double>(n->operands.size()) + per_touch;
+            c.memory_touches += 1;
+        } else if (auto p = as<Pow>(e)) {
+            if (is_int_exponent(p->exponent))
+                c.latency += pow_int_step * (2 * std::bit_width(static_cast<unsigned>(std::abs(p->exponent))));
+            else
+                c.latency += pow_real;
+        }
+        memo.emplace(e, c);
+        return c;
+    };
+    auto c = rec(rec, root);
+    c.latency += per_level * static_cast<double>(c.depth);
+    return c;
+}
+
+CostModel CostModel::calibrate() {
+    constexpr int kLeaves = 4096;
+    constexpr int kReps = 200;
+    auto ns_per_eval = [&](const std::shared_ptr<Expression>& e) {
+        volatile double sink = 0;
+        double ms = measure_ms([&] { for (int i = 0; i < kReps; ++i) sink = sink + e->evaluate(1 + i * 1e-9); });
+        return ms * 1e6 / kReps;
+    };
+    auto balanced = [&](auto&& self, int n, auto&& join) -> std::shared_ptr<Expression> {
+        if (n == 1) return V();
+        return join(self(self, n / 2, join), self(self, n - n / 2, join));
+    };
+    CostModel m;
+    auto adds = balanced(balanced, kLeaves, [](auto l, auto r) { return make_add(l, r); });
+    auto muls = balanced(balanced, kLeaves, [](auto l, auto r) { return make_mul(l, r); });
+    // 同じノード数の平衡木と一直線の鎖の差を依存鎖の段数で割る.
+    // 鎖が長いと再帰のスタックがキャッシュから溢れるので短い鎖で測る
+    constexpr int kChain = 128;
+    std::shared_ptr<Expression> chain = V();
+    for (int i = 1; i < kChain; ++i) chain = make_add(chain, V());
+    auto short_adds = balanced(balanced, kChain, [](auto l, auto r) { return make_add(l, r); });
+    m.per_level = std::max(0.0, (ns_per_eval(chain) - ns_per_eval(short_adds)) / (kChain - std::bit_width(unsigned{kChain})));
+    double t_adds = ns_per_eval(adds);
+    // 葉 kLeaves 個 + 内部ノード kLeaves - 1 個. 葉と内部ノードの固定費は同じとみなす
+    double add_node = t_adds / (2 * kLeaves - 1);
+    double mul_node = ns_per_eval(muls) / (2 * kLeaves - 1);
+    m.per_node = std::max(0.1, std::min(add_node, mul_node) - m.per_touch - m.variable);
+    m.add = std::max(0.05, 2 * (add_node - m.per_node - m.per_touch) - m.variable);
+    m.mul = std::max(0.05, 2 * (mul_node - m.per_node - m.per_touch) - m.variable);
+
+    std::vector<std::shared_ptr<Expression>> pows, reals;
+    for (int i = 0; i < kLeaves; ++i) {
+        pows.push_back(make_pow(V(), 1000));
+        reals.push_back(make_pow(V(), 0.37));
+    }
+    auto pow_sum = make_sum(pows), real_sum = make_sum(reals);
+    double base = m.per_node + m.per_touch + m.add;
+    m.pow_int_step = std::max(0.05, (ns_per_eval(pow_sum) / kLeaves - 2 * base) / (2 * std::bit_width(1000u)));
+    m.pow_real = std::max(0.05, ns_per_eval(real_sum) / kLeaves - 2 * base);
+    return m;
+}
+
+// 多項式を展開形 sum_k c_k * x^k の木にする
+std::shared_ptr<Expression> expanded_expression(const Polynomial& p) {
+    std::vector<std::shared_ptr<Expression>> terms;
+    for (int k = 1; k <= p.degree(); ++k) {
+        double c = p.coefficient(k);
+        if (c == 0) continue;
+        if (k == 1) terms.push_back(make_product({V()}, c));
+        else terms.push_back(make_product({make_pow(V(), k)}, c));
+    }
+    return make_sum(std::move(terms), p.coefficient(0))->simplify();
+}
+
+// 同値な候補の形を作り, コストモデルで最も速いと予測されるものを選ぶ
+//   そのまま / 不動点まで簡約 / n 項に平坦化 / 共通因数のくくり出し / 多項式の Horner 形 / 多項式の展開形
+struct SpeedCandidate {
+    std::string form;
+    std::shared_ptr<Expression> expr;
+    double predicted;
+};
+
+std::vector<SpeedCandidate> speed_candidates(const std::shared_ptr<Expression>& e, const CostModel& m) {
+    std::vector<SpeedCandidate> cs;
+    auto push = [&](std::string form, std::shared_ptr<Expression> x) {
+        double c = m(x.get());
+        cs.push_back({std::move(form), std::move(x), c});
+    };
+    push("そのまま", e);
+    auto s = simplify_fixpoint(e);
+    push("簡約", s);
+    push("平坦化", simplify_fixpoint(flatten(s)));
+    push("因数", factor_common(s));
+    // Polynomial は変数をすべて x とみなし, x の式に戻す. 他の名前の変数を含む式 (x * y + y など) では
+    // 同値でない候補になるので, 変数が x だけのときに限る
+    bool only_x = true;
+    std::unordered_map<const Expression*, bool> seen;
+    std::vector<const Expression*> stack{s.get()};
+    while (only_x && !stack.empty()) {
+        auto x = stack.back();
+        stack.pop_back();
+        if (!seen.emplace(x, true).second) continue;
+        if (auto v = as<Variable>(x)) only_x = v->name == "x";
+        for (auto& k : children_of(x)) stack.push_back(k.get());
+    }
+    if (only_x) {
+        try {
+            auto p = Polynomial::from_expression(*s);
+            if (p.degree() <= Polynomial::kMaxDegree) {
+                push("Horner", p.to_expression());
+                push("展開", expanded_expression(p));
+            }
+        } catch (const std::runtime_error&) {
+            // 多項式でなければ多項式の候補は作らない
+        }
+    }
+    return cs;
+}
+
+std::shared_ptr<Expression> simplify_for_speed(const std::shared_ptr<Expression>& e, const CostModel& m = {}) {
+    auto cs = speed_candidates(e, m);
+    return std::min_element(cs.begin(), cs.end(), [](auto& a, auto& b) { return a.predicted < b.predicted; })->expr;
+}
+
+//-------------------------------------------------
+// 11. 結合則による鎖の平衡化
+//-------------------------------------------------
+// make_add を繰り返して作った和は左に偏った鎖になり, evaluate() は 1 本の依存鎖に沿って
+// 直列に進み再帰も項数だけ深くなる.
+//   Reassociate: 和・積の鎖 (Add/Sum, Multiply/Product) を平衡木に組み直す. 深さは O(log n) に
+//                なり独立な部分和が並列に計算できるが, 浮動小数点の丸めの順序は変わる.
+//   Preserve:    左に偏った Add/Multiply の鎖だけを同じ順序で計算する n 項ノードに置き換える.
+//                結果はビット単位で一致し再帰も浅くなるが, 依存鎖は 1 本のまま.
+enum class FloatOrder { Reassociate, Preserve };
+
+std::shared_ptr<Expression> rebalance(const std::shared_ptr<Expression>& e, FloatOrder order = FloatOrder::Reassociate) {
+    bool is_sum = as<Add>(e.get()) || as<Sum>(e.get());
+    bool is_product = as<Multiply>(e.get()) || as<Product>(e.get());
+
+    if (order == FloatOrder::Preserve) {
+        if (as<Add>(e.get()) || as<Multiply>(e.get())) {
+            // 左の背骨をたどり, 右側の被演算子を逆順に集める
+            std::vector<std::shared_ptr<Expression>> ops;
+            std::shared_ptr<Expression> n = e;
+            while (typeid(*n) == typeid(*e)) {
+                auto b = as<BinaryOp>(n.get());
+                ops.push_back(b->right);
+                n = b->left;
+            }
+            ops.push_back(n);
+            std::reverse(ops.begin(), ops.end());
+            for (auto& op : ops) op = rebalance(op, order);
+            if (ops.size() == 2) return with_children(e, std::move(ops));
+            // -0.0 + a == a, 1 * a == a はどの a でも厳密に成り立つ
+            if (is_sum) return std::shared_ptr<Sum>(new Sum(-0.0, std::move(ops)));
+            return std::shared_ptr<Product>(new Product(1, std::move(ops)));
+        }
+    } else if (is_sum || is_product) {
+        // 同種の鎖の被演算子を明示スタックで集め (定数項・係数も被演算子として扱う), 平衡木に組む
+        std::vector<std::shared_ptr<Expression>> ops;
+        std::vector<std::shared_ptr<Expression>> stack{e};
+        while (!stack.empty()) {
+            auto n = std::move(stack.back());
+            stack.pop_back();
+            bool same_kind = is_sum ? as<Add>(n.get()) || as<Sum>(n.get()) : as<Multiply>(n.get()) || as<Product>(n.get());
+            if (auto b = as<BinaryOp>(n.get()); b && same_kind) {
+                stack.push_back(b->right);
+                stack.push_back(b->left);
+            } else if (auto s = as<NaryOp>(n.get()); s && same_kind) {
+                if (s->coeff != (is_sum ? 0.0 : 1.0)) ops.push_back(C(s->coeff));
+                stack.insert(stack.end(), s->operands.rbegin(), s->operands.rend());
+            } else {
+                ops.push_back(rebalance(n, order));
+            }
+        }
+        if (ops.empty()) return C(is_sum ? 0 : 1);
+        if (auto b = as<BinaryOp>(e.get()); b && ops.size() == 2 && ops[0] == b->left && ops[1] == b->right) return e;
+        // 各段を kFanout 項の Sum/Product にした平衡木. 二分木より内部ノード (仮想呼び出し) が少ない.
+        // make_sum/make_product は入れ子を平坦化してしまうので直接作る.
+        constexpr std::size_t kFanout = 8;
+        auto build = [&](auto&& self, std::size_t lo, std::size_t hi) -> std::shared_ptr<Expression> {
+            if (hi - lo == 1) return ops[lo];
+            if (hi - lo == 2) {
+                if (is_sum) return make_add(ops[lo], ops[lo + 1]);
+                return make_mul(ops[lo], ops[lo + 1]);
+            }
+            std::vector<std::shared_ptr<Expression>> parts;
+            std::size_t k = std::min(kFanout, hi - lo);
+            for (std::size_t i = 0; i < k; ++i) parts.push_back(self(self, lo + (hi - lo) * i / k, lo + (hi - lo) * (i + 1) / k));
+            if (is_sum) return std::shared_ptr<Expression>(new Sum(0, std::move(parts)));
+            return std::shared_ptr<Expression>(new Product(1, std::move(parts)));
+        };
+        return build(build, 0, ops.size());
+    }
+
+    auto kids = children_of(e.get());
+    if (kids.empty()) return e;
+    for (auto& k : kids) k = rebalance(k, order);
+    return with_children(e, std::move(kids));
+}
+
+//-------------------------------------------------
+// 12. テープ (位相順に並べた計算グラフ)
+//-------------------------------------------------
+// 式の DAG を命令列に線形化したもの. code[i] の値をスロット i に置く.
+// 共有された部分木 (同一ノード) は 1 度だけ命令になり, 定数と変数は値・名前ごとにまとめる.
+// 別々に作られた同じ形の部分木も, 命令の種類・被演算子・値が一致すれば 1 つの命令にまとめる (値番号付け).
+// 木の evaluate() と違い, 変数は名前ごとに別々の入力として扱う.
+// Fma (a * b + c を 1 回の丸めで求める) はテープにだけ現れ, Add と片方の Mul を融合して作る.
+enum class Op : std::uint8_t { Const, Var, Add, Mul, Pow, Fma };
+
+struct Instr {
+    Op op;
+    std::uint32_t a = 0, b = 0, c = 0;  // 被演算子のスロット (Var では入力の添字, c は Fma の加数)
+    double value = 0;                   // Const の値, Pow の指数
+};
+
+// Add(Mul(a, b), c) を Fma にするか. Off なら木の evaluate() とビット単位で同じ値になる.
+// 既定は Off で, 結果がビルドの設定に依らない. Fuse は明示したときだけ使う
+// (FMA 命令の無い環境 (FP_FAST_FMA が未定義) では std::fma は遅いライブラリ呼び出し)
+enum class FmaMode : std::uint8_t { Off, Fuse };
+
+struct Tape {
+    std::vector<Instr> code;
+    std::vector<std::string> variables;   // Var 命令の a が指す入力の名前
+    std::vector<std::uint32_t> outputs;   // 出力のスロット
+
+    // variables を省略すると式に現れる変数名を辞書順に並べる.
+    // 既定 (FmaMode::Off) の結果は木の evaluate() と同じビット列. Fuse では丸めが 1 回減るぶん異なりうる
+    static Tape compile(const std::vector<std::shared_ptr<Expression>>& outputs, std::vector<std::string> variables = {},
+                        FmaMode fma = FmaMode::Off);
+    // 使われるのが 1 か所だけの Mul を, それを足す Add と融合して Fma にしたテープ (不要になった命令は除く)
+    Tape fuse_multiply_add() const;
+    // 同時に生きている値が少なくなるよう命令を並べ替えたテープ (出力から届かない命令は除く. 実装は 25 節)
+    Tape schedule() const;
+
+    void forward(std::span<const double> inputs, std::vector<double>& values) const;
+    // 任意のスカラー型での前進評価 (T は double からの構築, +, *, power(T, double) を持つこと)
+    template<typename T>
+    void forward_as(std::span<const T> inputs, std::vector<T>& values) const;
+    std::vector<double> evaluate(std::span<const double> inputs) const;
+    // 前進モード: 入力の方向 seed に沿った各スロットの方向微分
+    void tangent(std::span<const double> seed, const std::vector<double>& values, std::vector<double>& dot) const;
+    // 逆モード: 出力の重み out_adjoint に対する入力の勾配を grad に足し込む
+    void adjoint(std::span<const double> out_adjoint, const std::vector<double>& values, std::vector<double>& grad) const;
+};
+
+std::vector<std::string> collect_variables(const std::vector<std::shared_ptr<Expression>>& outputs) {
+    std::vector<std::string> names;
+    std::unordered_map<const Expression*, bool> seen;
+    std::vector<const Expression*> stack;
+    for (auto& o : outputs) stack.push_back(o.get());
+    while (!stack.empty()) {
+        auto e = stack.back();
+        stack.pop_back();
+        if (!seen.emplace(e, true).second) continue;
+        if (auto v = as<Variable>(e)) names.push_back(v->name);
+        for (auto& k : children_of(e)) stack.push_back(k.get());
+    }
+    std::sort(names.begin(), names.end());
+    names.erase(std::unique(names.begin(), names.end()), names.end());
+    return names;
+}
+
+namespace tape_detail {
+// 値番号付けの鍵 (Const と Var は別の表でまとめる)
+struct InstrKey {
+    Op op;
+    std::uint32_t a, b;
+    std::uint64_t value;
+    bool operator==(const InstrKey&) const = default;
+};
+struct InstrKeyHash {
+    std::size_t operator()(const InstrKey& k) const {
+        std::uint64_t h = (std::uint64_t{k.a} << 32 | k.b) ^ (k.value * 0x9e3779b97f4a7c15ULL) ^ static_cast<std::uint64_t>(k.op);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<std::size_t>(h);
+    }
+};
+}  // namespace tape_detail
+
+Tape Tape::compile(const std::vector<std::shared_ptr<Expression>>& outputs, std::vector<std::string> variables, FmaMode fma) {
+    Tape t;
+    t.variables = variables.empty() ? collect_variables(outputs) : std::move(variables);
+    std::unordered_map<std::string, std::uint32_t> var_index;
+    for (std::size_t i = 0; i < t.variables.size(); ++i) var_index.emplace(t.variables[i], static_cast<std::uint32_t>(i));
+
+    std::unordered_map<const Expression*, std::uint32_t> slot;
+    // 定数はビット列で引く (double の == では -0.0 と 0.0 がまとまり, NaN はまとまらない)
+    std::unordered_map<std::uint64_t, std::uint32_t> const_slot;
+    std::unordered_map<std::uint32_t, std::uint32_t> var_slot;
+    auto emit = [&](Instr in) {
+        t.code.push_back(in);
+        return static_cast<std::uint32_t>(t.code.size() - 1);
+    };
+    auto constant = [&](double v) {
+        auto [it, fresh] = const_slot.try_emplace(std::bit_cast<std::uint64_t>(v), 0);
+        if (fresh) it->second = emit({Op::Const, 0, 0, 0, v});
+        return it->second;
+    };
+    // 和と積は被演算子を並べ替えてから引く (浮動小数点でも可換なので値は変わらない)
+    std::unordered_map<tape_detail::InstrKey, std::uint32_t, tape_detail::InstrKeyHash> numbered;
+    auto node = [&](Instr in) {
+        if ((in.op == Op::Add || in.op == Op::Mul) && in.a > in.b) std::swap(in.a, in.b);
+        auto [it, fresh] = numbered.try_emplace({in.op, in.a, in.b, std::bit_cast<std::uint64_t>(in.value)}, 0);
+        if (fresh) it->second = emit(in);
+        return it->second;
+    };
+    // n 項の和・積は左から順に 2 項命令の鎖にする (木の evaluate と同じ順序)
+    auto fold = [&](Op op, double identity, double coeff, const std::vector<std::shared_ptr<Expression>>& ops) {
+        std::uint32_t acc = 0;
+        bool has = !droppable_coeff(coeff, op == Op::Add);
+        if (has) acc = constant(coeff);
+        for (auto& o : ops) {
+            acc = has ? node({op, acc, slot.at(o.get())}) : slot.at(o.get());
+            has = true;
+        }
+        return has ? acc : constant(identity);
+    };
+
+    // 明示スタックによる帰りがけ順
+    std::vector<std::pair<const Expression*, bool>> stack;
+    for (auto& o : outputs) stack.emplace_back(o.get(), false);
+    while (!stack.empty()) {
+        auto [e, expanded] = stack.back();
+        if (slot.count(e)) {
+            stack.pop_back();
+            continue;
+        }
+        if (!expanded) {
+            stack.back().second = true;
+            for (auto& k : expanded_children_of(e))
+                if (!slot.count(k.get())) stack.emplace_back(k.get(), false);
+            continue;
+        }
+        stack.pop_back();
+        std::uint32_t s;
+        if (auto d = as<Derivative>(e)) {
+            s = slot.at(d->expand().get());  // 遅延微分は展開した式と同じ値
+        } else if (auto c = as<Constant>(e)) {
+            s = constant(c->value);
+        } else if (auto v = as<Variable>(e)) {
+            auto it = var_index.find(v->name);
+            if (it == var_index.end()) throw std::runtime_error("Tape::compile: 変数一覧にない変数: " + v->name);
+            auto [vs, fresh] = var_slot.try_emplace(it->second, 0);
+            if (fresh) vs->second = emit({Op::Var, it->second});
+            s = vs->second;
+        } else if (auto a = as<Add>(e)) {
+            s = node({Op::Add, slot.at(a->left.get()), slot.at(a->right.get())});
+        } else if (auto m = as<Multiply>(e)) {
+            s = node({Op::Mul, slot.at(m->left.get()), slot.at(m->right.get())});
+        } else if (auto p = as<Pow>(e)) {
+            s = node({Op::Pow, slot.at(p->base.get()), 0, 0, p->exponent});
+        } else if (auto sm = as<Sum>(e)) {
+            s = fold(Op::Add, -0.0, sm->coeff, sm->operands);
+        } else if (auto pr = as<Product>(e)) {
+            s = fold(Op::Mul, 1, pr->coeff, pr->operands);
+        } else {
+            throw std::runtime_error("Tape::compile: 未対応のノード: " + e->to_string());
+        }
+        slot.emplace(e, s);
+    }
+    for (auto& o : outputs) t.outputs.push_back(slot.at(o.get()));
+    return fma == FmaMode::Fuse ? t.fuse_multiply_add() : t;
+}
+
+Tape Tape::fuse_multiply_add() const {
+    std::size_t n = code.size();
+    std::vector<std::uint32_t> uses(n, 0);
+    for (auto o : outputs) ++uses[o];
+    for (const auto& in : code) {
+        if (in.op == Op::Add || in.op == Op::Mul) ++uses[in.a], ++uses[in.b];
+        else if (in.op == Op::Pow) ++uses[in.a];
+    }
+    // 右の被演算子を優先する (n 項の和の鎖では右が新しく足す項)
+    std::vector<Instr> fused = code;
+    for (auto& in : fused) {
+        if (in.op != Op::Add) continue;
+        auto single_mul = [&](std::uint32_t s) { return code[s].op == Op::Mul && uses[s] == 1; };
+        std::uint32_t m, addend;
+        if (single_mul(in.b)) m = in.b, addend = in.a;
+        else if (single_mul(in.a)) m = in.a, addend = in.b;
+        else continue;
+        in = {Op::Fma, code[m].a, code[m].b, addend};
+    }
+    // 出力から届く命令だけを残して詰め直す
+    std::vector<bool> live(n, false);
+    for (auto o : outputs) live[o] = true;
+    for (std::size_t i = n; i-- > 0;) {
+        if (!live[i]) continue;
+        const auto& in = fused[i];
+        if (in.op == Op::Add || in.op == Op::Mul) live[in.a] = live[in.b] = true;
+        else if (in.op == Op::Pow) live[in.a] = true;
+        else if (in.op == Op::Fma) live[in.a] = live[in.b] = live[in.c] = true;
+    }
+    Tape t;
+    t.variables = variables;
+    std::vector<std::uint32_t> remap(n, 0);
+    for (std::size_t i = 0; i < n; ++i) {
+        if (!live[i]) continue;
+        auto in = fused[i];
+        if (in.op != Op::Const && in.op != Op::Var) in.a = remap[in.a];
+        if (in.op == Op::Add || in.op == Op::Mul || in.op == Op::Fma) in.b = remap[in.b];
+        if (in.op == Op::Fma) in.c = remap[in.c];
+        remap[i] = static_cast<std::uint32_t>(t.code.size());
+        t.code.push_back(in);
+    }
+    for (auto o : outputs) t.outputs.push_back(remap[o]);
+    return t;
+}
+
+// a * b + c. 浮動小数点型は 1 回の丸め, 他のスカラー型 (二重数, 区間など) は乗算と加算に分ける
+template<typename T>
+T fused_multiply_add(const T& a, const T& b, const T& c) {
+    if constexpr (std::is_floating_point_v<T>) return std::fma(a, b, c);
+    else return a * b + c;
+}
+
+// 命令 1 つの値 (被演算子のスロットは計算済みであること)
+template<typename T>
+inline T apply(const Instr& in, std::span<const T> x, const std::vector<T>& v) {
+    switch (in.op) {
+    case Op::Const: return T(in.value);
+    case Op::Var:   return x[in.a];
+    case Op::Add:   return v[in.a] + v[in.b];
+    case Op::Mul:   return v[in.a] * v[in.b];
+    case Op::Pow:   return power(v[in.a], in.value);
+    case Op::Fma:   return fused_multiply_add(v[in.a], v[in.b], v[in.c]);
+    }
+    return T(0);
+}
+
+void Tape::forward(std::span<const double> x, std::vector<double>& v) const {
+    forward_as<double>(x, v);
+}
+
+template<typename T>
+void Tape::forward_as(std::span<const T> x, std::vector<T>& v) const {
+    v.resize(code.size(), T(0));
+    for (std::size_t i = 0; i < code.size(); ++i) v[i] = apply<T>(code[i], x, v);
+}
+
+std::vector<double> Tape::evaluate(std::span<const double> x) const {
+    std::vector<double> v;
+    forward(x, v);
+    std::vector<double> out;
+    out.reserve(outputs.size());
+    for (auto o : outputs) out.push_back(v[o]);
+    return out;
+}
+
+// d(b^e)/db. e = 0, 1 のときに 0 * inf を作らないよう分ける
+double power_derivative(double b, double e) {
+    if (e == 0) return 0;
+    if (e == 1) return 1;
+    return e * power(b, e - 1);
+}
+
+void Tape::tangent(std::span<const double> seed, const std::vector<double>& v, std::vector<double>& dot) const {
+    dot.resize(code.size());
+    for (std::size_t i = 0; i < code.size(); ++i) {
+        const auto& in = code[i];
+        switch (in.op) {
+        case Op::Const: dot[i] = 0; break;
+        case Op::Var:   dot[i] = seed[in.a]; break;
+        case Op::Add:   dot[i] = dot[in.a] + dot[in.b]; break;
+        case Op::Mul:   dot[i] = dot[in.a] * v[in.b] + v[in.a] * dot[in.b]; break;
+        case Op::Pow:   dot[i] = power_derivative(v[in.a], in.value) * dot[in.a]; break;
+        case Op::Fma:   dot[i] = dot[in.a] * v[in.b] + v[in.a] * dot[in.b] + dot[in.c]; break;
+        }
+    }
+}
+
+void Tape::adjoint(std::span<const double> out_adjoint, const std::vector<double>& v, std::vector<double>& grad) const {
+    std::vector<double> w(code.size(), 0.0);
+    for (std::size_t k = 0; k < outputs.size(); ++k) w[outputs[k]] += out_adjoint[k];
+    grad.resize(variables.size(), 0.0);
+    for (std::size_t i = code.size(); i-- > 0;) {
+        const auto& in = code[i];
+        if (w[i] == 0) continue;
+        switch (in.op) {
+        case Op::Const: break;
+        case Op::Var:   grad[in.a] += w[i]; break;
+        case Op::Add:   w[in.a] += w[i]; w[in.b] += w[i]; break;
+        case Op::Mul:   w[in.a] += w[i] * v[in.b]; w[in.b] += w[i] * v[in.a]; break;
+        case Op::Pow:   w[in.a] += w[i] * power_derivative(v[in.a], in.value); break;
+        case Op::Fma:   w[in.a] += w[i] * v[in.b]; w[in.b] += w[i] * v[in.a]; w[in.c] += w[i]; break;
+        }
+    }
+}
+
+//-------------------------------------------------
+// 13. ヤコビ行列・ヘッセ行列 (疎性の検出と彩色)
+//-------------------------------------------------
+// CSR 形式の疎行列. 行 r の非零は col_idx/values の [row_ptr[r], row_ptr[r+1])
+struct CsrMatrix {
+    std::size_t rows = 0, cols = 0;
+    std::vector<std::size_t> row_ptr{0};
+    std::vector<std::uint32_t> col_idx;
+    std::vector<double> values;
+
+    static CsrMatrix from_rows(const std::vector<std::vector<std::uint32_t>>& pattern, std::size_t cols);
+    std::size_t nonzeros() const { return col_idx.size(); }
+    double at(std::size_t r, std::size_t c) const;
+};
+
+CsrMatrix CsrMatrix::from_rows(const std::vector<std::vector<std::uint32_t>>& pattern, std::size_t cols) {
+    CsrMatrix m;
+    m.rows = pattern.size();
+    m.cols = cols;
+    for (auto& row : pattern) {
+        m.col_idx.insert(m.col_idx.end(), row.begin(), row.end());
+        m.row_ptr.push_back(m.col_idx.size());
+    }
+    return m;
+}
+
+double CsrMatrix::at(std::size_t r, std::size_t c) const {
+    auto b = col_idx.begin() + row_ptr[r], e = col_idx.begin() + row_ptr[r + 1];
+    auto it = std::lower_bound(b, e, static_cast<std::uint32_t>(c));
+    return it != e && *it == c ? values[it - col_idx.begin()] : 0.0;
+}
+
+namespace sparsity_detail {
+// 昇順の添字集合の和
+void merge_into(std::vector<std::uint32_t>& dst, const std::vector<std::uint32_t>& src) {
+    if (src.empty()) return;
+    std::vector<std::uint32_t> out;
+    out.reserve(dst.size() + src.size());
+    std::set_union(dst.begin(), dst.end(), src.begin(), src.end(), std::back_inserter(out));
+    dst = std::move(out);
+}
+
+// 各スロットが依存する入力の集合
+std::vector<std::vector<std::uint32_t>> dependencies(const Tape& t) {
+    std::vector<std::vector<std::uint32_t>> deps(t.code.size());
+    for (std::size_t i = 0; i < t.code.size(); ++i) {
+        const auto& in = t.code[i];
+        switch (in.op) {
+        case Op::Const: break;
+        case Op::Var: deps[i] = {in.a}; break;
+        case Op::Add:
+        case Op::Mul: deps[i] = deps[in.a]; merge_into(deps[i], deps[in.b]); break;
+        case Op::Pow: deps[i] = deps[in.a]; break;
+        case Op::Fma: deps[i] = deps[in.a]; merge_into(deps[i], deps[in.b]); merge_into(deps[i], deps[in.c]); break;
+        }
+    }
+    return deps;
+}
+
+// 行 r の非零列が rows[r] のとき, 同じ行に非零を持つ列どうしが別の色になるよう貪欲に彩色する
+std::vector<std::uint32_t> color_columns(const std::vector<std::vector<std::uint32_t>>& rows, std::size_t cols,
+                                         std::uint32_t& color_count) {
+    std::vector<std::vector<std::uint32_t>> rows_of(cols);
+    for (std::uint32_t r = 0; r < rows.size(); ++r)
+        for (auto c : rows[r]) rows_of[c].push_back(r);
+    constexpr std::uint32_t kNone = UINT32_MAX;
+    std::vector<std::uint32_t> color(cols, kNone);
+    std::vector<std::uint32_t> forbidden;  // forbidden[k] == j なら列 j に色 k は使えない
+    color_count = 0;
+    for (std::uint32_t j = 0; j < cols; ++j) {
+        for (auto r : rows_of[j])
+            for (auto k : rows[r])
+                if (color[k] != kNone) {
+                    if (forbidden.size() <= color[k]) forbidden.resize(color[k] + 1, kNone);
+                    forbidden[color[k]] = j;
+                }
+        std::uint32_t c = 0;
+        while (c < forbidden.size() && forbidden[c] == j) ++c;
+        color[j] = c;
+        color_count = std::max(color_count, c + 1);
+    }
+    return color;
+}
+
+std::vector<std::vector<std::uint32_t>> transpose(const std::vector<std::vector<std::uint32_t>>& rows, std::size_t cols) {
+    std::vector<std::vector<std::uint32_t>> t(cols);
+    for (std::uint32_t r = 0; r < rows.size(); ++r)
+        for (auto c : rows[r]) t[c].push_back(r);
+    return t;
+}
+}  // namespace sparsity_detail
+
+// F: R^n -> R^m のヤコビ行列. 疎性パターンと彩色は構築時に 1 度だけ求める.
+// 同じ色の列 (入力) は同じ行に現れないので, 色ごとに 1 回の前進掃引でまとめて求まる.
+// 行の色数の方が少なければ行を彩色し, 色ごとに 1 回の逆掃引で求める.
+struct SparseJacobian {
+    Tape tape;
+    CsrMatrix pattern;                  // values は空
+    std::vector<std::uint32_t> colors;  // reverse なら行の色, そうでなければ列の色
+    std::uint32_t color_count = 0;
+    bool reverse = false;
+
+    SparseJacobian(const std::vector<std::shared_ptr<Expression>>& outputs, std::vector<std::string> variables = {});
+    CsrMatrix evaluate(std::span<const double> x) const;
+};
+
+SparseJacobian::SparseJacobian(const std::vector<std::shared_ptr<Expression>>& outputs, std::vector<std::string> variables)
+    : tape(Tape::compile(outputs, std::move(variables))) {
+    auto deps = sparsity_detail::dependencies(tape);
+    std::vector<std::vector<std::uint32_t>> rows;
+    for (auto o : tape.outputs) rows.push_back(deps[o]);
+    std::size_t n = tape.variables.size();
+    pattern = CsrMatrix::from_rows(rows, n);
+
+    std::uint32_t col_colors = 0, row_colors = 0;
+    auto by_col = sparsity_detail::color_columns(rows, n, col_colors);
+    auto by_row = sparsity_detail::color_columns(sparsity_detail::transpose(rows, n), rows.size(), row_colors);
+    reverse = row_colors < col_colors;
+    colors = reverse ? std::move(by_row) : std::move(by_col);
+    color_count = reverse ? row_colors : col_colors;
+}
+
+CsrMatrix SparseJacobian::evaluate(std::span<const double> x) const {
+    CsrMatrix J = pattern;
+    J.values.assign(J.nonzeros(), 0.0);
+    std::vector<double> v, work;
+    tape.forward(x, v);
+    for (std::uint32_t c = 0; c < color_count; ++c) {
+        if (reverse) {
+            std::vector<double> seed(tape.outputs.size(), 0.0);
+            for (std::size_t r = 0; r < seed.size(); ++r) seed[r] = colors[r] == c;
+            work.assign(tape.variables.size(), 0.0);
+            tape.adjoint(seed, v, work);
+            for (std::size_t r = 0; r < J.rows; ++r)
+                if (colors[r] == c)
+                    for (std::size_t k = J.row_ptr[r]; k < J.row_ptr[r + 1]; ++k) J.values[k] = work[J.col_idx[k]];
+        } else {
+            std::vector<double> seed(tape.variables.size(), 0.0);
+            for (std::size_t j = 0; j < seed.size(); ++j) seed[j] = colors[j] == c;
+            tape.tangent(seed, v, work);
+            for (std::size_t r = 0; r < J.rows; ++r)
+                for (std::size_t k = J.row_ptr[r]; k < J.row_ptr[r + 1]; ++k)
+                    if (colors[J.col_idx[k]] == c) J.values[k] = work[tape.outputs[r]];
+        }
+    }
+    return J;
+}
+
+// スカラー関数 f のヘッセ行列. 非線形な演算 (積, べき) が結びつける入力の組から疎性を求め,
+// 列を彩色して色ごとに 1 回のヘッセ行列・ベクトル積 (逆モードの前進微分) で求める.
+struct SparseHessian {
+    Tape tape;
+    CsrMatrix pattern;
+    std::vector<std::uint32_t> colors;
+    std::uint32_t color_count = 0;
+
+    SparseHessian(const std::shared_ptr<Expression>& f, std::vector<std::string> variables = {});
+    CsrMatrix evaluate(std::span<const double> x) const;
+    // H * s を求める (前進モードで値の接ベクトルを求めてから, 随伴とその接ベクトルを逆に流す)
+    void hessian_vector(const std::vector<double>& v, std::span<const double> s, std::vector<double>& hv) const;
+};
+
+SparseHessian::SparseHessian(const std::shared_ptr<Expression>& f, std::vector<std::string> variables)
+    : tape(Tape::compile({f}, std::move(variables))) {
+    auto deps = sparsity_detail::dependencies(tape);
+    // 出力に届く命令だけを見る
+    std::vector<bool> live(tape.code.size(), false);
+    live[tape.outputs[0]] = true;
+    for (std::size_t i = tape.code.size(); i-- > 0;) {
+        if (!live[i]) continue;
+        const auto& in = tape.code[i];
+        if (in.op == Op::Add || in.op == Op::Mul) live[in.a] = live[in.b] = true;
+        else if (in.op == Op::Pow) live[in.a] = true;
+        else if (in.op == Op::Fma) live[in.a] = live[in.b] = live[in.c] = true;
+    }
+    std::size_t n = tape.variables.size();
+    std::vector<std::vector<std::uint32_t>> rows(n);
+    auto connect = [&](const std::vector<std::uint32_t>& a, const std::vector<std::uint32_t>& b) {
+        for (auto i : a) sparsity_detail::merge_into(rows[i], b);
+        for (auto j : b) sparsity_detail::merge_into(rows[j], a);
+    };
+    for (std::size_t i = 0; i < tape.code.size(); ++i) {
+        const auto& in = tape.code[i];
+        if (!live[i]) continue;
+        if (in.op == Op::Mul || in.op == Op::Fma) connect(deps[in.a], deps[in.b]);
+        else if (in.op == Op::Pow && in.value != 0 && in.value != 1) connect(deps[in.a], deps[in.a]);
+    }
+    pattern = CsrMatrix::from_rows(rows, n);
+    colors = sparsity_detail::color_columns(rows, n, color_count);
+}
+
+void SparseHessian::hessian_vector(const std::vector<double>& v, std::span<const double> s, std::vector<double>& hv) const {
+    std::vector<double> dot;
+    tape.tangent(s, v, dot);
+    std::vector<double> w(tape.code.size(), 0.0), dw(tape.code.size(), 0.0);
+    w[tape.outputs[0]] = 1;
+    hv.assign(tape.variables.size(), 0.0);
+    for (std::size_t i = tape.code.size(); i-- > 0;) {
+        const auto& in = tape.code[i];
+        switch (in.op) {
+        case Op::Const: break;
+        case Op::Var: hv[in.a] += dw[i]; break;
+        case Op::Add:
+            w[in.a] += w[i]; dw[in.a] += dw[i];
+            w[in.b] += w[i]; dw[in.b] += dw[i];
+            break;
+        case Op::Mul:
+            w[in.a] += w[i] * v[in.b]; dw[in.a] += dw[i] * v[in.b] + w[i] * dot[in.b];
+            w[in.b] += w[i] * v[in.a]; dw[in.b] += dw[i] * v[in.a] + w[i] * dot[in.a];
+            break;
+        case Op::Pow: {
+            double g = power_derivative(v[in.a], in.value);
+            double dg = in.value == 0 || in.value == 1 ? 0.0 : in.value * power_derivative(v[in.a], in.value - 1) * dot[in.a];
+            w[in.a] += w[i] * g;
+            dw[in.a] += dw[i] * g + w[i] * dg;
+            break;
+        }
+        case Op::Fma:
+            w[in.a] += w[i] * v[in.b]; dw[in.a] += dw[i] * v[in.b] + w[i] * dot[in.b];
+            w[in.b] += w[i] * v[in.a]; dw[in.b] += dw[i] * v[in.a] + w[i] * dot[in.a];
+            w[in.c] += w[i]; dw[in.c] += dw[i];
+            break;
+        }
+    }
+}
+
+CsrMatrix SparseHessian::evaluate(std::span<const double> x) const {
+    CsrMatrix H = pattern;
+    H.values.assign(H.nonzeros(), 0.0);
+    std::vector<double> v, hv;
+    tape.forward(x, v);
+    std::vector<double> seed(tape.variables.size());
+    for (std::uint32_t c = 0; c < color_count; ++c) {
+        for (std::size_t j = 0; j < seed.size(); ++j) seed[j] = colors[j] == c;
+        hessian_vector(v, seed, hv);
+        for (std::size_t r = 0; r < H.rows; ++r)
+            for (std::size_t k = H.row_ptr[r]; k < H.row_ptr[r + 1]; ++k)
+                if (colors[H.col_idx[k]] == c) H.values[k] = hv[r];
+    }
+    return H;
+}
+
+// 比較用: 名前付き変数についての記号的な偏微分と, 変数ごとの値を与えた木の評価
+std::shared_ptr<Expression> partial_derivative(const std::shared_ptr<Expression>& e, const std::string& var) {
+    if (as<Constant>(e.get())) return C(0);
+    if (auto v = as<Variable>(e.get())) return C(v->name == var ? 1 : 0);
+    if (auto a = as<Add>(e.get())) return make_add(partial_derivative(a->left, var), partial_derivative(a->right, var));
+    if (auto m = as<Multiply>(e.get()))
+        return make_add(make_mul(partial_derivative(m->left, var), m->right), make_mul(m->left, partial_derivative(m->right, var)));
+    if (auto p = as<Pow>(e.get())) {
+        if (p->exponent == 0) return C(0);
+        if (p->exponent == 1) return partial_derivative(p->base, var);
+        return make_product({make_pow(p->base, p->exponent - 1), partial_derivative(p->base, var)}, p->exponent);
+    }
+    if (auto s = as<Sum>(e.get())) {
+        std::vector<std::shared_ptr<Expression>> ds;
+        for (auto& op : s->operands) ds.push_back(partial_derivative(op, var));
+        return make_sum(std::move(ds));
+    }
+    if (auto pr = as<Product>(e.get())) {
+        std::vector<std::shared_ptr<Expression>> terms;
+        for (std::size_t i = 0; i < pr->operands.size(); ++i) {
+            auto factors = pr->operands;
+            factors[i] = partial_derivative(pr->operands[i], var);
+            terms.push_back(make_product(std::move(factors), pr->coeff));
+        }
+        return make_sum(std::move(terms));
+    }
+    throw std::runtime_error("partial_derivative: 未対応のノード: " + e->to_string());
+}
+
+double evaluate_at(const Expression* e, const std::unordered_map<std::string, double>& env) {
+    if (auto c = as<Constant>(e)) return c->value;
+    if (auto v = as<Variable>(e)) return env.at(v->name);
+    if (auto a = as<Add>(e)) return evaluate_at(a->left.get(), env) + evaluate_at(a->right.get(), env);
+    if (auto m = as<Multiply>(e)) return evaluate_at(m->left.get(), env) * evaluate_at(m->right.get(), env);
+    if (auto p = as<Pow>(e)) return power(evaluate_at(p->base.get(), env), p->exponent);
+    if (auto s = as<Sum>(e)) {
+        double acc = s->coeff;
+        for (auto& op : s->operands) acc += evaluate_at(op.get(), env);
+        return acc;
+    }
+    if (auto pr = as<Product>(e)) {
+        double acc = pr->coeff;
+        for (auto& op : pr->operands) acc *= evaluate_at(op.get(), env);
+        return acc;
+    }
+    throw std::runtime_error("evaluate_at: 未対応のノード: " + e->to_string());
+}
+
+//-------------------------------------------------
+// 14. 差分による再評価 (変更の伝播)
+//-------------------------------------------------
+// テープの全スロットの値を保持しておき, 入力が変わったときは影響を受けるスロットだけを
+// 位相順 (= テープの順) に計算し直す. 計算し直した値が前と同じなら, その先へは伝播しない.
+struct IncrementalEvaluator {
+    Tape tape;
+    std::vector<double> inputs;
+    std::vector<double> values;
+    std::vector<std::uint32_t> user_ptr, users;  // スロット i の利用者は users[user_ptr[i] .. user_ptr[i+1])
+    std::vector<std::uint32_t> input_slot;       // 入力 -> Var 命令のスロット (式に現れなければ UINT32_MAX)
+    // 計算し直すスロットのビット集合. 利用者は必ず後ろのスロットなので, 前から 1 回走査すれば位相順になる
+    std::vector<std::uint64_t> dirty;
+    std::size_t dirty_begin = SIZE_MAX, dirty_end = 0;  // 立っているビットを含む語の範囲
+    std::size_t recomputed = 0;                  // 直前の update() で計算し直した命令数
+
+    IncrementalEvaluator(Tape t, std::span<const double> x);
+    void set(std::size_t input, double value);
+    // 変更を伝播して出力の値を返す
+    std::vector<double> update();
+    double output(std::size_t k) const { return values[tape.outputs[k]]; }
+
+private:
+    void mark(std::uint32_t slot) {
+        dirty[slot / 64] |= std::uint64_t{1} << (slot % 64);
+        dirty_begin = std::min<std::size_t>(dirty_begin, slot / 64);
+        dirty_end = std::max<std::size_t>(dirty_end, slot / 64 + 1);
+    }
+};
+
+IncrementalEvaluator::IncrementalEvaluator(Tape t, std::span<const double> x)
+    : tape(std::move(t)), inputs(x.begin(), x.end()), dirty((tape.code.size() + 63) / 64, 0) {
+    if (inputs.size() != tape.variables.size())
+        throw std::runtime_error(std::format("IncrementalEvaluator: 入力が {} 個必要 ({} 個)", tape.variables.size(), inputs.size()));
+    tape.forward(inputs, values);
+
+    std::size_t n = tape.code.size();
+    input_slot.assign(inputs.size(), UINT32_MAX);
+    user_ptr.assign(n + 1, 0);
+    auto each_operand = [&](auto&& f) {
+        for (std::uint32_t i = 0; i < n; ++i) {
+            const auto& in = tape.code[i];
+            if (in.op == Op::Add || in.op == Op::Mul) {
+                f(in.a, i);
+                if (in.b != in.a) f(in.b, i);
+            } else if (in.op == Op::Pow) {
+                f(in.a, i);
+            } else if (in.op == Op::Fma) {
+                f(in.a, i);
+                if (in.b != in.a) f(in.b, i);
+                if (in.c != in.a && in.c != in.b) f(in.c, i);
+            }
+        }
+    };
+    each_operand([&](std::uint32_t from, std::uint32_t) { ++user_ptr[from + 1]; });
+    std::partial_sum(user_ptr.begin(), user_ptr.end(), user_ptr.begin());
+    users.resize(user_ptr[n]);
+    auto fill = user_ptr;
+    each_operand([&](std::uint32_t from, std::uint32_t to) { users[fill[from]++] = to; });
+    for (std::uint32_t i = 0; i < n; ++i)
+        if (tape.code[i].op == Op::Var) input_slot[tape.code[i].a] = i;
+}
+
+// 変化の判定はビット列で行う (== では -0.0 と +0.0 が等しく, 1 / x などの下流が全体の再評価と食い違う)
+void IncrementalEvaluator::set(std::size_t input, double value) {
+    if (std::bit_cast<std::uint64_t>(inputs.at(input)) == std::bit_cast<std::uint64_t>(value)) return;
+    inputs[input] = value;
+    if (input_slot[input] != UINT32_MAX) mark(input_slot[input]);
+}
+
+std::vector<double> IncrementalEvaluator::update() {
+    recomputed = 0;
+    // 走査中にも dirty_end は後ろへ伸びる
+    for (std::size_t w = dirty_begin; w < dirty_end; ++w) {
+        while (dirty[w]) {
+            auto i = static_cast<std::uint32_t>(w * 64 + std::countr_zero(dirty[w]));
+            dirty[w] &= dirty[w] - 1;
+            ++recomputed;
+            double v = apply<double>(tape.code[i], inputs, values);
+            if (std::bit_cast<std::uint64_t>(v) == std::bit_cast<std::uint64_t>(values[i])) continue;
+            values[i] = v;
+            for (auto k = user_ptr[i]; k < user_ptr[i + 1]; ++k) mark(users[k]);
+        }
+    }
+    dirty_begin = SIZE_MAX;
+    dirty_end = 0;
+    std::vector<double> out;
+    out.reserve(tape.outputs.size());
+    for (auto o : tape.outputs) out.push_back(values[o]);
+    return out;
+}
+
+//-------------------------------------------------
+// 15. 並行ハッシュコンス表 (スレッド間での部分木の共有)
+//-------------------------------------------------
+// 同じ構造のノードを 1 つにまとめる表. 子が表から得たノードであれば, 子の同一性 (ポインタ) と
+// 種類・スカラー値だけで構造の同一性を判定できる.
+// 表は weak_ptr しか持たないので, どのスレッドからも参照されなくなったノードは普通に解放される.
+// 失効した項目は, 挿入数が表の大きさに達するたびにストライプごとにまとめて掃除する.
+// 生きている項目は子を shared_ptr で保持しているので, 子のアドレスが再利用されて誤って一致することはない.
+class InternTable {
+public:
+    static constexpr std::size_t kStripes = 64;
+
+    std::shared_ptr<Expression> constant(double v);
+    std::shared_ptr<Expression> variable(const std::string& name) { return V(name); }
+    // 子は同じ表から得たノードであること
+    std::shared_ptr<Expression> add(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r);
+    std::shared_ptr<Expression> mul(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r);
+    std::shared_ptr<Expression> pow(std::shared_ptr<Expression> base, double exponent);
+    std::shared_ptr<Expression> sum(std::vector<std::shared_ptr<Expression>> ops, double coeff);
+    std::shared_ptr<Expression> product(std::vector<std::shared_ptr<Expression>> ops, double coeff);
+    // 任意の木を葉から順に表へ登録し, 共有された同値なノードを返す
+    std::shared_ptr<Expression> intern(const std::shared_ptr<Expression>& e);
+
+    std::size_t size() const;          // 生きている項目数
+    std::size_t contended() const;     // ロックの取得で待たされた回数
+    std::size_t hits() const;          // 既存ノードを返した回数
+
+private:
+    enum class Kind : std::uint8_t { Constant, Add, Mul, Pow, Sum, Product };
+    struct Key {
+        Kind kind;
+        double scalar;  // 定数値, 指数, n 項の係数
+        std::span<const std::shared_ptr<Expression>> children;
+    };
+    struct alignas(64) Stripe {
+        mutable std::mutex mtx;
+        std::unordered_multimap<std::size_t, std::weak_ptr<Expression>> entries;  // ハッシュ -> ノード
+        std::size_t inserts_since_sweep = 0;
+        std::atomic<std::size_t> contended{0}, hits{0};
+    };
+    std::array<Stripe, kStripes> stripes_;
+
+    static std::size_t hash_of(const Key& k);
+    static bool matches(const Expression* e, const Key& k);
+    template <class Make>
+    std::shared_ptr<Expression> find_or_insert(const Key& k, Make make);
+};
+
+std::size_t InternTable::hash_of(const Key& k) {
+    auto mix = [](std::uint64_t h, std::uint64_t v) {
+        h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+        return h;
+    };
+    std::uint64_t h = mix(static_cast<std::uint64_t>(k.kind), std::bit_cast<std::uint64_t>(k.scalar));
+    for (auto& c : k.children) h = mix(h, reinterpret_cast<std::uintptr_t>(c.get()));
+    // 上位ビットでストライプ, 下位ビットでバケットを選ぶので最後にかき混ぜる
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return static_cast<std::size_t>(h);
+}
+
+bool InternTable::matches(const Expression* e, const Key& k) {
+    auto same = [&](std::initializer_list<const Expression*> kids) {
+        return std::equal(kids.begin(), kids.end(), k.children.begin(), k.children.end(),
+                          [](const Expression* a, const std::shared_ptr<Expression>& b) { return a == b.get(); });
+    };
+    auto same_bits = [](double a, double b) { return std::bit_cast<std::uint64_t>(a) == std::bit_cast<std::uint64_t>(b); };
+    switch (k.kind) {
+    case Kind::Constant: {
+        auto c = as<Constant>(e);
+        return c && same_bits(c->value, k.scalar);
+    }
+    case Kind::Add: {
+        auto a = as<Add>(e);
+        return a && same({a->left.get(), a->right.get()});
+    }
+    case Kind::Mul: {
+        auto m = as<Multiply>(e);
+        return m && same({m->left.get(), m->right.get()});
+    }
+    case Kind::Pow: {
+        auto p = as<Pow>(e);
+        return p && same_bits(p->exponent, k.scalar) && same({p->base.get()});
+    }
+    case Kind::Sum:
+    case Kind::Product: {
+        auto n = k.kind == Kind::Sum ? static_cast<const NaryOp*>(as<Sum>(e)) : static_cast<const NaryOp*>(as<Product>(e));
+        return n && same_bits(n->coeff, k.scalar) &&
+               std::equal(n->operands.begin(), n->operands.end(), k.children.begin(), k.children.end(),
+                          [](auto& a, auto& b) { return a.get() == b.get(); });
+    }
+    }
+    return false;
+}
+
+template <class Make>
+std::shared_ptr<Expression> InternTable::find_or_insert(const Key& k, Make make) {
+    auto h = hash_of(k);
+    auto& s = stripes_[h >> (sizeof(std::size_t) * CHAR_BIT - 6)];
+    static_assert(kStripes == 64);
+    std::unique_lock lock(s.mtx, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        s.contended.fetch_add(1, std::memory_order_relaxed);
+        lock.lock();
+    }
+    auto [b, e] = s.entries.equal_range(h);
+    for (auto it = b; it != e; ++it)
+        if (auto node = it->second.lock(); node && matches(node.get(), k)) {
+            s.hits.fetch_add(1, std::memory_order_relaxed);
+            return node;
+        }
+    // 新しいノードはロックを持ったまま作る (同じノードを 2 つのスレッドが同時に登録しないように)
+    std::shared_ptr<Expression> node = make();
+    s.entries.emplace(h, node);
+    if (++s.inserts_since_sweep >= std::max<std::size_t>(s.entries.size(), 1024)) {
+        std::erase_if(s.entries, [](auto& kv) { return kv.second.expired(); });
+        s.inserts_since_sweep = 0;
+    }
+    return node;
+}
+
+std::shared_ptr<Expression> InternTable::constant(double v) {
+    if (is_cached_small_int(v)) return C(v);
+    return find_or_insert({Kind::Constant, v, {}}, [&] { return C(v); });
+}
+std::shared_ptr<Expression> InternTable::add(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) {
+    std::array kids{std::move(l), std::move(r)};
+    return find_or_insert({Kind::Add, 0, kids}, [&] { return make_add(kids[0], kids[1]); });
+}
+std::shared_ptr<Expression> InternTable::mul(std::shared_ptr<Expression> l, std::shared_ptr<Expression> r) {
+    std::array kids{std::move(l), std::move(r)};
+    return find_or_insert({Kind::Mul, 0, kids}, [&] { return make_mul(kids[0], kids[1]); });
+}
+std::shared_ptr<Expression> InternTable::pow(std::shared_ptr<Expression> base, double exponent) {
+    std::array kids{std::move(base)};
+    return find_or_insert({Kind::Pow, exponent, kids}, [&] { return make_pow(kids[0], exponent); });
+}
+// make_sum/make_product と違い平坦化・定数の畳み込みはしない (与えた形のまま共有する)
+std::shared_ptr<Expression> InternTable::sum(std::vector<std::shared_ptr<Expression>> ops, double coeff) {
+    return find_or_insert({Kind::Sum, coeff, ops}, [&] { return std::shared_ptr<Sum>(new Sum(coeff, ops)); });
+}
+std::shared_ptr<Expression> InternTable::product(std::vector<std::shared_ptr<Expression>> ops, double coeff) {
+    return find_or_insert({Kind::Product, coeff, ops}, [&] { return std::shared_ptr<Product>(new Product(coeff, ops)); });
+}
+
+std::shared_ptr<Expression> InternTable::intern(const std::shared_ptr<Expression>& root) {
+    std::unordered_map<const Expression*, std::shared_ptr<Expression>> done;
+    std::vector<std::pair<std::shared_ptr<Expression>, bool>> stack{{root, false}};
+    while (!stack.empty()) {
+        auto [e, expanded] = stack.back();
+        if (done.count(e.get())) {
+            stack.pop_back();
+            continue;
+        }
+        auto kids = expanded_children_of(e.get());
+        if (!expanded) {
+            stack.back().second = true;
+            for (auto& k : kids)
+                if (!done.count(k.get())) stack.emplace_back(k, false);
+            continue;
+        }
+        stack.pop_back();
+        for (auto& k : kids) k = done.at(k.get());
+        std::shared_ptr<Expression> r;
+        if (as<Derivative>(e.get())) r = kids[0];  // 遅延微分は展開した式として共有する
+        else if (auto c = as<Constant>(e.get())) r = constant(c->value);
+        else if (auto v = as<Variable>(e.get())) r = variable(v->name);
+        else if (as<Add>(e.get())) r = add(kids[0], kids[1]);
+        else if (as<Multiply>(e.get())) r = mul(kids[0], kids[1]);
+        else if (auto p = as<Pow>(e.get())) r = pow(kids[0], p->exponent);
+        else if (auto s = as<Sum>(e.get())) r = sum(std::move(kids), s->coeff);
+        else if (auto pr = as<Product>(e.get())) r = product(std::move(kids), pr->coeff);
+        else throw std::runtime_error("InternTable::intern: 未対応のノード: " + e->to_string());
+        done.emplace(e.get(), std::move(r));
+    }
+    return done.at(root.get());
+}
+
+std::size_t InternTable::size() const {
+    std::size_t n = 0;
+    for (auto& s : stripes_) {
+        std::lock_guard lock(s.mtx);
+        for (auto& [h, node] : s.entries) n += !node.expired();
+    }
+    return n;
+}
+std::size_t InternTable::contended() const {
+    std::size_t n = 0;
+    for (auto& s : stripes_) n += s.contended.load(std::memory_order_relaxed);
+    return n;
+}
+std::size_t InternTable::hits() const {
+    std::size_t n = 0;
+    for (auto& s : stripes_) n += s.hits.load(std::memory_order_relaxed);
+    return n;
+}
+
+// プロセス全体で共有する表 (C/V の表と同じく解放しない)
+InternTable& shared_interner() {
+    static auto* table = new InternTable();
+    return *table;
+}
+
+//-------------------------------------------------
+// 16. スカラー型に依らない評価 (float, long double, 二重数, 区間, SIMD パック)
+//-------------------------------------------------
+// evaluate(double) と同じく全ての変数を x とみなして評価する. ノードのクラスは増やさず,
+// スカラー型 T の演算 (double からの構築, +, *, power(T, double)) だけを要求する.
+template<typename T>
+T evaluate_derivative_as(const Derivative* d, const T& x);
+
+template<typename T>
+T evaluate_as(const Expression* e, const T& x) {
+    if (auto c = as<Constant>(e)) return T(c->value);
+    if (as<Variable>(e)) return x;
+    if (auto a = as<Add>(e)) return evaluate_as(a->left.get(), x) + evaluate_as(a->right.get(), x);
+    if (auto m = as<Multiply>(e)) return evaluate_as(m->left.get(), x) * evaluate_as(m->right.get(), x);
+    if (auto p = as<Pow>(e)) return power(evaluate_as(p->base.get(), x), p->exponent);
+    if (auto s = as<Sum>(e)) {
+        T acc(s->coeff);
+        for (auto& op : s->operands) acc = acc + evaluate_as(op.get(), x);
+        return acc;
+    }
+    if (auto pr = as<Product>(e)) {
+        T acc(pr->coeff);
+        for (auto& op : pr->operands) acc = acc * evaluate_as(op.get(), x);
+        return acc;
+    }
+    if (auto d = as<Derivative>(e)) return evaluate_derivative_as(d, x);
+    throw std::runtime_error("evaluate_as: 未対応のノード: " + e->to_string());
+}
+
+// 二重数 v + d ε (ε^2 = 0). x = {x, 1} で評価すると d に導関数の値が得られる
+template<typename T>
+struct Dual {
+    T v{}, d{};
+    Dual() = default;
+    explicit Dual(double c) : v(static_cast<T>(c)) {}
+    Dual(T value, T deriv) : v(value), d(deriv) {}
+};
+template<typename T> Dual<T> operator+(const Dual<T>& a, const Dual<T>& b) { return {a.v + b.v, a.d + b.d}; }
+template<typename T> Dual<T> operator*(const Dual<T>& a, const Dual<T>& b) { return {a.v * b.v, a.d * b.v + a.v * b.d}; }
+template<typename T>
+Dual<T> power(const Dual<T>& a, double e) {
+    if (e == 0) return Dual<T>(1.0);
+    if (e == 1) return a;
+    return {power(a.v, e), static_cast<T>(e) * power(a.v, e - 1) * a.d};
+}
+
+// 閉区間 [lo, hi]. 演算結果の端点は 1 ulp 外側へ丸めるので, 真の値域を必ず含む.
+// (最近接丸めの誤差は 0.5 ulp 以内. 丸めモードの切り替えより安く, コンパイラの最適化にも左右されない)
+struct Interval {
+    double lo = 0, hi = 0;
+    Interval() = default;
+    explicit Interval(double c) : lo(c), hi(c) {}
+    Interval(double l, double h) : lo(l), hi(h) {}
+    bool contains(double v) const { return lo <= v && v <= hi; }
+    double width() const { return hi - lo; }
+    double mid() const { return lo + (hi - lo) / 2; }
+};
+
+namespace interval_detail {
+constexpr double kInf = std::numeric_limits<double>::infinity();
+inline double down(double v) { return std::nextafter(v, -kInf); }
+inline double up(double v) { return std::nextafter(v, kInf); }
+// 区間演算の慣習どおり 0 * inf = 0
+inline double mul(double a, double b) { return a == 0 || b == 0 ? 0.0 : a * b; }
+
+// x >= 0 の x^n を下側 (Up = false) または上側に丸めて求める. 途中の値も全て非負なので丸めの向きが保たれる
+template<bool Up>
+double pow_bound(double x, unsigned n) {
+    double r = 1;
+    while (n) {
+        if (n & 1) r = Up ? up(r * x) : down(r * x);
+        x = Up ? up(x * x) : std::max(0.0, down(x * x));
+        n >>= 1;
+    }
+    return Up ? r : std::max(0.0, r);
+}
+}  // namespace interval_detail
+
+Interval operator+(const Interval& a, const Interval& b) {
+    return {interval_detail::down(a.lo + b.lo), interval_detail::up(a.hi + b.hi)};
+}
+Interval operator-(const Interval& a, const Interval& b) {
+    return {interval_detail::down(a.lo - b.hi), interval_detail::up(a.hi - b.lo)};
+}
+Interval operator*(const Interval& a, const Interval& b) {
+    using interval_detail::mul;
+    double p[] = {mul(a.lo, b.lo), mul(a.lo, b.hi), mul(a.hi, b.lo), mul(a.hi, b.hi)};
+    return {interval_detail::down(*std::min_element(std::begin(p), std::end(p))),
+            interval_detail::up(*std::max_element(std::begin(p), std::end(p)))};
+}
+// 共通部分 (空なら lo > hi)
+Interval intersect(const Interval& a, const Interval& b) { return {std::max(a.lo, b.lo), std::min(a.hi, b.hi)}; }
+
+Interval power(const Interval& a, double e) {
+    using namespace interval_detail;
+    constexpr double nan = std::numeric_limits<double>::quiet_NaN();
+    if (e == 0) return Interval(1.0);
+    if (e == 1) return a;
+    if (!is_int_exponent(e)) {
+        // 実数の指数は非負の底でのみ定義される. 単調なので端点で足り, std::pow の誤差 (1 ulp 未満) の分を 2 ulp 広げる
+        // 定義域の外は除く (外側への丸めで 0 が [-4.9e-324, ...] になるので, 負の端点は 0 に寄せる)
+        if (a.hi < 0) return {nan, nan};
+        double l = std::pow(std::max(a.lo, 0.0), e), h = std::pow(a.hi, e);
+        if (e < 0) std::swap(l, h);
+        return {std::max(0.0, down(down(l))), up(up(h))};
+    }
+    auto n = static_cast<unsigned>(std::abs(e));
+    bool even = n % 2 == 0;
+    if (e < 0 && a.contains(0)) return even ? Interval{0, kInf} : Interval{-kInf, kInf};
+    Interval p;
+    if (even) {
+        // 偶数乗は |x| について単調
+        double mig = a.contains(0) ? 0 : std::min(std::abs(a.lo), std::abs(a.hi));
+        double mag = std::max(std::abs(a.lo), std::abs(a.hi));
+        p = {pow_bound<false>(mig, n), pow_bound<true>(mag, n)};
+    } else {
+        // 奇数乗は単調増加. 負の端点は絶対値の逆向きの丸めで求める
+        p.lo = a.lo >= 0 ? pow_bound<false>(a.lo, n) : -pow_bound<true>(-a.lo, n);
+        p.hi = a.hi >= 0 ? pow_bound<true>(a.hi, n) : -pow_bound<false>(-a.hi, n);
+    }
+    if (e > 0) return p;
+    // 負の指数: p は 0 を含まないので 1/x は単調減少
+    return {down(1 / p.hi), up(1 / p.lo)};
+}
+
+// N レーンを同時に計算する値 (各演算はレーンごとの固定長ループで, コンパイラがベクトル命令にする)
+template<typename T, std::size_t N>
+struct Pack {
+    alignas(sizeof(T) * N) std::array<T, N> lane;
+    Pack() = default;
+    explicit Pack(double c) { lane.fill(static_cast<T>(c)); }
+};
+template<typename T, std::size_t N>
+Pack<T, N> operator+(const Pack<T, N>& a, const Pack<T, N>& b) {
+    Pack<T, N> r;
+    for (std::size_t i = 0; i < N; ++i) r.lane[i] = a.lane[i] + b.lane[i];
+    return r;
+}
+template<typename T, std::size_t N>
+Pack<T, N> operator*(const Pack<T, N>& a, const Pack<T, N>& b) {
+    Pack<T, N> r;
+    for (std::size_t i = 0; i < N; ++i) r.lane[i] = a.lane[i] * b.lane[i];
+    return r;
+}
+template<typename T, std::size_t N>
+Pack<T, N> power(const Pack<T, N>& a, double e) {
+    // 小さい正の整数指数はレーンごとの乗算の列で済ませる
+    if (is_int_exponent(e) && e > 0 && e <= 64) return ipow(a, static_cast<unsigned>(e));
+    Pack<T, N> r;
+    for (std::size_t i = 0; i < N; ++i) r.lane[i] = power(a.lane[i], e);
+    return r;
+}
+template<typename T, std::size_t N>
+Pack<T, N> fused_multiply_add(const Pack<T, N>& a, const Pack<T, N>& b, const Pack<T, N>& c) {
+    Pack<T, N> r;
+    for (std::size_t i = 0; i < N; ++i) r.lane[i] = std::fma(a.lane[i], b.lane[i], c.lane[i]);
+    return r;
+}
+
+// 64 バイトのパック (float なら 16 レーン, double なら 8 レーン) 単位でテープを評価する.
+// evaluate(double) と同じく, テープの全ての入力に x を与える
+// (TapeT は Tape と RegisterTape のどちらでもよい)
+template<typename T, std::size_t N = 64 / sizeof(T), typename TapeT>
+void evaluate_batch(const TapeT& tape, std::span<const T> xs, std::span<T> out) {
+    using P = Pack<T, N>;
+    std::vector<P> inputs(tape.variables.size()), values;
+    for (std::size_t base = 0; base < xs.size(); base += N) {
+        std::size_t n = std::min(N, xs.size() - base);
+        P x;
+        for (std::size_t i = 0; i < N; ++i) x.lane[i] = xs[base + std::min(i, n - 1)];
+        std::fill(inputs.begin(), inputs.end(), x);
+        tape.template forward_as<P>(inputs, values);
+        const P& r = values[tape.outputs[0]];
+        std::copy_n(r.lane.begin(), n, out.begin() + base);
+    }
+}
+
+// 全ての出力を 1 回の走査で求め, 行優先 (out[i * 出力数 + k]) で書く. 共通部分式は
+// Tape::compile でまとめてあるので, 同じ x での関連する式の族を一度に評価するのに使う
+template<typename T, std::size_t N = 64 / sizeof(T), typename TapeT>
+void evaluate_batch_all(const TapeT& tape, std::span<const T> xs, std::span<T> out) {
+    using P = Pack<T, N>;
+    static thread_local std::vector<P> inputs, values;
+    inputs.resize(tape.variables.size());
+    std::size_t m = tape.outputs.size();
+    for (std::size_t base = 0; base < xs.size(); base += N) {
+        std::size_t n = std::min(N, xs.size() - base);
+        P x;
+        for (std::size_t i = 0; i < N; ++i) x.lane[i] = xs[base + std::min(i, n - 1)];
+        std::fill(inputs.begin(), inputs.end(), x);
+        tape.template forward_as<P>(inputs, values);
+        for (std::size_t i = 0; i < n; ++i)
+            for (std::size_t k = 0; k < m; ++k) out[(base + i) * m + k] = values[tape.outputs[k]].lane[i];
+    }
+}
+
+//-------------------------------------------------
+// 17. 区間による値域の保証と分枝限定法
+//-------------------------------------------------
+// f の X 上の値域を含む区間. 自然な区間拡張と平均値形式 f(m) + f'(X) (X - m) の共通部分をとる
+// (平均値形式は X が狭いほど過大評価が小さい)
+Interval enclose(const Expression* f, const Expression* df, const Interval& X) {
+    auto natural = evaluate_as(f, X);
+    double m = X.mid();
+    auto mean_value = evaluate_as(f, Interval(m)) + evaluate_as(df, X) * (X - Interval(m));
+    auto r = intersect(natural, mean_value);
+    return r.lo <= r.hi ? r : natural;  // NaN を含むときは自然な拡張に戻す
+}
+
+// 区間 domain 上の f の最小値の保証付き囲み. value.lo <= min f <= value.hi, value.hi = f(argmin) の上界
+struct IntervalMinimum {
+    Interval value;
+    double argmin = 0;
+    std::size_t boxes = 0;   // 調べた部分区間の数
+    std::size_t pruned = 0;  // 下界が暫定最小値を超えて捨てた部分区間の数
+    std::size_t monotone = 0;  // f' が符号一定で端点に置き換えた部分区間の数
+};
+
+// 下界の小さい部分区間から順に調べる分枝限定法. 下界が暫定最小値 (評価した点の上界の最小) を超える区間は捨て,
+// f' の区間が 0 を含まない区間は内部に極小がないので端点 1 つに置き換える.
+// 暫定最小値と残りの区間の下界の差が tol 以下になるか, max_boxes 個を調べたら止める
+IntervalMinimum minimize_interval(const std::shared_ptr<Expression>& f, Interval domain,
+                                  double tol = 1e-9, std::size_t max_boxes = 100000) {
+    auto df = f->derivative()->simplify();
+    IntervalMinimum result;
+    struct Box {
+        Interval x;
+        double lower;
+        bool operator>(const Box& o) const { return lower > o.lower; }
+    };
+    std::vector<Box> heap;
+    double best = std::numeric_limits<double>::infinity();
+    auto sample = [&](double x) {
+        double hi = evaluate_as(f.get(), Interval(x)).hi;
+        if (!std::isnan(hi) && hi < best) {  // 定義されない点は暫定最小値にしない
+            best = hi;
+            result.argmin = x;
+        }
+    };
+    auto push = [&](Interval x) {
+        double lower = x.width() == 0 ? evaluate_as(f.get(), x).lo : enclose(f.get(), df.get(), x).lo;
+        if (std::isnan(lower)) lower = -std::numeric_limits<double>::infinity();  // 下界が分からなければ捨てない
+        if (lower > best) {
+            ++result.pruned;
+            return;
+        }
+        heap.push_back({x, lower});
+        std::push_heap(heap.begin(), heap.end(), std::greater<>{});
+    };
+    sample(domain.lo);
+    sample(domain.hi);
+    sample(domain.mid());
+    push(domain);
+
+    double lower = -std::numeric_limits<double>::infinity();
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), std::greater<>{});
+        Box b = heap.back();
+        heap.pop_back();
+        lower = b.lower;
+        if (b.lower > best) {
+            ++result.pruned;
+            continue;
+        }
+        if (best - b.lower <= tol || result.boxes >= max_boxes) break;
+        ++result.boxes;
+        double m = b.x.mid();
+        if (b.x.width() == 0 || m <= b.x.lo || m >= b.x.hi) {
+            // これ以上分けられない
+            lower = b.lower;
+            break;
+        }
+        auto d = evaluate_as(df.get(), b.x);
+        if (d.lo > 0 || d.hi < 0) {
+            // 単調: 最小は小さい側の端点
+            ++result.monotone;
+            double x = d.lo > 0 ? b.x.lo : b.x.hi;
+            sample(x);
+            push(Interval(x));
+            continue;
+        }
+        sample(m);
+        push({b.x.lo, m});
+        push({m, b.x.hi});
+    }
+    if (heap.empty() && lower > best) lower = best;
+    result.value = {std::min(lower, best), best};
+    return result;
+}
+
+//-------------------------------------------------
+// 18. コンパイル時の式 (式テンプレート)
+//-------------------------------------------------
+// 式の形を型で表す. ノードは空の構造体で, 定数は非型テンプレート引数に持つ.
+// 微分と簡約は型の計算としてコンパイル時に済み, 評価はインライン展開されて直線的なコードになる.
+// to_runtime() で実行時の Expression 木に変換できる.
+namespace ct {
+template<double V>
+struct Const {
+    static constexpr double value = V;
+    constexpr double operator()(double) const { return V; }
+};
+struct X {
+    constexpr double operator()(double x) const { return x; }
+};
+template<typename L, typename R>
+struct Add {
+    constexpr double operator()(double x) const { return L{}(x) + R{}(x); }
+};
+template<typename L, typename R>
+struct Mul {
+    constexpr double operator()(double x) const { return L{}(x) * R{}(x); }
+};
+
+template<typename T> constexpr bool is_const = false;
+template<double V> constexpr bool is_const<Const<V>> = true;
+template<typename T> constexpr bool is_expr = is_const<T> || std::is_same_v<T, X>;
+template<typename L, typename R> constexpr bool is_expr<Add<L, R>> = true;
+template<typename L, typename R> constexpr bool is_expr<Mul<L, R>> = true;
+template<typename T> concept Expr = is_expr<T>;
+
+template<typename T, double V>
+constexpr bool is_value() {
+    if constexpr (is_const<T>) return T::value == V;
+    else return false;
+}
+
+// 簡約しながら組み立てる (Sum/Product::simplify_uncached と同じ畳み込みの型版)
+template<Expr L, Expr R>
+constexpr auto add(L, R) {
+    if constexpr (is_const<L> && is_const<R>) return Const<L::value + R::value>{};
+    else if constexpr (is_value<L, 0.0>()) return R{};
+    else if constexpr (is_value<R, 0.0>()) return L{};
+    else if constexpr (std::is_same_v<L, R>) return Mul<Const<2.0>, L>{};
+    else return Add<L, R>{};
+}
+template<Expr L, Expr R>
+constexpr auto mul(L, R) {
+    if constexpr (is_const<L> && is_const<R>) return Const<L::value * R::value>{};
+    else if constexpr (is_value<L, 0.0>() || is_value<R, 0.0>()) return Const<0.0>{};
+    else if constexpr (is_value<L, 1.0>()) return R{};
+    else if constexpr (is_value<R, 1.0>()) return L{};
+    else if constexpr (is_const<R>) return mul(R{}, L{});  // 定数は左に寄せる
+    else return Mul<L, R>{};
+}
+template<Expr L, Expr R> constexpr auto operator+(L l, R r) { return add(l, r); }
+template<Expr L, Expr R> constexpr auto operator*(L l, R r) { return mul(l, r); }
+
+template<double V> constexpr Const<V> c{};
+constexpr X x{};
+
+template<double V> constexpr auto derivative(Const<V>) { return Const<0.0>{}; }
+constexpr auto derivative(X) { return Const<1.0>{}; }
+template<typename L, typename R> constexpr auto derivative(Add<L, R>) { return derivative(L{}) + derivative(R{}); }
+template<typename L, typename R>
+constexpr auto derivative(Mul<L, R>) { return derivative(L{}) * R{} + L{} * derivative(R{}); }
+
+template<double V> std::shared_ptr<Expression> to_runtime(Const<V>) { return C(V); }
+inline std::shared_ptr<Expression> to_runtime(X) { return V(); }
+template<typename L, typename R> std::shared_ptr<Expression> to_runtime(Add<L, R>) { return make_add(to_runtime(L{}), to_runtime(R{})); }
+template<typename L, typename R> std::shared_ptr<Expression> to_runtime(Mul<L, R>) { return make_mul(to_runtime(L{}), to_runtime(R{})); }
+}  // namespace ct
+
+//-------------------------------------------------
+// 19. メモリマップした列ファイルの逐次評価
+//-------------------------------------------------
+// 生の double/float 列ファイルを mmap し, キャッシュに収まるブロックごとにテープで評価して,
+// 結果を出力ファイルのマッピングへ直接書く. 処理済みの範囲はチャンクごとに手放すので,
+// ファイルが物理メモリより大きくても常駐量はチャンク程度にとどまる.
+// 出力は標本ごとに tape.outputs の順で double を並べた行優先の配列.
+enum class ColumnType { Float64, Float32 };
+
+// madvise などに渡すアドレスを揃える単位 (4K とは限らない. 16K, 64K の核もある)
+std::size_t page_size() {
+    static const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    return page;
+}
+
+// 読み込み専用または読み書きのファイルマッピング (所有権は移動のみ)
+class MappedFile {
+public:
+    static MappedFile open_read(const std::string& path);
+    static MappedFile create(const std::string& path, std::size_t size);
+    MappedFile(MappedFile&& o) noexcept : data_(std::exchange(o.data_, nullptr)), size_(std::exchange(o.size_, 0)) {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { if (data_) munmap(data_, size_); }
+
+    std::byte* data() const { return static_cast<std::byte*>(data_); }
+    std::size_t size() const { return size_; }
+    // [offset, offset + length) のページを手放す (ファイルの内容は残る)
+    void release(std::size_t offset, std::size_t length) const;
+
+private:
+    MappedFile(void* data, std::size_t size) : data_(data), size_(size) {}
+    void* data_;
+    std::size_t size_;
+};
+
+MappedFile MappedFile::open_read(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("MappedFile: 開けない: " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("MappedFile: 大きさを取れない: " + path);
+    }
+    auto size = static_cast<std::size_t>(st.st_size);
+    void* p = size ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : nullptr;
+    ::close(fd);
+    if (p == MAP_FAILED) throw std::runtime_error("MappedFile: mmap に失敗: " + path);
+    if (p) madvise(p, size, MADV_SEQUENTIAL);
+    return MappedFile(p, size);
+}
+
+MappedFile MappedFile::create(const std::string& path, std::size_t size) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw std::runtime_error("MappedFile: 作れない: " + path);
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+        ::close(fd);
+        throw std::runtime_error("MappedFile: 大きさを設定できない: " + path);
+    }
+    void* p = size ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : nullptr;
+    ::close(fd);
+    if (p == MAP_FAILED) throw std::runtime_error("MappedFile: mmap に失敗: " + path);
+    return MappedFile(p, size);
+}
+
+void MappedFile::release(std::size_t offset, std::size_t length) const {
+    std::size_t page = page_size();
+    std::size_t begin = offset / page * page, end = std::min(size_, offset + length) / page * page;
+    if (end <= begin) return;
+    // 共有マッピングの書き込み済みページはページキャッシュに残るので, 書き出しを始めてから外す
+    msync(data() + begin, end - begin, MS_ASYNC);
+    madvise(data() + begin, end - begin, MADV_DONTNEED);
+}
+
+// 現在の常駐メモリ量 (バイト)
+std::size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    std::size_t total = 0, resident = 0;
+    statm >> total >> resident;
+    return resident * page_size();
+}
+
+struct StreamStats {
+    std::size_t samples = 0;
+    std::size_t bytes_in = 0, bytes_out = 0;
+    double seconds = 0;
+    std::size_t peak_resident = 0;  // 評価中に観測した常駐メモリ量の最大
+    double gb_per_s() const { return (bytes_in + bytes_out) / seconds / 1e9; }
+};
+
+namespace stream_detail {
+constexpr std::size_t kBlock = 2048;              // 1 ブロックの標本数 (入力 16 KiB)
+constexpr std::size_t kChunk = std::size_t{1} << 20;  // この標本数ごとに処理済みのページを手放す
+
+// xs の各標本で全出力を求め, 行優先で out に書く (evaluate(double) と同じく全入力に x を与える)
+void evaluate_block(const Tape& tape, std::span<const double> xs, double* out) {
+    evaluate_batch_all<double, 8>(tape, xs, {out, xs.size() * tape.outputs.size()});
+}
+}  // namespace stream_detail
+
+StreamStats stream_evaluate(const Tape& tape, const std::string& input, ColumnType type, const std::string& output) {
+    using namespace stream_detail;
+    StreamStats st;
+    auto in = MappedFile::open_read(input);
+    std::size_t width = type == ColumnType::Float64 ? sizeof(double) : sizeof(float);
+    if (in.size() % width) throw std::runtime_error("stream_evaluate: 列の大きさが型の倍数でない: " + input);
+    std::size_t n = in.size() / width, m = tape.outputs.size();
+    auto out = MappedFile::create(output, n * m * sizeof(double));
+    auto* dst = reinterpret_cast<double*>(out.data());
+
+    std::array<double, kBlock> block;
+    st.seconds = measure_ms([&] {
+        for (std::size_t chunk = 0; chunk < n; chunk += kChunk) {
+            std::size_t chunk_end = std::min(n, chunk + kChunk);
+            // 出力ページの書き込み時フォールトを 1 回の呼び出しにまとめる (未対応の核なら何もしない)
+            std::size_t from = chunk * m * sizeof(double), to = chunk_end * m * sizeof(double);
+            std::size_t aligned = from / page_size() * page_size();
+            madvise(out.data() + aligned, to - aligned, MADV_POPULATE_WRITE);
+            for (std::size_t b = chunk; b < chunk_end; b += kBlock) {
+                std::size_t len = std::min(kBlock, chunk_end - b);
+                std::span<const double> xs;
+                if (type == ColumnType::Float64) {
+                    xs = {reinterpret_cast<const double*>(in.data()) + b, len};
+                } else {
+                    auto* src = reinterpret_cast<const float*>(in.data()) + b;
+                    std::copy_n(src, len, block.begin());
+                    xs = {block.data(), len};
+                }
+                evaluate_block(tape, xs, dst + b * m);
+            }
+            st.peak_resident = std::max(st.peak_resident, resident_bytes());
+            in.release(chunk * width, (chunk_end - chunk) * width);
+            out.release(chunk * m * sizeof(double), (chunk_end - chunk) * m * sizeof(double));
+        }
+    }) / 1e3;
+    st.samples = n;
+    st.bytes_in = in.size();
+    st.bytes_out = out.size();
+    return st;
+}
+
+// CSV の遅い経路: column 列目 (0 始まり) を読み, 同じ形式の出力ファイルへ追記する. 数値でない行 (見出しなど) は飛ばす
+StreamStats stream_evaluate_csv(const Tape& tape, const std::string& input, std::size_t column, const std::string& output) {
+    using namespace stream_detail;
+    StreamStats st;
+    std::ifstream in(input);
+    if (!in) throw std::runtime_error("stream_evaluate_csv: 開けない: " + input);
+    std::ofstream out(output, std::ios::binary | std::ios::trunc);
+    std::vector<double> xs, ys(kBlock * tape.outputs.size());
+    xs.reserve(kBlock);
+    auto flush = [&] {
+        evaluate_block(tape, xs, ys.data());
+        out.write(reinterpret_cast<const char*>(ys.data()), static_cast<std::streamsize>(xs.size() * tape.outputs.size() * sizeof(double)));
+        st.samples += xs.size();
+        xs.clear();
+    };
+    std::string line;
+    st.seconds = measure_ms([&] {
+        while (std::getline(in, line)) {
+            st.bytes_in += line.size() + 1;
+            std::size_t begin = 0;
+            for (std::size_t c = 0; c < column && begin != std::string::npos; ++c) {
+                begin = line.find(',', begin);
+                if (begin != std::string::npos) ++begin;
+            }
+            if (begin == std::string::npos) continue;
+            while (begin < line.size() && line[begin] == ' ') ++begin;
+            double v;
+            auto [ptr, ec] = std::from_chars(line.data() + begin, line.data() + line.size(), v);
+            if (ec != std::errc()) continue;
+            xs.push_back(v);
+            if (xs.size() == kBlock) flush();
+        }
+        if (!xs.empty()) flush();
+        out.flush();
+    }) / 1e3;
+    st.bytes_out = st.samples * tape.outputs.size() * sizeof(double);
+    st.peak_resident = resident_bytes();
+    return st;
+}
+
+//-------------------------------------------------
+// 20. ディスク上の結果キャッシュ (構造ハッシュで引く)
+//-------------------------------------------------
+// 小さな二進形式. ヘッダ "EXPR" + 版 + ノード数の後に, 帰りがけ順のノード列が続き, 最後のノードが根.
+// 各ノードは種類 1 バイトと内容で, 子は「自分の番号 - 子の番号」の可変長整数で参照する (共有も保たれる).
+//   Constant: double / Variable: 長さ + 名前 / Add, Multiply: 子 2 つ / Pow: 子 + 指数
+//   Sum, Product: 係数 + 子の数 + 子 / Derivative: 子 (展開せずに書く)
+namespace binary_format {
+enum Tag : std::uint8_t { kConstant = 1, kVariable, kAdd, kMultiply, kPow, kSum, kProduct, kDerivative };
+constexpr std::string_view kMagic = "EXPR";
+constexpr std::uint8_t kVersion = 1;
+
+void put_varint(std::string& out, std::uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+void put_double(std::string& out, double v) {
+    auto bits = std::bit_cast<std::array<char, sizeof(double)>>(v);
+    out.append(bits.data(), bits.size());
+}
+
+struct Reader {
+    std::string_view in;
+    std::size_t pos = 0;
+    void need(std::size_t n) const {
+        if (in.size() - pos < n) throw std::runtime_error("binary_format: データが途中で終わっている");
+    }
+    std::uint8_t byte() {
+        need(1);
+        return static_cast<std::uint8_t>(in[pos++]);
+    }
+    std::uint64_t varint() {
+        std::uint64_t v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            auto b = byte();
+            v |= std::uint64_t{b & 0x7fu} << shift;
+            if (!(b & 0x80)) return v;
+        }
+        throw std::runtime_error("binary_format: 可変長整数が長すぎる");
+    }
+    double real() {
+        need(sizeof(double));
+        std::array<char, sizeof(double)> bits;
+        std::copy_n(in.data() + pos, bits.size(), bits.begin());
+        pos += bits.size();
+        return std::bit_cast<double>(bits);
+    }
+};
+}  // namespace binary_format
+
+std::string serialize(const std::shared_ptr<Expression>& root) {
+    using namespace binary_format;
+    std::string body;
+    std::uint64_t count = 0;
+    // 畳み込みの値はノードの番号
+    fold_postorder<std::uint64_t>(root, [&](const Expression* e, std::span<const std::uint64_t> kids) {
+        std::uint64_t self = count++;
+        auto put_kids = [&] { for (auto k : kids) put_varint(body, self - k); };
+        if (auto c = as<Constant>(e)) {
+            body.push_back(kConstant);
+            put_double(body, c->value);
+        } else if (auto v = as<Variable>(e)) {
+            body.push_back(kVariable);
+            put_varint(body, v->name.size());
+            body += v->name;
+        } else if (as<Add>(e) || as<Multiply>(e)) {
+            body.push_back(as<Add>(e) ? kAdd : kMultiply);
+            put_kids();
+        } else if (auto p = as<Pow>(e)) {
+            body.push_back(kPow);
+            put_kids();
+            put_double(body, p->exponent);
+        } else if (auto n = as<NaryOp>(e)) {
+            body.push_back(as<Sum>(e) ? kSum : kProduct);
+            put_double(body, n->coeff);
+            put_varint(body, kids.size());
+            put_kids();
+        } else if (as<Derivative>(e)) {
+            body.push_back(kDerivative);
+            put_kids();
+        } else {
+            throw std::runtime_error("serialize: 未対応のノード: " + e->to_string());
+        }
+        return self;
+    });
+    std::string out(kMagic);
+    out.push_back(static_cast<char>(kVersion));
+    put_varint(out, count);
+    return out + body;
+}
+
+std::shared_ptr<Expression> deserialize(std::string_view bytes) {
+    using namespace binary_format;
+    Reader r{bytes};
+    r.need(kMagic.size());
+    if (bytes.substr(0, kMagic.size()) != kMagic) throw std::runtime_error("deserialize: 形式が違う");
+    r.pos = kMagic.size();
+    if (r.byte() != kVersion) throw std::runtime_error("deserialize: 版が違う");
+    auto count = r.varint();
+    if (count == 0 || count > bytes.size()) throw std::runtime_error("deserialize: ノード数が不正");
+    std::vector<std::shared_ptr<Expression>> nodes;
+    nodes.reserve(count);
+    auto child = [&] {
+        auto d = r.varint();
+        if (d == 0 || d > nodes.size()) throw std::runtime_error("deserialize: 子の参照が不正");
+        return nodes[nodes.size() - d];
+    };
+    while (nodes.size() < count) {
+        switch (r.byte()) {
+        case kConstant: nodes.push_back(C(r.real())); break;
+        case kVariable: {
+            auto len = r.varint();
+            r.need(len);
+            nodes.push_back(V(std::string(bytes.substr(r.pos, len))));
+            r.pos += len;
+            break;
+        }
+        case kAdd: {
+            auto a = child(), b = child();
+            nodes.push_back(make_add(a, b));
+            break;
+        }
+        case kMultiply: {
+            auto a = child(), b = child();
+            nodes.push_back(make_mul(a, b));
+            break;
+        }
+        case kPow: {
+            auto b = child();
+            nodes.push_back(make_pow(b, r.real()));
+            break;
+        }
+        case kSum:
+        case kProduct: {
+            bool sum = static_cast<std::uint8_t>(bytes[r.pos - 1]) == kSum;
+            double coeff = r.real();
+            auto n = r.varint();
+            // 共有された子は 1 度しか書かれないので, 子の数はノード数を超えうる. 参照は 1 つ 1 バイト以上
+            r.need(n);
+            std::vector<std::shared_ptr<Expression>> ops;
+            ops.reserve(n);
+            for (std::uint64_t i = 0; i < n; ++i) ops.push_back(child());
+            // 形をそのまま復元する (make_sum/make_product の平坦化はしない)
+            if (sum) nodes.push_back(std::shared_ptr<Sum>(new Sum(coeff, std::move(ops))));
+            else nodes.push_back(std::shared_ptr<Product>(new Product(coeff, std::move(ops))));
+            break;
+        }
+        case kDerivative: nodes.push_back(make_derivative(child())); break;
+        default: throw std::runtime_error("deserialize: 不明な種類");
+        }
+    }
+    if (r.pos != bytes.size()) throw std::runtime_error("deserialize: 余分なデータがある");
+    return nodes.back();
+}
+
+// 演算名と入力の構造ハッシュで引く, ディスク上の結果キャッシュ.
+// 1 項目 1 ファイル (<演算名>-v<版>-<ハッシュ 32 桁>.expr) で, 中身は版と演算名と入力のハッシュ, 結果の二進形式.
+// 読み込み時は入力を直列化せず 128 ビットのハッシュだけを照合する (偶然の衝突は無視できる).
+// 書き込みは一時ファイルからの rename なので, 複数のジョブが同じ場所を共有してもよい.
+// 書き込みに失敗した項目は公開せず, 結果だけを返す.
+class DiskCache {
+public:
+    // derivative() / simplify() の結果や構造ハッシュ, 二進形式が変わる変更をしたら上げる.
+    // 版の違う項目は別のファイルになり, 読まれない
+    static constexpr std::uint32_t kVersion = 2;
+
+    explicit DiskCache(std::filesystem::path dir) : dir_(std::move(dir)) { std::filesystem::create_directories(dir_); }
+
+    std::shared_ptr<Expression> derivative(const std::shared_ptr<Expression>& e) {
+        return cached("derivative", e, [&] { return e->derivative(); });
+    }
+    std::shared_ptr<Expression> simplify(const std::shared_ptr<Expression>& e) {
+        return cached("simplify", e, [&] { return e->simplify(); });
+    }
+    // 任意の演算の結果をキャッシュする (op は演算を区別する名前で, ファイル名に使える文字だけにする)
+    template<typename F>
+    std::shared_ptr<Expression> cached(std::string_view op, const std::shared_ptr<Expression>& e, F&& compute);
+
+    std::size_t hits = 0, misses = 0, write_failures = 0;
+
+private:
+    std::filesystem::path dir_;
+};
+
+template<typename F>
+std::shared_ptr<Expression> DiskCache::cached(std::string_view op, const std::shared_ptr<Expression>& e, F&& compute) {
+    auto key = structural_hash(e);
+    auto path = dir_ / std::format("{}-v{}-{}.expr", op, kVersion, key.hex());
+
+    // 形式: 版 + 演算名の長さ + 演算名 + ハッシュ 16 バイト + 結果
+    std::string header;
+    binary_format::put_varint(header, kVersion);
+    binary_format::put_varint(header, op.size());
+    header += op;
+    header.append(reinterpret_cast<const char*>(&key.h1), sizeof key.h1);
+    header.append(reinterpret_cast<const char*>(&key.h2), sizeof key.h2);
+    // 大きさは開いたストリームから取る (開いた後に項目が消えたり置き換わったりしても同じファイルを読み, 失敗は外れにする)
+    if (std::ifstream f{path, std::ios::binary | std::ios::ate}) {
+        std::string data;
+        if (auto size = f.tellg(); size > 0) {
+            data.resize(static_cast<std::size_t>(size));
+            f.seekg(0);
+            f.read(data.data(), static_cast<std::streamsize>(data.size()));
+        }
+        if (f && data.size() > header.size() && std::string_view(data).substr(0, header.size()) == header) {
+            try {
+                auto r = deserialize(std::string_view(data).substr(header.size()));
+                ++hits;
+                return r;
+            } catch (const std::runtime_error&) {
+                // 壊れた項目は計算し直して上書きする
+            }
+        }
+    }
+    ++misses;
+    auto result = compute();
+    auto tmp = path;
+    tmp += std::format(".{}.{}.tmp", getpid(), std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+    f << header << serialize(result);
+    f.close();
+    std::error_code ec;
+    if (!f) {
+        ++write_failures;
+        std::filesystem::remove(tmp, ec);
+        return result;
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        ++write_failures;
+        std::filesystem::remove(tmp, ec);
+    }
+    return result;
+}
+
+//-------------------------------------------------
+// 21. 32 ビット添字の SoA 式ストア
+//-------------------------------------------------
+// ノードを 32 ビットの添字で表し, 種類・子・定数を別々の配列に持つ (1 ノード 9 バイト + 定数表).
+// ノードは追加するだけなので, 子は必ず親より前にある (位相順). 評価・微分・簡約は
+// 配列を前から 1 回なめるだけで済む. 木の evaluate と同じく変数はすべて x とみなす.
+// Sum/Product はテープと同じく左から 2 項の鎖にする. Op::Fma はテープ専用でストアには現れない.
+struct ExprStore {
+    using Ref = std::uint32_t;
+
+    std::vector<Op> kind;
+    std::vector<Ref> lhs, rhs;  // Const: lhs = 定数表の添字 / Var: lhs = 名前の添字 / Pow: lhs = 底, rhs = 指数の定数表の添字
+    std::vector<double> constants;
+    std::vector<std::string> names;
+
+    Ref constant(double v);
+    Ref variable(const std::string& name);
+    Ref add(Ref a, Ref b) { return push(Op::Add, a, b); }
+    Ref mul(Ref a, Ref b) { return push(Op::Mul, a, b); }
+    Ref pow(Ref base, double exponent) { return push(Op::Pow, base, pool(exponent)); }
+
+    std::size_t size() const { return kind.size(); }
+    std::size_t bytes() const;  // 配列が使っているバイト数 (名前の文字列を除く)
+    double value(Ref r) const { return constants[lhs[r]]; }
+    bool is_constant(Ref r, double v) const { return kind[r] == Op::Const && value(r) == v; }
+
+    Ref import(const std::shared_ptr<Expression>& e);
+    std::shared_ptr<Expression> to_expression(Ref root) const;
+    // root から届くノードの番号 (昇順). ノードは追加するだけなので, 一度求めればずっと使える
+    std::vector<Ref> cone(Ref root) const;
+    double evaluate(Ref root, double x) const { return evaluate(cone(root), x); }
+    // 同じ根を何度も評価するときは cone を 1 回だけ求めて渡す
+    double evaluate(std::span<const Ref> cone, double x) const;
+    // 結果はストアの末尾に追加される (元の式はそのまま残る)
+    Ref derivative(Ref root);
+    Ref simplify(Ref root);
+
+private:
+    std::unordered_map<std::uint64_t, std::uint32_t> pool_index_;
+    std::unordered_map<std::string, std::uint32_t> name_index_;
+    std::uint32_t pool(double v);
+    Ref push(Op op, Ref a, Ref b = 0) {
+        if (kind.size() >= UINT32_MAX) throw std::runtime_error("ExprStore: ノード数が 32 ビットを超えた");
+        kind.push_back(op);
+        lhs.push_back(a);
+        rhs.push_back(b);
+        return static_cast<Ref>(kind.size() - 1);
+    }
+    std::vector<bool> live_from(Ref root) const;
+};
+
+std::uint32_t ExprStore::pool(double v) {
+    auto [it, fresh] = pool_index_.try_emplace(std::bit_cast<std::uint64_t>(v), static_cast<std::uint32_t>(constants.size()));
+    if (fresh) constants.push_back(v);
+    return it->second;
+}
+ExprStore::Ref ExprStore::constant(double v) { return push(Op::Const, pool(v)); }
+ExprStore::Ref ExprStore::variable(const std::string& name) {
+    auto [it, fresh] = name_index_.try_emplace(name, static_cast<std::uint32_t>(names.size()));
+    if (fresh) names.push_back(name);
+    return push(Op::Var, it->second);
+}
+
+std::size_t ExprStore::bytes() const {
+    return kind.size() * sizeof(Op) + (lhs.size() + rhs.size()) * sizeof(Ref) + constants.size() * sizeof(double);
+}
+
+ExprStore::Ref ExprStore::import(const std::shared_ptr<Expression>& root) {
+    // 共有された部分木 (C/V のシングルトンなど) は 1 つのノードにする
+    return fold_postorder<Ref>(root, [&](const Expression* e, std::span<const Ref> kids) {
+        if (auto c = as<Constant>(e)) return constant(c->value);
+        if (auto v = as<Variable>(e)) return variable(v->name);
+        if (as<Add>(e)) return add(kids[0], kids[1]);
+        if (as<Multiply>(e)) return mul(kids[0], kids[1]);
+        if (auto p = as<Pow>(e)) return pow(kids[0], p->exponent);
+        if (auto n = as<NaryOp>(e)) {
+            bool sum = as<Sum>(e) != nullptr;
+            bool keep = !droppable_coeff(n->coeff, sum);
+            if (kids.empty()) return constant(n->coeff);
+            Ref acc = keep ? constant(n->coeff) : kids[0];
+            for (std::size_t i = keep ? 0 : 1; i < kids.size(); ++i)
+                acc = sum ? add(acc, kids[i]) : mul(acc, kids[i]);
+            return acc;
+        }
+        if (as<Derivative>(e)) throw std::runtime_error("ExprStore::import: 遅延微分ノードは simplify() で展開してから入れる: " + e->to_string());
+        throw std::runtime_error("ExprStore::import: 未対応のノード: " + e->to_string());
+    });
+}
+
+std::shared_ptr<Expression> ExprStore::to_expression(Ref root) const {
+    auto live = live_from(root);
+    std::vector<std::shared_ptr<Expression>> out(root + 1);
+    for (Ref i = 0; i <= root; ++i) {
+        if (!live[i]) continue;
+        switch (kind[i]) {
+        case Op::Const: out[i] = C(value(i)); break;
+        case Op::Var:   out[i] = V(names[lhs[i]]); break;
+        case Op::Add:   out[i] = make_add(out[lhs[i]], out[rhs[i]]); break;
+        case Op::Mul:   out[i] = make_mul(out[lhs[i]], out[rhs[i]]); break;
+        case Op::Pow:   out[i] = make_pow(out[lhs[i]], constants[rhs[i]]); break;
+        case Op::Fma:   break;
+        }
+    }
+    return out[root];
+}
+
+std::vector<bool> ExprStore::live_from(Ref root) const {
+    std::vector<bool> live(root + 1, false);
+    live[root] = true;
+    for (Ref i = root + 1; i-- > 0;) {
+        if (!live[i]) continue;
+        if (kind[i] == Op::Add || kind[i] == Op::Mul) live[lhs[i]] = live[rhs[i]] = true;
+        else if (kind[i] == Op::Pow) live[lhs[i]] = true;
+    }
+    return live;
+}
+
+std::vector<ExprStore::Ref> ExprStore::cone(Ref root) const {
+    auto live = live_from(root);
+    std::vector<Ref> order;
+    for (Ref i = 0; i <= root; ++i)
+        if (live[i]) order.push_back(i);
+    return order;
+}
+
+double ExprStore::evaluate(std::span<const Ref> cone, double x) const {
+    // 根の下のノードだけを前から順に計算する (死んだノードや他の根だけが使うノードは飛ばす)
+    if (cone.empty()) throw std::runtime_error("ExprStore::evaluate: 空の cone");
+    Ref root = cone.back();
+    static thread_local std::vector<double> v;
+    v.resize(root + 1);
+    double* w = v.data();
+    const Op* k = kind.data();
+    const Ref *l = lhs.data(), *r = rhs.data();
+    auto step = [&](Ref i) {
+        switch (k[i]) {
+        case Op::Const: w[i] = constants[l[i]]; break;
+        case Op::Var:   w[i] = x; break;
+        case Op::Add:   w[i] = w[l[i]] + w[r[i]]; break;
+        case Op::Mul:   w[i] = w[l[i]] * w[r[i]]; break;
+        case Op::Pow:   w[i] = power(w[l[i]], constants[r[i]]); break;
+        case Op::Fma:   break;
+        }
+    };
+    // root までがすべて生きていれば添字の列を読まずに連続で回す
+    if (cone.size() == std::size_t{root} + 1)
+        for (Ref i = 0; i <= root; ++i) step(i);
+    else
+        for (Ref i : cone) step(i);
+    return w[root];
+}
+
+ExprStore::Ref ExprStore::derivative(Ref root) {
+    auto live = live_from(root);
+    Ref zero = constant(0), one = constant(1);
+    // 0 と 1 は組み立てながら畳む (木の derivative() が作る 0 * x などのノードを作らない)
+    auto d_add = [&](Ref a, Ref b) { return a == zero ? b : b == zero ? a : add(a, b); };
+    auto d_mul = [&](Ref a, Ref b) {
+        if (a == zero || b == zero) return zero;
+        if (a == one) return b;
+        if (b == one) return a;
+        return mul(a, b);
+    };
+    std::vector<Ref> d(root + 1, zero);
+    for (Ref i = 0; i <= root; ++i) {
+        if (!live[i]) continue;
+        switch (kind[i]) {
+        case Op::Const: d[i] = zero; break;
+        case Op::Var:   d[i] = one; break;
+        case Op::Add:   d[i] = d_add(d[lhs[i]], d[rhs[i]]); break;
+        case Op::Mul:   d[i] = d_add(d_mul(d[lhs[i]], rhs[i]), d_mul(lhs[i], d[rhs[i]])); break;
+        case Op::Pow: {
+            double e = constants[rhs[i]];
+            if (d[lhs[i]] == zero || e == 0) d[i] = zero;
+            else if (e == 1) d[i] = d[lhs[i]];
+            else d[i] = d_mul(d_mul(constant(e), e == 2 ? lhs[i] : pow(lhs[i], e - 1)), d[lhs[i]]);
+            break;
+        }
+        case Op::Fma: break;
+        }
+    }
+    return d[root];
+}
+
+ExprStore::Ref ExprStore::simplify(Ref root) {
+    auto live = live_from(root);
+    // 結果のノードはハッシュコンスするので, 構造が同じなら添字が等しい. 種類ごとに (a, b) を 64 ビットの鍵にする
+    std::array<std::unordered_map<std::uint64_t, Ref>, 5> seen;
+    auto node = [&](Op op, Ref a, Ref b) {
+        if ((op == Op::Add || op == Op::Mul) && a > b) std::swap(a, b);  // 可換
+        auto [it, fresh] = seen[static_cast<std::size_t>(op)].try_emplace(std::uint64_t{a} << 32 | b, 0);
+        if (fresh) it->second = push(op, a, b);
+        return it->second;
+    };
+    auto k = [&](double v) { return node(Op::Const, pool(v), 0); };
+    auto is_k = [&](Ref r) { return kind[r] == Op::Const; };
+    // r = c * x (c は定数) の分解. そうでなければ c = 1
+    auto split_coeff = [&](Ref r) -> std::pair<double, Ref> {
+        if (kind[r] == Op::Mul && is_k(lhs[r])) return {value(lhs[r]), rhs[r]};
+        return {1.0, r};
+    };
+    auto base_exp = [&](Ref r) -> std::pair<Ref, double> {
+        if (kind[r] == Op::Pow) return {lhs[r], constants[rhs[r]]};
+        return {r, 1.0};
+    };
+    std::function<Ref(Ref, double)> s_pow;
+    std::function<Ref(Ref, Ref)> s_mul;
+    auto s_add = [&](Ref a, Ref b) -> Ref {
+        if (is_k(a) && is_k(b)) return k(value(a) + value(b));
+        if (is_k(a) && value(a) == 0) return b;
+        if (is_k(b) && value(b) == 0) return a;
+        // (c1 * x) + (c2 * x) -> (c1 + c2) * x
+        auto [ca, xa] = split_coeff(a);
+        auto [cb, xb] = split_coeff(b);
+        if (xa == xb) return s_mul(k(ca + cb), xa);
+        return node(Op::Add, a, b);
+    };
+    s_mul = [&](Ref a, Ref b) -> Ref {
+        if (is_k(b) && !is_k(a)) std::swap(a, b);  // 定数は左
+        if (is_k(a) && is_k(b)) return k(value(a) * value(b));
+        if (is_k(a) && value(a) == 0) return a;
+        if (is_k(a) && value(a) == 1) return b;
+        // c1 * (c2 * x) -> (c1 c2) * x
+        if (is_k(a) && kind[b] == Op::Mul && is_k(lhs[b])) return s_mul(k(value(a) * value(lhs[b])), rhs[b]);
+        // x^m * x^n -> x^(m + n) (木の simplify と同じく値が変わらないときのみ)
+        auto [ba, ea] = base_exp(a);
+        auto [bb, eb] = base_exp(b);
+        if (ba == bb && !is_k(ba) && can_add_exponents(ea, eb)) return s_pow(ba, ea + eb);
+        return node(Op::Mul, a, b);
+    };
+    s_pow = [&](Ref b, double e) -> Ref {
+        if (e == 0) return k(1);
+        if (e == 1) return b;
+        if (is_k(b)) return k(power(value(b), e));
+        if (kind[b] == Op::Pow && is_int_exponent(constants[rhs[b]]) && is_int_exponent(e)) return s_pow(lhs[b], constants[rhs[b]] * e);
+        return node(Op::Pow, b, pool(e));
+    };
+
+    std::vector<Ref> m(root + 1, 0);
+    for (Ref i = 0; i <= root; ++i) {
+        if (!live[i]) continue;
+        switch (kind[i]) {
+        case Op::Const: m[i] = k(value(i)); break;
+        case Op::Var:   m[i] = node(Op::Var, lhs[i], 0); break;
+        case Op::Add:   m[i] = s_add(m[lhs[i]], m[rhs[i]]); break;
+        case Op::Mul:   m[i] = s_mul(m[lhs[i]], m[rhs[i]]); break;
+        case Op::Pow:   m[i] = s_pow(m[lhs[i]], constants[rhs[i]]); break;
+        case Op::Fma:   break;
+        }
+    }
+    return m[root];
+}
+
+//-------------------------------------------------
+// 22. 遅延微分ノード
+//-------------------------------------------------
+// 数値が欲しいだけなら二重数の前進モードで元の木を 1 回たどれば足り, 導関数の木は作らない.
+// 記号的な形は expand() で 1 段ずつ作る (子の微分は再び Derivative のまま残る).
+// simplify() は expand() を子へ伝えていくので, 結果は derivative()->simplify() と同じ式になる.
+template<typename T> constexpr int dual_depth = 0;
+template<typename T> constexpr int dual_depth<Dual<T>> = dual_depth<T> + 1;
+// 前進モードで扱う階数の上限 (二重数の入れ子の深さ. テンプレートの実体化が無限に続かないように止める).
+// それより深い入れ子は 1 段ずつ expand() した木を同じ型で評価する
+constexpr int kMaxLazyOrder = 4;
+
+template<typename T>
+T evaluate_derivative_as(const Derivative* d, const T& x) {
+    // 入れ子の Derivative (2 階以上) は T = Dual<...> でここへ戻ってくる
+    if constexpr (dual_depth<T> + 1 >= kMaxLazyOrder)
+        return evaluate_as(d->expand().get(), x);
+    else
+        return evaluate_as(d->inner.get(), Dual<T>(x, T(1.0))).d;
+}
+
+namespace lazy_detail {
+// 葉の微分はその場で定数にし, それ以外は遅延ノードで包む
+std::shared_ptr<Expression> d(const std::shared_ptr<Expression>& e) {
+    if (as<Constant>(e.get())) return C(0);
+    if (as<Variable>(e.get())) return C(1);
+    return make_derivative(e);
+}
+bool is_zero(const std::shared_ptr<Expression>& e) {
+    auto c = as<Constant>(e.get());
+    return c && c->value == 0;
+}
+}  // namespace lazy_detail
+
+double Derivative::evaluate(double val) const { return evaluate_derivative_as(this, val); }
+std::shared_ptr<Expression> Derivative::derivative() const { return make_derivative(self()); }
+std::shared_ptr<Expression> Derivative::simplify_uncached() const { return expand()->simplify(); }
+std::string Derivative::to_string() const { return "d/dx(" + inner->to_string() + ")"; }
+
+std::shared_ptr<Expression> Derivative::expand() const {
+    if (auto done = expansion_.load()) return done;
+    using lazy_detail::d;
+    const Expression* e = inner.get();
+    std::shared_ptr<Expression> r;
+    if (as<Constant>(e) || as<Variable>(e)) r = d(inner);
+    else if (auto a = as<Add>(e)) r = make_add(d(a->left), d(a->right));
+    else if (auto m = as<Multiply>(e)) r = make_add(make_mul(d(m->left), m->right), make_mul(m->left, d(m->right)));
+    else if (auto p = as<Pow>(e)) {
+        r = p->exponent == 0   ? C(0)
+            : p->exponent == 1 ? d(p->base)
+                               : make_product({make_pow(p->base, p->exponent - 1), d(p->base)}, p->exponent);
+    } else if (auto s = as<Sum>(e)) {
+        std::vector<std::shared_ptr<Expression>> terms;
+        for (auto& op : s->operands)
+            if (auto t = d(op); !lazy_detail::is_zero(t)) terms.push_back(std::move(t));
+        r = make_sum(std::move(terms));
+    } else if (auto pr = as<Product>(e)) {
+        std::vector<std::shared_ptr<Expression>> terms;
+        for (std::size_t i = 0; i < pr->operands.size(); ++i) {
+            auto t = d(pr->operands[i]);
+            if (lazy_detail::is_zero(t)) continue;
+            auto factors = pr->operands;
+            factors[i] = std::move(t);
+            terms.push_back(make_product(std::move(factors), pr->coeff));
+        }
+        r = make_sum(std::move(terms));
+    } else if (auto dd = as<Derivative>(e)) {
+        r = d(dd->expand());
+    } else {
+        throw std::runtime_error("Derivative::expand: 未対応のノード: " + inner->to_string());
+    }
+    // 同時に展開したスレッドがあれば先に書いた方を使う
+    std::shared_ptr<Expression> expected;
+    if (!expansion_.compare_exchange_strong(expected, r)) return expected;
+    return r;
+}
+
+//-------------------------------------------------
+// 23. テープからの C コード生成
+//-------------------------------------------------
+// void name(const double* in, double* out) を定義する C の翻訳単位を返す. in は tape.variables の順,
+// out は tape.outputs の順. 定数は 16 進表記で書くので値は丸められない.
+// Fma 命令は fma() になる. それ以外の a * b + c をコンパイラが融合しないよう, 木やテープと
+// ビット単位で同じ値が要るときは -ffp-contract=off を付けてコンパイルすること.
+namespace codegen_detail {
+std::string literal(double v) {
+    if (std::isnan(v)) return "NAN";
+    if (std::isinf(v)) return v > 0 ? "INFINITY" : "-INFINITY";
+    char buf[64];
+    std::snprintf(buf, sizeof buf, "%a", v);
+    return buf;
+}
+
+// 翻訳単位の先頭に 1 度だけ置く部分
+constexpr std::string_view kPrelude =
+    "#include <math.h>\n"
+    "static inline double ipow_(double x, unsigned n) {\n"
+    "    double r = 1;\n"
+    "    while (n) { if (n & 1) r = r * x; x = x * x; n >>= 1; }\n"
+    "    return r;\n"
+    "}\n";
+}  // namespace codegen_detail
+
+// 関数の定義だけ (複数の関数を 1 つの翻訳単位にまとめるとき用. 先頭に kPrelude が要る)
+std::string emit_c_function(const Tape& t, const std::string& name) {
+    using codegen_detail::literal;
+    std::string src = std::format("void {}(const double* in, double* out) {{\n", name);
+    for (std::size_t i = 0; i < t.code.size(); ++i) {
+        const auto& in = t.code[i];
+        std::string rhs;
+        switch (in.op) {
+        case Op::Const: rhs = literal(in.value); break;
+        case Op::Var:   rhs = std::format("in[{}]", in.a); break;
+        case Op::Add:   rhs = std::format("v{} + v{}", in.a, in.b); break;
+        case Op::Mul:   rhs = std::format("v{} * v{}", in.a, in.b); break;
+        case Op::Fma:   rhs = std::format("fma(v{}, v{}, v{})", in.a, in.b, in.c); break;
+        case Op::Pow:
+            // power() と同じ場合分け
+            if (!is_int_exponent(in.value)) rhs = std::format("pow(v{}, {})", in.a, literal(in.value));
+            else if (in.value < 0) rhs = std::format("1.0 / ipow_(v{}, {}u)", in.a, static_cast<unsigned>(-in.value));
+            else rhs = std::format("ipow_(v{}, {}u)", in.a, static_cast<unsigned>(in.value));
+            break;
+        }
+        src += std::format("    const double v{} = {};\n", i, rhs);
+    }
+    for (std::size_t k = 0; k < t.outputs.size(); ++k) src += std::format("    out[{}] = v{};\n", k, t.outputs[k]);
+    src += "}\n";
+    return src;
+}
+
+std::string emit_c(const Tape& t, const std::string& name) {
+    return std::string(codegen_detail::kPrelude) + emit_c_function(t, name);
+}
+
+//-------------------------------------------------
+// 24. 段階的な実行 (木 -> テープ -> ネイティブコード)
+//-------------------------------------------------
+// emit_c の出力を外部の C コンパイラで共有ライブラリにして読み込む.
+// 関数は void (const double* in, double* out) の形 (emit_c_function と同じ)
+using NativeFn = void (*)(const double*, double*);
+
+struct NativeModule {
+    void* handle = nullptr;
+    NativeModule() = default;
+    NativeModule(const NativeModule&) = delete;
+    NativeModule& operator=(const NativeModule&) = delete;
+    ~NativeModule() { if (handle) dlclose(handle); }
+
+    // 木やテープとビット単位で同じ値にするため -ffp-contract=off でコンパイルする. 失敗すれば runtime_error.
+    // compiler はシェルを通さずにそのまま起動するプログラム名 (PATH から探す. オプションは含められない)
+    static std::shared_ptr<NativeModule> compile(const std::string& source, const std::string& compiler = "cc");
+    NativeFn function(const std::string& name) const;
+};
+
+std::shared_ptr<NativeModule> NativeModule::compile(const std::string& source, const std::string& compiler) {
+    // 作業ファイルは mkdtemp で作った自分だけのディレクトリに置く (推測できる名前だとシンボリックリンクを仕込まれうる).
+    // 読み込んだ後はファイルが無くてもよいので, 抜けるときにディレクトリごと消す
+    std::string dir = (std::filesystem::temp_directory_path() / "expr_jit_XXXXXX").string();
+    if (!mkdtemp(dir.data())) throw std::runtime_error("NativeModule: 作業ディレクトリを作れない: " + dir);
+    struct RemoveDir {
+        std::filesystem::path path;
+        ~RemoveDir() {
+            std::error_code ec;
+            std::filesystem::remove_all(path, ec);
+        }
+    } cleanup{dir};
+    auto c_path = (cleanup.path / "f.c").string(), so_path = (cleanup.path / "f.so").string();
+    std::ofstream f(c_path, std::ios::binary);
+    f << source;
+    f.close();
+    if (!f) throw std::runtime_error("NativeModule: ソースを書けない: " + c_path);
+
+    // シェルを通さず引数の配列で起動する. 子では exec するだけなので, 引数は fork の前にそろえておく
+    std::vector<std::string> args{compiler, "-O2", "-ffp-contract=off", "-shared", "-fPIC", "-o", so_path, c_path, "-lm"};
+    std::vector<char*> argv;
+    for (auto& a : args) argv.push_back(a.data());
+    argv.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid < 0) throw std::runtime_error("NativeModule: fork に失敗");
+    if (pid == 0) {
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0)
+        if (errno != EINTR) throw std::runtime_error("NativeModule: waitpid に失敗");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        throw std::runtime_error(std::format("NativeModule: コンパイルに失敗: {} (終了状態 {})", compiler,
+                                             WIFEXITED(status) ? WEXITSTATUS(status) : -1));
+    auto m = std::make_shared<NativeModule>();
+    m->handle = dlopen(so_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!m->handle) throw std::runtime_error(std::string("NativeModule: 読み込みに失敗: ") + dlerror());
+    return m;
+}
+
+NativeFn NativeModule::function(const std::string& name) const {
+    auto f = reinterpret_cast<NativeFn>(dlsym(handle, name.c_str()));
+    if (!f) throw std::runtime_error("NativeModule: 関数がない: " + name);
+    return f;
+}
+
+// 投入された仕事を 1 本のスレッドで順に実行する (コンパイルを評価側のスレッドから外すため)
+class BackgroundCompiler {
+public:
+    BackgroundCompiler() : worker_([this] { run(); }) {}
+    ~BackgroundCompiler();
+    void submit(std::function<void()> job);
+    // 投入済みの仕事が全て終わるまで待つ
+    void drain();
+    static BackgroundCompiler& shared();
+
+private:
+    void run();
+    std::mutex mtx_;
+    std::condition_variable wake_, idle_;
+    std::deque<std::function<void()>> queue_;
+    bool busy_ = false, stop_ = false;
+    std::thread worker_;
+};
+
+BackgroundCompiler::~BackgroundCompiler() {
+    {
+        std::lock_guard lock(mtx_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    worker_.join();
+}
+
+void BackgroundCompiler::submit(std::function<void()> job) {
+    {
+        std::lock_guard lock(mtx_);
+        queue_.push_back(std::move(job));
+    }
+    wake_.notify_one();
+}
+
+void BackgroundCompiler::drain() {
+    std::unique_lock lock(mtx_);
+    idle_.wait(lock, [&] { return queue_.empty() && !busy_; });
+}
+
+void BackgroundCompiler::run() {
+    std::unique_lock lock(mtx_);
+    while (true) {
+        wake_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+        if (queue_.empty()) return;  // stop_ かつ仕事なし
+        auto job = std::move(queue_.front());
+        queue_.pop_front();
+        busy_ = true;
+        lock.unlock();
+        job();  // 仕事の中の例外は仕事側で扱う
+        lock.lock();
+        busy_ = false;
+        if (queue_.empty()) idle_.notify_all();
+    }
+}
+
+// プロセス全体で共有する (shared_interner と同じく解放しない)
+BackgroundCompiler& BackgroundCompiler::shared() {
+    static auto* compiler = new BackgroundCompiler();
+    return *compiler;
+}
+
+enum class Tier : std::uint8_t { Tree, Bytecode, Native };
+
+struct TieredOptions {
+    std::uint64_t bytecode_after = 16;  // この回数呼ばれたらテープを作る
+    // テープで実行した命令数の累計 (呼び出し回数 * 命令数) がこれを超えたらネイティブコードを作る.
+    // C コンパイラの起動に約 50 ms かかり, テープに対する節約は 1 命令あたり 1〜2 ns なので 3 * 10^7 程度で元が取れる
+    std::uint64_t native_work = 30'000'000;
+    std::string compiler = "cc";
+};
+
+// 呼ばれた回数に応じて木の evaluate -> テープ -> ネイティブコードと実行方法を上げていく評価の入口.
+// 翻訳はバックグラウンドのスレッドで行い, 出来上がったものを atomic に差し替える (それまでは今の段で評価を続ける).
+// 値は evaluate(double) と同じく全ての変数を x とみなす. C コンパイラが無いなどでネイティブ化に
+// 失敗したときはテープのまま動き続け, テープにできない式 (未対応のノードを含む) は木のまま動き続ける.
+class TieredFunction {
+public:
+    explicit TieredFunction(std::shared_ptr<Expression> e, TieredOptions options = {});
+    double operator()(double x) const;
+    Tier tier() const;
+    std::uint64_t calls() const { return state_->calls.load(std::memory_order_relaxed); }
+
+private:
+    struct State {
+        std::shared_ptr<Expression> expr;
+        TieredOptions options;
+        mutable std::atomic<std::uint64_t> calls{0};
+        // 一度書いたら差し替えないので, 評価側は生ポインタを読むだけでよい
+        std::shared_ptr<const Tape> tape_owner;
+        std::atomic<const Tape*> tape{nullptr};
+        std::shared_ptr<NativeModule> module;
+        std::atomic<NativeFn> native{nullptr};
+        std::atomic<std::size_t> inputs{0};
+        // テープを作った時点で native_work から決める呼び出し回数
+        std::atomic<std::uint64_t> native_at{UINT64_MAX};
+        std::atomic<bool> native_queued{false};
+        std::atomic<bool> tape_failed{false};  // 作れなかったテープを作り直さない
+    };
+    static void build_tape(State& s);
+    static void build_native(State& s);
+    std::shared_ptr<State> state_;
+};
+
+TieredFunction::TieredFunction(std::shared_ptr<Expression> e, TieredOptions options) : state_(std::make_shared<State>()) {
+    state_->expr = std::move(e);
+    state_->options = std::move(options);
+}
+
+void TieredFunction::build_tape(State& s) {
+    if (s.tape.load(std::memory_order_acquire) || s.tape_failed.load(std::memory_order_relaxed)) return;
+    std::shared_ptr<const Tape> t;
+    try {
+        // 木の evaluate は積和を融合しないので融合しない (段が変わっても値は同じ)
+        t = std::make_shared<const Tape>(Tape::compile({s.expr}, {}, FmaMode::Off));
+    } catch (const std::exception&) {
+        // 木の段に留まる (例外を仕事の外へ出すとコンパイル用のスレッドごと止まる)
+        s.tape_failed.store(true, std::memory_order_relaxed);
+        return;
+    }
+    s.inputs.store(t->variables.size(), std::memory_order_relaxed);
+    s.native_at.store(s.options.native_work / std::max<std::size_t>(1, t->code.size()), std::memory_order_relaxed);
+    s.tape_owner = t;
+    s.tape.store(t.get(), std::memory_order_release);
+}
+
+void TieredFunction::build_native(State& s) {
+    build_tape(s);
+    if (!s.tape_owner) return;
+    try {
+        auto m = NativeModule::compile(emit_c(*s.tape_owner, "f"), s.options.compiler);
+        auto f = m->function("f");
+        s.module = std::move(m);
+        s.native.store(f, std::memory_order_release);
+    } catch (const std::exception&) {
+        // テープの段に留まる
+    }
+}
+
+double TieredFunction::operator()(double x) const {
+    State& s = *state_;
+    std::uint64_t n = s.calls.fetch_add(1, std::memory_order_relaxed) + 1;
+    // 入力は全て x. 変数の数は高々数個なので呼び出しごとに詰める
+    static thread_local std::vector<double> in, values;
+    if (auto f = s.native.load(std::memory_order_acquire)) {
+        in.assign(s.inputs.load(std::memory_order_relaxed), x);
+        double out;
+        f(in.data(), &out);
+        return out;
+    }
+    // 仕事は State を共有して持つので, 翻訳中に TieredFunction が破棄されてもよい
+    if (auto t = s.tape.load(std::memory_order_acquire)) {
+        if (n >= s.native_at.load(std::memory_order_relaxed) && !s.native_queued.load(std::memory_order_relaxed) &&
+            !s.native_queued.exchange(true))
+            BackgroundCompiler::shared().submit([keep = state_] { build_native(*keep); });
+        in.assign(t->variables.size(), x);
+        t->forward(in, values);
+        return values[t->outputs[0]];
+    }
+    // 閾値ちょうどの呼び出しだけが投入するので, 同じ仕事は 1 度しか積まれない
+    if (n == s.options.bytecode_after) BackgroundCompiler::shared().submit([keep = state_] { build_tape(*keep); });
+    return s.expr->evaluate(x);
+}
+
+Tier TieredFunction::tier() const {
+    if (state_->native.load(std::memory_order_acquire)) return Tier::Native;
+    if (state_->tape.load(std::memory_order_acquire)) return Tier::Bytecode;
+    return Tier::Tree;
+}
+
+//-------------------------------------------------
+// 25. レジスタ割り付けしたテープ
+//-------------------------------------------------
+// Tape は命令ごとに別のスロットを持つので, 100 万命令なら作業領域も 8 MB (8 レーンのパックなら 64 MB) になる.
+// 最後の使用を過ぎた値のスロットを後の命令で使い回し, 作業領域を同時に生きている値の最大数まで縮める.
+namespace regalloc_detail {
+// 命令 in の被演算子 (重複は除かない)
+template<typename F>
+void for_each_operand(const Instr& in, F&& f) {
+    switch (in.op) {
+    case Op::Const:
+    case Op::Var:   break;
+    case Op::Pow:   f(in.a); break;
+    case Op::Add:
+    case Op::Mul:   f(in.a); f(in.b); break;
+    case Op::Fma:   f(in.a); f(in.b); f(in.c); break;
+    }
+}
+// 高々 3 要素の安定な挿入ソート
+template<typename Less>
+void sort_operands(std::array<std::uint32_t, 3>& a, std::size_t k, Less less) {
+    for (std::size_t j = 1; j < k; ++j)
+        for (std::size_t m = j; m > 0 && less(a[m], a[m - 1]); --m) std::swap(a[m], a[m - 1]);
+}
+}  // namespace regalloc_detail
+
+// 出力から深さ優先で命令を並べ直す. 被演算子は Sethi-Ullman 数 (その部分式を評価するのに
+// 要る値の数) の大きい方から先に評価すると, 途中で保持する値が少なくて済む.
+// 共有された値は最初に必要になったところで 1 度だけ評価する (DAG では近似になる)
+Tape Tape::schedule() const {
+    using regalloc_detail::for_each_operand, regalloc_detail::sort_operands;
+    std::size_t n = code.size();
+    std::vector<std::uint32_t> need(n, 1);
+    for (std::size_t i = 0; i < n; ++i) {
+        std::array<std::uint32_t, 3> ns{};
+        std::size_t k = 0;
+        for_each_operand(code[i], [&](std::uint32_t s) { ns[k++] = need[s]; });
+        sort_operands(ns, k, std::greater<>());
+        for (std::size_t j = 0; j < k; ++j) need[i] = std::max<std::uint32_t>(need[i], ns[j] + static_cast<std::uint32_t>(j));
+    }
+
+    constexpr std::uint32_t kNone = UINT32_MAX;
+    std::vector<std::uint32_t> remap(n, kNone);
+    Tape t;
+    t.variables = variables;
+    // (スロット, 次に見る被演算子の番号) の明示スタック
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> stack;
+    auto operands_by_need = [&](std::uint32_t i) {
+        std::array<std::uint32_t, 3> ops{};
+        std::size_t k = 0;
+        for_each_operand(code[i], [&](std::uint32_t s) { ops[k++] = s; });
+        sort_operands(ops, k, [&](auto a, auto b) { return need[a] > need[b]; });
+        return std::pair{ops, k};
+    };
+    for (auto o : outputs) {
+        if (remap[o] == kNone) stack.emplace_back(o, 0);
+        while (!stack.empty()) {
+            auto& [i, next] = stack.back();
+            auto [ops, k] = operands_by_need(i);
+            while (next < k && remap[ops[next]] != kNone) ++next;
+            if (next < k) {
+                stack.emplace_back(ops[next], 0);  // back() の参照は無効になる
+                continue;
+            }
+            auto in = code[i];
+            if (in.op != Op::Const && in.op != Op::Var) in.a = remap[in.a];
+            if (in.op == Op::Add || in.op == Op::Mul || in.op == Op::Fma) in.b = remap[in.b];
+            if (in.op == Op::Fma) in.c = remap[in.c];
+            remap[i] = static_cast<std::uint32_t>(t.code.size());
+            t.code.push_back(in);
+            stack.pop_back();
+        }
+    }
+    for (auto o : outputs) t.outputs.push_back(remap[o]);
+    return t;
+}
+
+// 被演算子と結果の位置をレジスタ番号で表したテープ. code[i] の結果は dst[i] に書く.
+// 値は元のテープと同じ順序の同じ演算で求めるので, ビット単位で一致する
+struct RegisterTape {
+    std::vector<Instr> code;           // a, b, c はレジスタ番号 (Var の a は入力の添字のまま)
+    std::vector<std::uint32_t> dst;
+    std::vector<std::string> variables;
+    std::vector<std::uint32_t> outputs;  // 出力を持つレジスタ
+    std::uint32_t registers = 0;
+
+    // 命令の並びはそのままで, 最後の使用の後にレジスタを空ける (直線コードの線形走査)
+    static RegisterTape allocate(const Tape& t);
+
+    template<typename T>
+    void forward_as(std::span<const T> inputs, std::vector<T>& regs) const;
+    void forward(std::span<const double> inputs, std::vector<double>& regs) const { forward_as<double>(inputs, regs); }
+    std::vector<double> evaluate(std::span<const double> inputs) const;
+};
+
+RegisterTape RegisterTape::allocate(const Tape& t) {
+    using regalloc_detail::for_each_operand;
+    std::size_t n = t.code.size();
+    constexpr std::uint32_t kForever = UINT32_MAX;
+    std::vector<std::uint32_t> last_use(n, 0);
+    for (std::uint32_t i = 0; i < n; ++i) for_each_operand(t.code[i], [&](std::uint32_t s) { last_use[s] = i; });
+    for (auto o : t.outputs) last_use[o] = kForever;
+
+    RegisterTape r;
+    r.variables = t.variables;
+    r.code.reserve(n);
+    r.dst.reserve(n);
+    std::vector<std::uint32_t> reg(n), free_regs;
+    for (std::uint32_t i = 0; i < n; ++i) {
+        auto in = t.code[i];
+        if (in.op != Op::Const && in.op != Op::Var) in.a = reg[in.a];
+        if (in.op == Op::Add || in.op == Op::Mul || in.op == Op::Fma) in.b = reg[in.b];
+        if (in.op == Op::Fma) in.c = reg[in.c];
+        // ここで最後に使われる被演算子のレジスタを先に空ける (結果を同じレジスタに書ける)
+        for_each_operand(t.code[i], [&](std::uint32_t s) {
+            if (last_use[s] == i) {
+                last_use[s] = 0;  // 同じ被演算子が 2 度現れても 1 度だけ空ける
+                free_regs.push_back(reg[s]);
+            }
+        });
+        if (free_regs.empty()) reg[i] = r.registers++;
+        else reg[i] = free_regs.back(), free_regs.pop_back();
+        r.code.push_back(in);
+        r.dst.push_back(reg[i]);
+        // 使われない値 (出力でもない) はすぐに空ける
+        if (last_use[i] == 0) free_regs.push_back(reg[i]);
+    }
+    for (auto o : t.outputs) r.outputs.push_back(reg[o]);
+    return r;
+}
+
+template<typename T>
+void RegisterTape::forward_as(std::span<const T> x, std::vector<T>& regs) const {
+    regs.resize(registers, T(0));
+    for (std::size_t i = 0; i < code.size(); ++i) regs[dst[i]] = apply<T>(code[i], x, regs);
+}
+
+std::vector<double> RegisterTape::evaluate(std::span<const double> x) const {
+    std::vector<double> regs;
+    forward(x, regs);
+    std::vector<double> out;
+    out.reserve(outputs.size());
+    for (auto o : outputs) out.push_back(regs[o]);
+    return out;
+}
+
+//-------------------------------------------------
+// 26. メモリ上限つきの逆モード (チェックポイント)
+//-------------------------------------------------
+// Tape::adjoint は全スロットの値と随伴 (命令数 * 16 バイト) を持つ. ここでは RegisterTape の上で,
+// 区間 [lo, hi) の逆掃引を次のように再帰的に行い, 再計算と引き換えにメモリを抑える.
+//   - 区間が短ければ: 前進しながら上書きされるレジスタの古い値を記録し, 逆順に戻しながら随伴を流す
+//   - 長ければ: レジスタ全体を退避して中点まで前進し, 後半を処理してから退避した状態に戻して前半を処理する
+// どちらも入ったときのレジスタの状態に戻して返る. 随伴もレジスタごとに持つ (値の定義を逆にたどった
+// 時点でそのレジスタの随伴は使い終わるので 0 に戻す). 必要なメモリは (2 + 段数) * レジスタ数 + 区間長,
+// 前進の回数は段数 / 2 + 1 回分程度になる.
+struct CheckpointedGradient {
+    std::vector<double> gradient;  // variables の順
+    std::vector<double> outputs;   // 出力の値 (最後の区間の前進で得る)
+    std::size_t levels = 0;                  // 二分の段数
+    std::size_t leaf = 0;                    // 記録しながら前進する区間の長さ
+    std::size_t peak_bytes = 0;              // レジスタ, 随伴, 退避, 記録の合計
+    std::size_t forward_instructions = 0;    // 再計算を含む前進の命令数
+};
+
+// 出力の重み out_adjoint に対する勾配を, 作業領域 memory_cap バイト以内で求める.
+// 上限内に収まる段数がなければ runtime_error
+CheckpointedGradient checkpointed_gradient(const RegisterTape& t, std::span<const double> x,
+                                           std::span<const double> out_adjoint, std::size_t memory_cap) {
+    std::size_t n = t.code.size(), r = t.registers;
+    CheckpointedGradient g;
+    // 段数 d では葉の区間が ceil(n / 2^d) になる. 上限に収まる最小の段数を選ぶ (段が少ないほど再計算が少ない)
+    auto bytes_for = [&](std::size_t d) {
+        std::size_t leaf = (n + (std::size_t{1} << d) - 1) >> d;
+        return ((2 + d) * r + leaf) * sizeof(double);
+    };
+    std::size_t d = 0, least = bytes_for(0);
+    while (bytes_for(d) > memory_cap) {
+        least = std::min(least, bytes_for(d));
+        if ((std::size_t{1} << d) >= n)
+            throw std::runtime_error(std::format("checkpointed_gradient: 上限 {} バイトでは足りない (最低 {} バイト)",
+                                                 memory_cap, least));
+        ++d;
+    }
+    g.levels = d;
+    g.leaf = std::max<std::size_t>(1, (n + (std::size_t{1} << d) - 1) >> d);
+    g.peak_bytes = bytes_for(d);
+
+    std::vector<double> regs(r, 0.0), w(r, 0.0), undo(g.leaf);
+    std::vector<std::vector<double>> saved(d, std::vector<double>(r));
+    g.gradient.assign(t.variables.size(), 0.0);
+    for (std::size_t k = 0; k < t.outputs.size(); ++k) w[t.outputs[k]] += out_adjoint[k];
+
+    auto step = [&](std::size_t i) { regs[t.dst[i]] = apply<double>(t.code[i], x, regs); };
+    // regs が命令 i の直前の状態のとき, 命令 i の随伴を被演算子へ流す
+    auto reverse_step = [&](std::size_t i) {
+        const auto& in = t.code[i];
+        double wi = w[t.dst[i]];
+        w[t.dst[i]] = 0;
+        if (wi == 0) return;
+        switch (in.op) {
+        case Op::Const: break;
+        case Op::Var:   g.gradient[in.a] += wi; break;
+        case Op::Add:   w[in.a] += wi; w[in.b] += wi; break;
+        case Op::Mul:   w[in.a] += wi * regs[in.b]; w[in.b] += wi * regs[in.a]; break;
+        case Op::Pow:   w[in.a] += wi * power_derivative(regs[in.a], in.value); break;
+        case Op::Fma:   w[in.a] += wi * regs[in.b]; w[in.b] += wi * regs[in.a]; w[in.c] += wi; break;
+        }
+    };
+    auto sweep = [&](auto&& self, std::size_t lo, std::size_t hi, std::size_t level) -> void {
+        if (hi - lo <= g.leaf) {
+            for (std::size_t i = lo; i < hi; ++i) {
+                undo[i - lo] = regs[t.dst[i]];
+                step(i);
+            }
+            g.forward_instructions += hi - lo;
+            if (hi == n)
+                for (auto o : t.outputs) g.outputs.push_back(regs[o]);
+            for (std::size_t i = hi; i-- > lo;) {
+                regs[t.dst[i]] = undo[i - lo];
+                reverse_step(i);
+            }
+            return;
+        }
+        std::size_t mid = lo + (hi - lo) / 2;
+        auto& snapshot = saved[level];
+        snapshot = regs;
+        for (std::size_t i = lo; i < mid; ++i) step(i);
+        g.forward_instructions += mid - lo;
+        self(self, mid, hi, level + 1);
+        regs = snapshot;
+        self(self, lo, mid, level + 1);
+    };
+    if (n) sweep(sweep, 0, n, 0);
+    return g;
+}
+
+//-------------------------------------------------
+// 27. ベンチマーク (./test bench で実行)
+//-------------------------------------------------
+// 確保回数・バイト数の計測用に global operator new / delete を差し替える.
+// 配列形・整列形も同じ確保と解放の対にそろえる. 解放が呼び出し側に展開されると, GCC は標準の
+// operator new の戻り値に free を呼んでいると見なして -Wmismatched-new-delete を出すので展開させない
+std::atomic<std::size_t> g_alloc_count{0};
+std::atomic<std::size_t> g_alloc_bytes{0};
+
+void* counted_allocate(std::size_t n, std::size_t align = 0) {
+    g_alloc_count.fetch_add(1, std::memory_order_relaxed);
+    g_alloc_bytes.fetch_add(n, std::memory_order_relaxed);
+    if (n == 0) n = 1;
+    void* p = align <= alignof(std::max_align_t) ? std::malloc(n)
+                                                 : std::aligned_alloc(align, (n + align - 1) / align * align);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+[[gnu::noinline]] void counted_free(void* p) noexcept { std::free(p); }
+
+void* operator new(std::size_t n) { return counted_allocate(n); }
+void* operator new[](std::size_t n) { return counted_allocate(n); }
+void* operator new(std::size_t n, std::align_val_t a) { return counted_allocate(n, std::size_t(a)); }
+void* operator new[](std::size_t n, std::align_val_t a) { return counted_allocate(n, std::size_t(a)); }
+void operator delete(void* p) noexcept { counted_free(p); }
+void operator delete(void* p, std::size_t) noexcept { counted_free(p); }
+void operator delete[](void* p) noexcept { counted_free(p); }
+void operator delete[](void* p, std::size_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { counted_free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { counted_free(p); }
+
+std::size_t count_nodes(const Expression* e) {
+    if (auto b = as<BinaryOp>(e)) return 1 + count_nodes(b->left.get()) + count_nodes(b->right.get());
+    if (auto p = as<Pow>(e)) return 1 + count_nodes(p->base.get());
+    if (auto n = as<NaryOp>(e)) {
+        std::size_t c = 1;
+        for (auto& op : n->operands) c += count_nodes(op.get());
+        return c;
+    }
+    return 1;
+}
+
+std::size_t tree_depth(const Expression* e) {
+    if (auto b = as<BinaryOp>(e)) return 1 + std::max(tree_depth(b->left.get()), tree_depth(b->right.get()));
+    if (auto p = as<Pow>(e)) return 1 + tree_depth(p->base.get());
+    if (auto n = as<NaryOp>(e)) {
+        std::size_t d = 0;
+        for (auto& op : n->operands) d = std::max(d, tree_depth(op.get()));
+        return 1 + d;
+    }
+    return 1;
+}
+
+// 葉が x と小さな定数の平衡二分木 (葉は n 個)
+std::shared_ptr<Expression> bench_tree(std::size_t n, std::size_t seed = 0) {
+    if (n == 1) {
+        if (seed % 2) return V();
+        return C(static_cast<double>(seed % 7));
+    }
+    auto l = bench_tree(n / 2, seed * 2 + 1);
+    auto r = bench_tree(n - n / 2, seed * 2 + 2);
+    if (seed % 3 == 0) return make_mul(l, r);
+    return make_add(l, r);
+}
+
+// bench_tree と同じ形で, 葉の定数を全て変え, 変数を vars 個 (x0, x1, ... . 1 個なら x) に散らした木.
+// bench_tree は葉の定数が 7 種類しかなく, テープの値番号付けで大半がまとまってしまう
+std::shared_ptr<Expression> bench_tree_distinct(std::size_t n, std::size_t vars = 1, std::size_t seed = 0) {
+    if (n == 1) {
+        if (seed % 2 == 0) return C(1 + double(seed) * 1e-7);
+        return vars == 1 ? V() : V(std::format("x{}", seed / 2 % vars));
+    }
+    auto l = bench_tree_distinct(n / 2, vars, seed * 2 + 1);
+    auto r = bench_tree_distinct(n - n / 2, vars, seed * 2 + 2);
+    if (seed % 3 == 0) return make_mul(l, r);
+    return make_add(l, r);
+}
+
+void bench_derivative_alloc() {
+    auto f = bench_tree(std::size_t{1} << 19);
+    std::shared_ptr<Expression> df;
+    auto allocs = g_alloc_count.load();
+    double ms = measure_ms([&] { df = f->derivative(); });
+    allocs = g_alloc_count.load() - allocs;
+    std::cout << std::format("derivative(): 入力 {} ノード -> 出力 {} ノード, 確保 {} 回, {:.2f} ms\n",
+                             count_nodes(f.get()), count_nodes(df.get()), allocs, ms);
+}
+
+// 長い和 sum_i (i * x) と長い積 prod_i (x + i) を二分木と n 項ノードで比較
+void bench_nary() {
+    constexpr int kTerms = 10000;
+    constexpr int kFactors = 200;
+    constexpr int kEvals = 200;
+
+    std::shared_ptr<Expression> chain = make_mul(C(1), V());
+    for (int i = 2; i <= kTerms; ++i) chain = make_add(chain, make_mul(C(i), V()));
+    std::shared_ptr<Expression> prod = make_add(V(), C(1));
+    for (int i = 2; i <= kFactors; ++i) prod = make_mul(prod, make_add(V(), C(i)));
+
+    for (auto& [name, bin] : {std::pair{"和", chain}, std::pair{"積", prod}}) {
+        auto nary = flatten(bin);
+        double sink = 0;
+        double eb = measure_ms([&] { for (int k = 0; k < kEvals; ++k) sink += bin->evaluate(0.5 + k * 1e-3); });
+        double en = measure_ms([&] { for (int k = 0; k < kEvals; ++k) sink += nary->evaluate(0.5 + k * 1e-3); });
+        std::shared_ptr<Expression> db, dn;
+        double tb = measure_ms([&] { db = bin->derivative()->simplify(); });
+        double tn = measure_ms([&] { dn = nary->derivative()->simplify(); });
+        std::cout << std::format("{} 二分木: {} ノード 深さ {}, evaluate x{} {:.2f} ms, 微分+簡約 {:.2f} ms ({} ノード)\n",
+                                 name, count_nodes(bin.get()), tree_depth(bin.get()), kEvals, eb, tb, count_nodes(db.get()));
+        std::cout << std::format("{} n 項:   {} ノード 深さ {}, evaluate x{} {:.2f} ms, 微分+簡約 {:.2f} ms ({} ノード) [{}]\n",
+                                 name, count_nodes(nary.get()), tree_depth(nary.get()), kEvals, en, tn, count_nodes(dn.get()),
+                                 sink != 0);
+    }
+}
+
+// 次数 n の密な多項式 sum_k (k % 5 + 1) x^k: 木 (x^k は make_mul の入れ子) と Polynomial を比較
+void bench_polynomial() {
+    constexpr int kEvals = 64;
+    std::vector<double> xs(4096);
+    for (std::size_t i = 0; i < xs.size(); ++i) xs[i] = -1 + 2.0 * i / xs.size();
+    std::vector<double> out(xs.size());
+
+    for (int n : {10, 100, 1000, 10000, 100000}) {
+        Polynomial p;
+        p.dense.resize(n + 1);
+        for (int k = 0; k <= n; ++k) p.dense[k] = k % 5 + 1;
+        p.normalize();
+
+        double sink = 0;
+        Polynomial dp;
+        double pd = measure_ms([&] { dp = p.derivative(); });
+        double ph = measure_ms([&] { for (int i = 0; i < kEvals; ++i) sink += p.evaluate(0.5 + i * 1e-4); });
+        double pe = measure_ms([&] { for (int i = 0; i < kEvals; ++i) sink += p.evaluate_estrin(0.5 + i * 1e-4); });
+        double pb = measure_ms([&] { p.evaluate_batch(xs, out); });
+        std::cout << std::format("多項式 次数 {:>6}: 微分 {:.3f} ms, Horner x{} {:.3f} ms, Estrin x{} {:.3f} ms, "
+                                 "一括 {} 点 {:.3f} ms ({:.2f} ns/点/次)\n",
+                                 n, pd, kEvals, ph, kEvals, pe, xs.size(), pb, pb * 1e6 / xs.size() / n);
+        if (n > 1000) { std::cout << std::format("  (木表現は O(n^2) のため省略) [{}]\n", sink != 0); continue; }
+
+        std::shared_ptr<Expression> xk = V();
+        std::shared_ptr<Expression> tree = C(p.dense[0]);
+        for (int k = 1; k <= n; ++k) {
+            if (k > 1) xk = make_mul(V(), xk);
+            tree = make_add(tree, make_mul(C(p.dense[k]), xk));
+        }
+        std::shared_ptr<Expression> dt;
+        double td = measure_ms([&] { dt = tree->derivative(); });
+        double te = measure_ms([&] { for (int i = 0; i < kEvals; ++i) sink += tree->evaluate(0.5 + i * 1e-4); });
+        std::cout << std::format("  木     次数 {:>6}: 微分 {:.3f} ms ({} ノード), evaluate x{} {:.3f} ms [{}]\n",
+                                 n, td, count_nodes(dt.get()), kEvals, te, sink != 0);
+    }
+}
+
+// x^n: make_mul の入れ子と Pow ノードを比較
+void bench_pow() {
+    constexpr int kEvals = 1000;
+    for (int n : {10, 100, 1000}) {
+        std::shared_ptr<Expression> nested = V();
+        for (int k = 1; k < n; ++k) nested = make_mul(V(), nested);
+        auto pw = make_pow(V(), n);
+
+        double sink = 0;
+        std::shared_ptr<Expression> dn, dp;
+        double tn = measure_ms([&] { dn = nested->derivative(); });
+        std::size_t raw = count_nodes(dn.get());
+        double sn = measure_ms([&] { dn = dn->simplify(); });
+        double tp = measure_ms([&] { dp = pw->derivative()->simplify(); });
+        double en = measure_ms([&] { for (int i = 0; i < kEvals; ++i) sink += nested->evaluate(1 + i * 1e-6); });
+        double ep = measure_ms([&] { for (int i = 0; i < kEvals; ++i) sink += pw->evaluate(1 + i * 1e-6); });
+        std::cout << std::format("x^{:<4} 入れ子: 微分 {:.3f} ms ({} ノード) + 簡約 {:.3f} ms ({} ノード), evaluate x{} {:.3f} ms\n",
+                                 n, tn, raw, sn, count_nodes(dn.get()), kEvals, en);
+        std::cout << std::format("x^{:<4} Pow:    微分+簡約 {:.4f} ms ({} ノード), evaluate x{} {:.4f} ms [{}]\n",
+                                 n, tp, count_nodes(dp.get()), kEvals, ep, sink != 0);
+    }
+}
+
+// 簡約済みの木への simplify() の繰り返しと, 共有の多い DAG の simplify()
+void bench_simplify_memo() {
+    auto f = bench_tree(std::size_t{1} << 17)->derivative();
+    std::shared_ptr<Expression> g;
+    for (int i = 0; i < 4; ++i) {
+        double ms = measure_ms([&] { g = (i == 0 ? f : g)->simplify(); });
+        std::cout << std::format("simplify() {} 回目: {:.3f} ms ({} ノード)\n", i + 1, ms, count_nodes(g.get()));
+    }
+
+    // t_{k+1} = (t_k * t_k) + (t_k * 3): 木としては 4^k ノード, DAG としては 3k ノード
+    std::shared_ptr<Expression> t = make_add(V(), C(1));
+    constexpr int kDepth = 9;
+    for (int k = 0; k < kDepth; ++k) t = make_add(make_mul(t, t), make_mul(t, C(3)));
+    double ms = measure_ms([&] { g = t->simplify(); });
+    std::cout << std::format("共有 DAG (深さ {}, 木として {} ノード) の simplify(): {:.3f} ms\n",
+                             kDepth, count_nodes(t.get()), ms);
+}
+
+// 1 パスでは正規形にならない式: ((2x + -1x) * t) + ((3x + -3x) * t) の入れ子
+std::shared_ptr<Expression> bench_multipass_tree(int depth) {
+    if (depth == 0) return V();
+    auto t = bench_multipass_tree(depth - 1);
+    auto one = make_add(make_mul(C(2), V()), make_mul(C(-1), V()));
+    auto zero = make_add(make_mul(C(3), V()), make_mul(C(-3), V()));
+    return make_add(make_mul(one, t), make_mul(zero, bench_multipass_tree(depth - 1)));
+}
+
+// simplify() を to_string() が変わらなくなるまで繰り返す場合と simplify_fixpoint() の比較
+void bench_fixpoint() {
+    for (int depth : {8, 12, 16}) {
+        auto f1 = bench_multipass_tree(depth);
+        auto f2 = bench_multipass_tree(depth);
+        int passes = 0;
+        std::shared_ptr<Expression> g1, g2;
+        double loop = measure_ms([&] {
+            g1 = f1;
+            for (auto prev = g1->to_string();; ++passes) {
+                g1 = g1->simplify();
+                auto cur = g1->to_string();
+                if (cur == prev) break;
+                prev = std::move(cur);
+            }
+        });
+        double fix = measure_ms([&] { g2 = simplify_fixpoint(f2); });
+        std::cout << std::format("深さ {:>2} ({} ノード): simplify() ループ {} 回 {:.3f} ms, simplify_fixpoint {:.3f} ms, 一致 {}\n",
+                                 depth, count_nodes(f1.get()), passes + 1, loop, fix,
+                                 structurally_equal(g1.get(), g2.get()));
+    }
+}
+
+// builtin_rules の先頭から n 個, 足りなければ恒等式になる合成規則で埋める
+RuleSet bench_rule_set(std::size_t n) {
+    RuleSet rs;
+    for (auto& r : builtin_rules().rules)
+        if (rs.rules.size() < n) rs.add(r.source);
+    for (int k = 2; rs.rules.size() < n; ++k) {
+        std::string gen[] = {
+            std::format("(?a ^ {}) * ?a -> ?a ^ {}", k, k + 1),
+            std::format("?a * (?a ^ {}) -> ?a ^ {}", k, k + 1),
+            std::format("({} * ?a) + ({} * ?a) -> {} * ?a", k, k, 2 * k),
+            std::format("(?a + {}) + {} -> ?a", k, -k),
+        };
+        for (auto& g : gen)
+            if (rs.rules.size() < n) rs.add(g);
+    }
+    return rs;
+}
+
+// 微分直後の木の全ノードに対する根での規則照合のスループット
+void bench_rewrite_rules() {
+    auto f = make_add(bench_tree(std::size_t{1} << 14), make_mul(make_pow(V(), 3), V()))->derivative();
+    std::vector<const Expression*> nodes;
+    std::vector<const Expression*> stack{f.get()};
+    while (!stack.empty()) {
+        auto e = stack.back();
+        stack.pop_back();
+        nodes.push_back(e);
+        for (auto& k : children_of(e)) stack.push_back(k.get());
+    }
+
+    // 手書きの規則: 子の simplify() をキャッシュ済みにしてから各ノードの規則だけを測る
+    f->simplify();
+    std::size_t hits = 0;
+    double hand = measure_ms([&] {
+        for (auto e : nodes)
+            if (as<BinaryOp>(e) && e->simplify_uncached().get() != e) ++hits;
+    });
+    std::cout << std::format("規則照合 ({} ノード) 手書き (Add/Multiply::simplify): {:.2f} ms ({:.1f} ns/ノード, 変化 {})\n",
+                             nodes.size(), hand, hand * 1e6 / nodes.size(), hits);
+
+    for (std::size_t n : {10, 50, 200}) {
+        auto rs = bench_rule_set(n);
+        std::size_t lin_hits = 0, tree_hits = 0;
+        double lin = measure_ms([&] { for (auto e : nodes) lin_hits += rs.rewrite_linear(e) != nullptr; });
+        double tree = measure_ms([&] { for (auto e : nodes) tree_hits += rs.rewrite(e) != nullptr; });
+        std::cout << std::format("  規則 {:>3} 個: 逐次照合 {:.2f} ms ({:.1f} ns/ノード), 決定木 {:.2f} ms ({:.1f} ns/ノード), "
+                                 "一致 {} / {}\n",
+                                 n, lin, lin * 1e6 / nodes.size(), tree, tree * 1e6 / nodes.size(), lin_hits, tree_hits);
+    }
+}
+
+// コストモデルの予測と実測の evaluate() 時間を候補の形ごとに比較する
+void bench_cost_model() {
+    auto model = CostModel::calibrate();
+    std::cout << std::format("較正: ノード {:.2f}, 依存 1 段 {:.2f}, 加算 {:.2f}, 乗算 {:.2f}, 整数べき 1 段 {:.2f}, 実数べき {:.2f} (ns)\n",
+                             model.per_node, model.per_level, model.add, model.mul, model.pow_int_step, model.pow_real);
+
+    std::vector<std::pair<std::string, std::shared_ptr<Expression>>> corpus;
+    std::shared_ptr<Expression> fact = make_add(V(), C(1));
+    for (int i = 2; i <= 8; ++i) fact = make_mul(fact, make_add(V(), C(i)));
+    corpus.emplace_back("prod (x+i), i<=8", fact);
+    corpus.emplace_back("その微分", fact->derivative());
+    std::shared_ptr<Expression> nested = V();
+    for (int i = 1; i < 20; ++i) nested = make_mul(V(), nested);
+    corpus.emplace_back("x*x*...*x (20)", nested);
+    std::shared_ptr<Expression> series = C(1);
+    for (int i = 1; i <= 30; ++i) series = make_add(series, make_mul(C(1.0 / i), make_pow(V(), i)));
+    corpus.emplace_back("sum x^i/i, i<=30", series);
+    corpus.emplace_back("平衡木 256 の微分", bench_tree(256)->derivative());
+
+    std::vector<double> lp, lm;
+    int hits = 0;
+    for (auto& [name, e] : corpus) {
+        auto cs = speed_candidates(e, model);
+        std::size_t chosen = 0, fastest = 0;
+        std::vector<double> measured;
+        for (auto& c : cs) {
+            constexpr int kReps = 2000;
+            volatile double sink = 0;
+            double ms = measure_ms([&] { for (int i = 0; i < kReps; ++i) sink = sink + c.expr->evaluate(0.3 + i * 1e-7); });
+            measured.push_back(ms * 1e6 / kReps);
+            lp.push_back(std::log(c.predicted));
+            lm.push_back(std::log(measured.back()));
+        }
+        for (std::size_t i = 0; i < cs.size(); ++i) {
+            if (cs[i].predicted < cs[chosen].predicted) chosen = i;
+            if (measured[i] < measured[fastest]) fastest = i;
+        }
+        hits += chosen == fastest;
+        std::cout << std::format("{}:\n", name);
+        for (std::size_t i = 0; i < cs.size(); ++i)
+            std::cout << std::format("  {:<8} 予測 {:>9.1f} ns, 実測 {:>9.1f} ns{}{}\n", cs[i].form, cs[i].predicted,
+                                     measured[i], i == chosen ? " [選択]" : "", i == fastest ? " [最速]" : "");
+    }
+    // 対数をとった予測と実測の相関係数
+    auto mean = [](auto& v) { return std::accumulate(v.begin(), v.end(), 0.0) / v.size(); };
+    double mp = mean(lp), mm = mean(lm), sxy = 0, sxx = 0, syy = 0;
+    for (std::size_t i = 0; i < lp.size(); ++i) {
+        sxy += (lp[i] - mp) * (lm[i] - mm);
+        sxx += (lp[i] - mp) * (lp[i] - mp);
+        syy += (lm[i] - mm) * (lm[i] - mm);
+    }
+    std::cout << std::format("予測と実測の相関 (対数): {:.3f}, 最速の形を選べた式: {} / {}\n",
+                             sxy / std::sqrt(sxx * syy), hits, corpus.size());
+}
+
+// 多項式的な入力の微分について, くくり出し前後の演算数と evaluate() 時間を比較
+void bench_factoring() {
+    std::vector<std::pair<std::string, std::shared_ptr<Expression>>> corpus;
+    auto prod = [](int n, auto&& factor) {
+        std::vector<std::shared_ptr<Expression>> fs;
+        for (int i = 1; i <= n; ++i) fs.push_back(factor(i));
+        return std::shared_ptr<Expression>(make_product(std::move(fs)));
+    };
+    corpus.emplace_back("prod (x+i), i<=6", prod(6, [](int i) { return make_add(V(), C(i)); }));
+    corpus.emplace_back("prod (x+i*y), i<=5", prod(5, [](int i) { return make_add(V(), make_mul(C(i), V("y"))); }));
+    corpus.emplace_back("prod (x^2+i*y), i<=4", prod(4, [](int i) { return make_add(make_pow(V(), 2), make_mul(C(i), V("y"))); }));
+    corpus.emplace_back("平衡木 64", bench_tree(64));
+
+    for (auto& [name, f] : corpus) {
+        auto before = simplify_fixpoint(flatten(f->derivative()));
+        std::shared_ptr<Expression> after;
+        double ft = measure_ms([&] { after = factor_common(before); });
+        auto ob = count_ops(before.get()), oa = count_ops(after.get());
+        constexpr int kReps = 20000;
+        volatile double sink = 0;
+        double tb = measure_ms([&] { for (int i = 0; i < kReps; ++i) sink = sink + before->evaluate(0.7 + i * 1e-7); });
+        double ta = measure_ms([&] { for (int i = 0; i < kReps; ++i) sink = sink + after->evaluate(0.7 + i * 1e-7); });
+        double err = std::abs(before->evaluate(0.7) - after->evaluate(0.7)) / std::max(1.0, std::abs(before->evaluate(0.7)));
+        std::cout << std::format("{} の微分: 乗算 {} -> {}, 加算 {} -> {}, evaluate {:.1f} -> {:.1f} ns, "
+                                 "くくり出し {:.2f} ms, 相対誤差 {:.1e}\n",
+                                 name, ob.mul, oa.mul, ob.add, oa.add, tb * 1e6 / kReps, ta * 1e6 / kReps, ft, err);
+    }
+}
+
+// 深い鎖の evaluate() とデストラクタは再帰が深いので, 大きなスタックのスレッドで実行する
+template<typename F>
+void run_with_large_stack(std::size_t bytes, F f) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, bytes);
+    pthread_t th;
+    auto body = [](void* p) -> void* {
+        (*static_cast<F*>(p))();
+        return nullptr;
+    };
+    if (pthread_create(&th, &attr, body, &f) != 0) throw std::runtime_error("pthread_create に失敗");
+    pthread_join(th, nullptr);
+    pthread_attr_destroy(&attr);
+}
+
+// 左に偏った和の鎖 sum_i (c_i * x) の evaluate() の遅延を平衡化の前後で比較
+void bench_rebalance() {
+    run_with_large_stack(std::size_t{4} << 30, [] {
+        for (int n : {1000, 10000, 100000, 1000000}) {
+            std::shared_ptr<Expression> chain = make_mul(C(1), V());
+            for (int i = 1; i < n; ++i) chain = make_add(chain, make_mul(C(i % 7 + 1), V()));
+            std::shared_ptr<Expression> exact, balanced;
+            double tp = measure_ms([&] { exact = rebalance(chain, FloatOrder::Preserve); });
+            double tr = measure_ms([&] { balanced = rebalance(chain); });
+
+            int reps = std::max(1, 2000000 / n);
+            auto latency = [&](const std::shared_ptr<Expression>& e) {
+                volatile double sink = 0;
+                return measure_ms([&] { for (int i = 0; i < reps; ++i) sink = sink + e->evaluate(0.3 + i * 1e-9); }) * 1e6 / reps;
+            };
+            double lc = latency(chain), lp = latency(exact), lr = latency(balanced);
+            double x = 0.123456789;
+            std::cout << std::format("項数 {:>7}: 深さ {} / {} / {}, evaluate 鎖 {:.0f} ns, 順序保存 {:.0f} ns, 平衡 {:.0f} ns "
+                                     "(変換 {:.1f} / {:.1f} ms), 順序保存の一致 {}, 平衡の相対差 {:.1e}\n",
+                                     n, tree_depth(chain.get()), tree_depth(exact.get()), tree_depth(balanced.get()),
+                                     lc, lp, lr, tp, tr, chain->evaluate(x) == exact->evaluate(x),
+                                     std::abs(balanced->evaluate(x) - chain->evaluate(x)) / std::abs(chain->evaluate(x)));
+        }
+    });
+}
+
+// 変数 n 個の帯状の問題で, 彩色した掃引と要素ごとの記号微分 + 評価を比較する.
+// ヤコビ行列: F_i = x_i^2 * x_{i+1} + 3 x_{i-1} (i = 0..n-1, 範囲外は省く)
+// ヘッセ行列: Rosenbrock 関数 sum 100 (x_{i+1} - x_i^2)^2 + (1 - x_i)^2
+void bench_jacobian_hessian() {
+    for (int n : {100, 200, 400}) {
+        std::vector<std::string> names;
+        for (int i = 0; i < n; ++i) names.push_back(std::format("x{}", i));
+        std::vector<std::shared_ptr<Expression>> F;
+        for (int i = 0; i < n; ++i) {
+            std::vector<std::shared_ptr<Expression>> terms;
+            std::shared_ptr<Expression> xi2 = make_pow(V(names[i]), 2);
+            terms.push_back(i + 1 < n ? make_mul(xi2, V(names[i + 1])) : xi2);
+            if (i > 0) terms.push_back(make_product({V(names[i - 1])}, 3));
+            F.push_back(make_sum(std::move(terms)));
+        }
+        std::vector<std::shared_ptr<Expression>> rb;
+        for (int i = 0; i + 1 < n; ++i) {
+            auto d = make_sum({V(names[i + 1]), make_product({make_pow(V(names[i]), 2)}, -1)});
+            rb.push_back(make_product({make_pow(d, 2)}, 100));
+            rb.push_back(make_pow(make_sum({make_product({V(names[i])}, -1)}, 1), 2));
+        }
+        auto f = make_sum(std::move(rb));
+
+        std::vector<double> x(n);
+        std::unordered_map<std::string, double> env;
+        for (int i = 0; i < n; ++i) env[names[i]] = x[i] = 0.5 + 0.01 * i;
+
+        std::optional<SparseJacobian> jac;
+        std::optional<SparseHessian> hes;
+        CsrMatrix J, H;
+        double tjb = measure_ms([&] { jac.emplace(F, names); });
+        double tje = measure_ms([&] { J = jac->evaluate(x); });
+        double thb = measure_ms([&] { hes.emplace(f, names); });
+        double the = measure_ms([&] { H = hes->evaluate(x); });
+
+        // 要素ごとの素朴な方法 (n^2 個の偏微分を作って評価する).
+        // ヘッセ行列は n^3 に比例して遅いので, 等間隔に選んだ sampled 行だけ求めて n 行分に換算する
+        int sampled = std::min(n, 16);
+        std::vector<double> Jn(std::size_t(n) * n), Hn(std::size_t(n) * n);
+        double tjn = measure_ms([&] {
+            for (int i = 0; i < n; ++i)
+                for (int j = 0; j < n; ++j) Jn[i * n + j] = evaluate_at(partial_derivative(F[i], names[j]).get(), env);
+        });
+        double thn = measure_ms([&] {
+            for (int r = 0; r < sampled; ++r) {
+                int j = r * n / sampled;
+                auto dj = partial_derivative(f, names[j]);
+                for (int k = 0; k < n; ++k) Hn[j * n + k] = evaluate_at(partial_derivative(dj, names[k]).get(), env);
+            }
+        }) * n / sampled;
+        double ej = 0, eh = 0;
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < n; ++j) ej = std::max(ej, std::abs(J.at(i, j) - Jn[i * n + j]));
+        for (int r = 0; r < sampled; ++r)
+            for (int j = r * n / sampled, k = 0; k < n; ++k)
+                eh = std::max(eh, std::abs(H.at(j, k) - Hn[j * n + k]) / std::max(1.0, std::abs(Hn[j * n + k])));
+        std::cout << std::format("n = {:>3}: ヤコビ 非零 {} / 掃引 {} ({}), 構築 {:.2f} ms + 評価 {:.3f} ms, 要素ごと {:.1f} ms, 最大差 {:.1e}\n",
+                                 n, J.nonzeros(), jac->color_count, jac->reverse ? "逆" : "前進", tjb, tje, tjn, ej);
+        std::cout << std::format("         ヘッセ 非零 {} / 掃引 {}, 構築 {:.2f} ms + 評価 {:.3f} ms, 要素ごと {:.1f} ms ({} 行から換算), 最大相対差 {:.1e}\n",
+                                 H.nonzeros(), hes->color_count, thb, the, thn, sampled, eh);
+    }
+}
+
+// 入力 n 個から層を重ねた DAG (各ノードは前の層の隣り合う 2 ノードを使う) を作り,
+// 入力の 1% を変えたときの差分再評価と, テープ全体の再評価を比較する
+void bench_incremental() {
+    std::mt19937 rng(37);
+    for (int n : {10000, 100000}) {
+        constexpr int kLayers = 8, kBlock = 64;
+        std::vector<std::string> names;
+        std::vector<std::shared_ptr<Expression>> layer;
+        for (int i = 0; i < n; ++i) {
+            names.push_back(std::format("x{}", i));
+            layer.push_back(V(names.back()));
+        }
+        for (int l = 0; l < kLayers; ++l) {
+            std::vector<std::shared_ptr<Expression>> next;
+            for (int i = 0; i < n; ++i) next.push_back(make_add(make_mul(layer[i], layer[(i + 1) % n]), C(0.25)));
+            layer = std::move(next);
+        }
+        std::vector<std::shared_ptr<Expression>> outputs;
+        for (int i = 0; i < n; i += kBlock)
+            outputs.push_back(make_sum({layer.begin() + i, layer.begin() + std::min(n, i + kBlock)}));
+
+        std::uniform_real_distribution<double> value(0.1, 0.9);
+        std::vector<double> x(n);
+        for (auto& xi : x) xi = value(rng);
+        IncrementalEvaluator inc(Tape::compile(outputs, names), x);
+
+        constexpr int kUpdates = 50;
+        int changed = n / 100;
+        std::uniform_int_distribution<int> pick(0, n - 1);
+        std::vector<std::vector<std::pair<int, double>>> changes(kUpdates);
+        for (auto& c : changes)
+            for (int k = 0; k < changed; ++k) c.emplace_back(pick(rng), value(rng));
+
+        std::size_t recomputed = 0;
+        std::vector<double> got;
+        double ti = measure_ms([&] {
+            for (auto& c : changes) {
+                for (auto [i, v] : c) inc.set(i, v);
+                got = inc.update();
+                recomputed += inc.recomputed;
+            }
+        }) / kUpdates;
+        std::vector<double> values, full;
+        double tf = measure_ms([&] {
+            for (auto& c : changes) {
+                for (auto [i, v] : c) x[i] = v;
+                inc.tape.forward(x, values);
+            }
+        }) / kUpdates;
+        full = inc.tape.evaluate(x);
+        std::cout << std::format("入力 {:>6} (命令 {}), 1 回に {} 入力を変更: 差分 {:.3f} ms (平均 {} 命令), 全体 {:.3f} ms, 出力の一致 {}\n",
+                                 n, inc.tape.code.size(), changed, ti, recomputed / kUpdates, tf, got == full);
+    }
+}
+
+// 各スレッドが同じ形の式 (sum_i c_i * x_{i mod 16}^k_i を 2 項の和で連ねたもの) を組み立てる.
+// 表を使う場合はスレッド間で部分木が共有され, ノード数はスレッド数によらない
+void bench_intern() {
+    constexpr int kTerms = 20000, kReps = 5;
+    std::vector<std::string> names;
+    for (int i = 0; i < 16; ++i) names.push_back(std::format("x{}", i));
+    auto build = [&](auto&& constant, auto&& add, auto&& mul, auto&& pow) {
+        std::shared_ptr<Expression> acc = constant(0.5);
+        for (int i = 0; i < kTerms; ++i)
+            acc = add(acc, mul(constant(i % 32 + 0.5), pow(V(names[i % 16]), i % 4 + 2)));
+        return acc;
+    };
+    std::cout << std::format("(ハードウェアスレッド {})\n", std::thread::hardware_concurrency());
+    for (int threads : {1, 2, 4, 8}) {
+        InternTable table;
+        std::vector<std::shared_ptr<Expression>> kept(threads);
+        std::size_t requested = std::size_t(threads) * kReps * kTerms * 4;
+        auto run = [&](auto&& body) {
+            return measure_ms([&] {
+                std::vector<std::thread> pool;
+                for (int t = 0; t < threads; ++t) pool.emplace_back([&, t] { for (int r = 0; r < kReps; ++r) kept[t] = body(); });
+                for (auto& th : pool) th.join();
+            });
+        };
+        double tp = run([&] {
+            return build([](double v) { return std::shared_ptr<Expression>(C(v)); },
+                         [](auto l, auto r) { return std::shared_ptr<Expression>(make_add(l, r)); },
+                         [](auto l, auto r) { return std::shared_ptr<Expression>(make_mul(l, r)); },
+                         [](auto b, double e) { return std::shared_ptr<Expression>(make_pow(b, e)); });
+        });
+        kept.assign(threads, nullptr);
+        double ti = run([&] {
+            return build([&](double v) { return table.constant(v); },
+                         [&](auto l, auto r) { return table.add(l, r); },
+                         [&](auto l, auto r) { return table.mul(l, r); },
+                         [&](auto b, double e) { return table.pow(b, e); });
+        });
+        bool shared = std::all_of(kept.begin(), kept.end(), [&](auto& k) { return k == kept[0]; });
+        std::cout << std::format("スレッド {}: 共有なし {:.1f} Mノード/s, 表 {:.1f} Mノード/s (生存項目 {}, ヒット {}, 競合 {}), 結果の共有 {}\n",
+                                 threads, requested / tp / 1e3, requested / ti / 1e3, table.size(), table.hits(),
+                                 table.contended(), shared);
+    }
+}
+
+// 同じテープを float と double のパックでバッチ評価したときの処理量と,
+// long double の木の評価を基準とした誤差を比べる
+void bench_scalar_types() {
+    std::vector<std::pair<std::string, std::shared_ptr<Expression>>> cases{
+        {"q'(x) (未簡約)", make_mul(make_mul(make_add(V(), C(1)), make_add(V(), C(2))), make_add(V(), C(3)))->derivative()},
+        {"bench_tree(1024)", bench_tree(1024)},
+        {"多項式 sum_k x^k / k (k <= 32)", [] {
+            std::vector<std::shared_ptr<Expression>> terms;
+            for (int k = 1; k <= 32; ++k) terms.push_back(make_product({make_pow(V(), k)}, 1.0 / k));
+            return std::shared_ptr<Expression>(make_sum(std::move(terms)));
+        }()},
+    };
+    constexpr std::size_t kPoints = 1 << 16;
+    for (auto& [name, e] : cases) {
+        auto tape = Tape::compile({e});
+        std::vector<float> xf(kPoints), of(kPoints);
+        std::vector<double> xd(kPoints), od(kPoints);
+        for (std::size_t i = 0; i < kPoints; ++i) xf[i] = static_cast<float>(xd[i] = 0.9 * i / kPoints);
+        // float と double の入力を同じ値にそろえる
+        for (std::size_t i = 0; i < kPoints; ++i) xd[i] = xf[i];
+
+        int reps = std::max<int>(1, 20000000 / int(kPoints * tape.code.size()));
+        double tf = measure_ms([&] { for (int r = 0; r < reps; ++r) evaluate_batch<float>(tape, xf, of); }) / reps;
+        double td = measure_ms([&] { for (int r = 0; r < reps; ++r) evaluate_batch<double>(tape, xd, od); }) / reps;
+        double ts = measure_ms([&] { for (std::size_t i = 0; i < kPoints; ++i) od[i] = e->evaluate(xd[i]); });
+        evaluate_batch<double>(tape, xd, od);
+
+        double ef = 0, ed = 0;
+        for (std::size_t i = 0; i < kPoints; i += 64) {
+            long double ref = evaluate_as<long double>(e.get(), xd[i]);
+            double scale = std::max<double>(1, std::abs(static_cast<double>(ref)));
+            ef = std::max(ef, std::abs(static_cast<double>(of[i] - ref)) / scale);
+            ed = std::max(ed, std::abs(static_cast<double>(od[i] - ref)) / scale);
+        }
+        std::cout << std::format("{} (命令 {}): float {:.0f} M評価/s, double {:.0f} M評価/s, 木の evaluate {:.1f} M評価/s, "
+                                 "long double との差 float {:.1e} / double {:.1e}\n",
+                                 name, tape.code.size(), kPoints / tf / 1e3, kPoints / td / 1e3, kPoints / ts / 1e3, ef, ed);
+    }
+}
+
+// 区間上の最小値: 分枝限定法の保証付き囲みと, 等間隔の標本点の最小 (上界でしかない) を比べる
+void bench_interval() {
+    auto x = [] { return std::shared_ptr<Expression>(V()); };
+    // w(x) = prod_{k=1..8} (x - k) (Wilkinson 型, 極小が 4 つ)
+    std::vector<std::shared_ptr<Expression>> roots;
+    for (int k = 1; k <= 8; ++k) roots.push_back(make_add(x(), C(-k)));
+    std::vector<std::tuple<std::string, std::shared_ptr<Expression>, Interval>> cases{
+        {"prod (x - k), k = 1..8 on [0, 9]", make_product(roots), {0, 9}},
+        {"x^4 - 3x^3 + 2x + 1 on [-2, 3]",
+         make_sum({make_pow(x(), 4), make_product({make_pow(x(), 3)}, -3), make_product({x()}, 2)}, 1), {-2, 3}},
+        {"bench_tree(64) on [-1, 1]", bench_tree(64), {-1, 1}},
+    };
+    for (auto& [name, f, dom] : cases) {
+        auto whole = evaluate_as(f.get(), dom);
+        IntervalMinimum r;
+        double tb = measure_ms([&] { r = minimize_interval(f, dom, 1e-9); });
+        std::cout << std::format("{}: 区間全体の評価 [{:.4g}, {:.4g}], 分枝限定 [{:.12g}, {:.12g}] (幅 {:.1e}, {:.2f} ms, "
+                                 "区間 {}, 枝刈り {}, 単調 {}) at x = {:.9g}\n",
+                                 name, whole.lo, whole.hi, r.value.lo, r.value.hi, r.value.width(), tb,
+                                 r.boxes, r.pruned, r.monotone, r.argmin);
+        for (std::size_t n : {std::size_t{1000}, std::size_t{1000000}}) {
+            double best = std::numeric_limits<double>::infinity();
+            double ts = measure_ms([&] {
+                for (std::size_t i = 0; i <= n; ++i) best = std::min(best, f->evaluate(dom.lo + dom.width() * i / n));
+            });
+            std::cout << std::format("  標本 {:>7} 点: 最小 {:.12g} ({:.2f} ms, 保証なし)\n", n, best, ts);
+        }
+    }
+}
+
+// q(x) = (x + 1)(x + 2)(x + 3) とその導関数を, 式テンプレート・実行時の木・手書きのコードで評価する
+void bench_compile_time() {
+    using namespace ct;
+    constexpr auto q = (x + c<1.0>) * (x + c<2.0>) * (x + c<3.0>);
+    constexpr auto dq = derivative(q);
+    auto rq = to_runtime(q);
+    auto rdq = rq->derivative()->simplify();
+    auto hand_q = [](double v) { return (v + 1) * (v + 2) * (v + 3); };
+    auto hand_dq = [](double v) { return (v + 2) * (v + 3) + (v + 1) * (v + 3) + (v + 1) * (v + 2); };
+
+    constexpr int kPoints = 1 << 20;
+    std::vector<double> xs(kPoints);
+    for (int i = 0; i < kPoints; ++i) xs[i] = 1.0 * i / kPoints;
+    auto run = [&](auto&& f) {
+        double sum = 0;
+        double t = measure_ms([&] { for (double v : xs) sum += f(v); });
+        return std::pair{t * 1e6 / kPoints, sum};
+    };
+    auto [tq, sq] = run(q);
+    auto [tr, sr] = run([&](double v) { return rq->evaluate(v); });
+    auto [th, sh] = run(hand_q);
+    auto [tdq, sdq] = run(dq);
+    auto [tdr, sdr] = run([&](double v) { return rdq->evaluate(v); });
+    auto [tdh, sdh] = run(hand_dq);
+    double tdb = run([&](double v) { return rq->derivative()->simplify()->evaluate(v); }).first;
+    std::cout << std::format("q:  式テンプレート {:.2f} ns, 実行時の木 {:.2f} ns, 手書き {:.2f} ns (合計の一致 {} / {})\n",
+                             tq, tr, th, sq == sh, sr == sh);
+    std::cout << std::format("q': 式テンプレート {:.2f} ns, 実行時の木 (微分済み) {:.2f} ns, 手書き {:.2f} ns, "
+                             "毎回 derivative()+simplify() {:.0f} ns (相対差 {:.1e} / {:.1e})\n",
+                             tdq, tdr, tdh, tdb, std::abs(sdq - sdh) / sdh, std::abs(sdr - sdh) / sdh);
+}
+
+// megabytes MB の double 列ファイルを作り, q(x) と q'(x) を逐次評価する.
+// 物理メモリより大きいファイルでの計測は ./test stream <MB> で行う
+void bench_streaming(std::size_t megabytes = 512) {
+    auto dir = std::filesystem::temp_directory_path();
+    auto in64 = (dir / "expr_stream_in64.bin").string(), in32 = (dir / "expr_stream_in32.bin").string();
+    auto csv = (dir / "expr_stream_in.csv").string(), out = (dir / "expr_stream_out.bin").string();
+    std::size_t n = megabytes * (std::size_t{1} << 20) / sizeof(double);
+    {
+        auto f64 = MappedFile::create(in64, n * sizeof(double));
+        auto f32 = MappedFile::create(in32, n * sizeof(float));
+        auto* d = reinterpret_cast<double*>(f64.data());
+        auto* s = reinterpret_cast<float*>(f32.data());
+        for (std::size_t i = 0; i < n; ++i) {
+            s[i] = static_cast<float>(d[i] = static_cast<double>(i % 1000003) / 1000003);
+            if ((i + 1) % stream_detail::kChunk == 0) {
+                f64.release((i + 1 - stream_detail::kChunk) * sizeof(double), stream_detail::kChunk * sizeof(double));
+                f32.release((i + 1 - stream_detail::kChunk) * sizeof(float), stream_detail::kChunk * sizeof(float));
+            }
+        }
+    }
+    std::size_t csv_rows = std::min<std::size_t>(n, 1 << 21);
+    {
+        std::ofstream c(csv);
+        c << "id,x\n";
+        for (std::size_t i = 0; i < csv_rows; ++i) c << i << "," << std::format("{}", static_cast<double>(i % 1000003) / 1000003) << "\n";
+    }
+
+    auto q = make_product({make_add(V(), C(1)), make_add(V(), C(2)), make_add(V(), C(3))});
+    auto tape = Tape::compile({q, q->derivative()});
+    std::size_t base = resident_bytes();
+    auto report = [&](const std::string& name, const StreamStats& st, bool f32 = false) {
+        auto check = MappedFile::open_read(out);
+        auto* r = reinterpret_cast<const double*>(check.data());
+        std::size_t i = st.samples / 2;
+        double x = static_cast<double>(i % 1000003) / 1000003;
+        if (f32) x = static_cast<float>(x);
+        bool ok = r[i * 2] == tape.evaluate(std::vector<double>{x})[0];
+        std::cout << std::format("{}: {} 標本, 入力 {:.0f} MB + 出力 {:.0f} MB, {:.2f} s, {:.2f} GB/s, 常駐 {:.1f} MB (開始時 {:.1f} MB), 検算 {}\n",
+                                 name, st.samples, st.bytes_in / 1e6, st.bytes_out / 1e6, st.seconds, st.gb_per_s(),
+                                 st.peak_resident / 1e6, base / 1e6, ok);
+    };
+    report("mmap double", stream_evaluate(tape, in64, ColumnType::Float64, out));
+    report("mmap float ", stream_evaluate(tape, in32, ColumnType::Float32, out), true);
+    report("CSV        ", stream_evaluate_csv(tape, csv, 1, out));
+
+    // 比較: ベクタへ読み込んでから評価する (入力と出力の両方が常駐する)
+    if (megabytes <= 1024) {
+        std::size_t peak = 0;
+        double t = measure_ms([&] {
+            std::vector<double> xs(n), ys(n * 2);
+            std::ifstream(in64, std::ios::binary).read(reinterpret_cast<char*>(xs.data()), static_cast<std::streamsize>(n * sizeof(double)));
+            for (std::size_t b = 0; b < n; b += stream_detail::kBlock)
+                stream_detail::evaluate_block(tape, std::span(xs).subspan(b, std::min(stream_detail::kBlock, n - b)), ys.data() + b * 2);
+            std::ofstream(out, std::ios::binary).write(reinterpret_cast<const char*>(ys.data()), static_cast<std::streamsize>(ys.size() * sizeof(double)));
+            peak = resident_bytes();
+        }) / 1e3;
+        std::cout << std::format("ベクタへ読み込み: {:.2f} s, {:.2f} GB/s, 常駐 {:.1f} MB\n", t, n * 3 * sizeof(double) / t / 1e9, peak / 1e6);
+    }
+    for (auto& p : {in64, in32, csv, out}) std::filesystem::remove(p);
+}
+
+// 大きな式の derivative() と simplify() を, キャッシュなし・空のキャッシュ (初回)・書き込み済みのキャッシュ (2 回目) で比べる.
+// 毎回式を作り直すので, プロセス内の simplify のメモ化は効かない
+void bench_disk_cache() {
+    auto dir = std::filesystem::temp_directory_path() / "expr_disk_cache";
+    std::vector<std::pair<std::string, std::function<std::shared_ptr<Expression>()>>> cases{
+        {"bench_tree(16384)", [] { return bench_tree(16384); }},
+        {"prod_{k=1..16} (x + k)", [] {
+            std::vector<std::shared_ptr<Expression>> fs;
+            for (int k = 1; k <= 16; ++k) fs.push_back(make_add(V(), C(k)));
+            return std::shared_ptr<Expression>(make_product(std::move(fs)));
+        }},
+    };
+    for (auto& [name, build] : cases) {
+        std::filesystem::remove_all(dir);
+        std::shared_ptr<Expression> plain, cold, warm;
+        double tp = measure_ms([&] { plain = build()->derivative()->simplify(); });
+        auto run = [&](std::shared_ptr<Expression>& out) {
+            DiskCache cache(dir);
+            double t = measure_ms([&] { out = cache.simplify(cache.derivative(build())); });
+            return std::pair{t, cache.hits};
+        };
+        auto [tc, hc] = run(cold);
+        auto [tw, hw] = run(warm);
+        // 引く費用のうち構造ハッシュの分 (読み込みと復元は 2 回目の時間に含まれる)
+        auto f = build();
+        double th = measure_ms([&] { structural_hash(f); });
+        double ts = measure_ms([&] { serialize(f); });
+        std::size_t bytes = 0;
+        for (auto& entry : std::filesystem::directory_iterator(dir)) bytes += entry.file_size();
+        std::cout << std::format("{}: キャッシュなし {:.2f} ms, 初回 {:.2f} ms (ヒット {}), 2 回目 {:.2f} ms (ヒット {}), "
+                                 "ハッシュ {:.2f} ms + 直列化 {:.2f} ms, ファイル {} バイト (to_string {} 文字), 一致 {}\n",
+                                 name, tp, tc, hc, tw, hw, th, ts, bytes, plain->to_string().size(),
+                                 structurally_equal(cold.get(), warm.get()) && cold->evaluate(0.7) == plain->evaluate(0.7));
+    }
+    // 計算の重い演算: 3 変数 216 項の多項式からの共通因数のくくり出し
+    auto poly = [] {
+        std::vector<std::shared_ptr<Expression>> terms;
+        for (int i = 0; i < 6; ++i)
+            for (int j = 0; j < 6; ++j)
+                for (int k = 0; k < 6; ++k)
+                    terms.push_back(make_product({make_pow(V(), i + 1), make_pow(V("y"), j + 1), make_pow(V("z"), k + 1)}, i + 2 * j + 3 * k + 1));
+        return std::shared_ptr<Expression>(make_sum(std::move(terms)));
+    };
+    std::filesystem::remove_all(dir);
+    std::shared_ptr<Expression> factored;
+    double tp = measure_ms([&] { factored = factor_common(poly()); });
+    double tc = 0, tw = 0;
+    for (double* t : {&tc, &tw}) {
+        DiskCache cache(dir);
+        *t = measure_ms([&] { auto f = poly(); factored = cache.cached("factor", f, [&] { return factor_common(f); }); });
+    }
+    std::cout << std::format("factor_common (216 項): キャッシュなし {:.2f} ms, 初回 {:.2f} ms, 2 回目 {:.2f} ms\n", tp, tc, tw);
+    std::filesystem::remove_all(dir);
+}
+
+// bench_tree(n) をポインタの木と SoA ストアで持ったときの 1 ノードあたりのメモリと,
+// evaluate / derivative / simplify の速度を比べる. ノード数はポインタ側が木として数えた数,
+// SoA 側が追加されたノード数 (共有された部分木は 1 つ) なので, 同じ式でも数え方が違う
+void bench_soa_store() {
+    for (std::size_t n : {std::size_t{1} << 16, std::size_t{1} << 20}) {
+        auto bytes0 = g_alloc_bytes.load();
+        auto f = bench_tree(n);
+        // 葉は C/V のシングルトンなので, 確保されたのは内部ノード n - 1 個
+        double ptr_per_node = double(g_alloc_bytes.load() - bytes0) / double(n - 1);
+
+        ExprStore store;
+        ExprStore::Ref root = 0;
+        double t_import = measure_ms([&] { root = store.import(f); });
+        double soa_per_node = double(store.bytes()) / double(store.size());
+
+        int reps = std::max<int>(1, int((std::size_t{1} << 24) / n));
+        volatile double sink = 0;
+        double te_ptr = measure_ms([&] { for (int i = 0; i < reps; ++i) sink = sink + f->evaluate(0.3 + i * 1e-9); }) / reps;
+        auto root_cone = store.cone(root);
+        double te_soa = measure_ms([&] { for (int i = 0; i < reps; ++i) sink = sink + store.evaluate(root_cone, 0.3 + i * 1e-9); }) / reps;
+
+        std::shared_ptr<Expression> df, sdf;
+        ExprStore::Ref droot = 0, sroot = 0;
+        double td_ptr = measure_ms([&] { df = f->derivative(); });
+        std::size_t before = store.size();
+        double td_soa = measure_ms([&] { droot = store.derivative(root); });
+        std::size_t d_nodes = store.size() - before;
+        double ts_ptr = measure_ms([&] { sdf = df->simplify(); });
+        before = store.size();
+        double ts_soa = measure_ms([&] { sroot = store.simplify(droot); });
+        std::size_t s_nodes = store.size() - before;
+
+        double a = store.evaluate(sroot, 0.3), b = sdf->evaluate(0.3);
+        bool same = a == b || std::abs(a - b) <= 1e-9 * std::max(1.0, std::abs(b));
+        std::cout << std::format("n = {:>7}: 1 ノード ポインタ {:.1f} B / SoA {:.1f} B (取り込み {:.1f} ms)\n", n, ptr_per_node, soa_per_node, t_import);
+        std::cout << std::format("           evaluate {:.3f} / {:.3f} ms, derivative {:.2f} / {:.2f} ms ({} / {} ノード), "
+                                 "simplify {:.2f} / {:.2f} ms ({} / {} ノード), 値の一致 {}\n",
+                                 te_ptr, te_soa, td_ptr, td_soa, count_nodes(df.get()), d_nodes,
+                                 ts_ptr, ts_soa, count_nodes(sdf.get()), s_nodes, same);
+    }
+}
+
+// 大きな式を微分して数点で評価するだけの使い方: derivative() で導関数の木を作ってから評価するのと,
+// 遅延ノードを前進モードで評価するのとで, 時間と確保したバイト数を比べる
+void bench_lazy_derivative() {
+    constexpr double xs[] = {0.3, 0.5, 0.7};
+    auto close = [](double a, double b) { return a == b || std::abs(a - b) <= 1e-9 * std::max(1.0, std::abs(b)); };
+    for (std::size_t n : {std::size_t{1} << 16, std::size_t{1} << 20}) {
+        auto f = bench_tree(n);
+        for (int order : {1, 2}) {
+            auto run = [&](auto&& differentiate) {
+                auto bytes0 = g_alloc_bytes.load();
+                std::vector<double> vals;
+                double t = measure_ms([&] {
+                    auto df = differentiate(f);
+                    if (order == 2) df = df->derivative();
+                    for (double x : xs) vals.push_back(df->evaluate(x));
+                });
+                return std::tuple{t, g_alloc_bytes.load() - bytes0, vals};
+            };
+            auto [te, be, ve] = run([](auto& g) { return g->derivative(); });
+            auto [tl, bl, vl] = run([](auto& g) { return std::shared_ptr<Expression>(make_derivative(g)); });
+            bool same = std::ranges::equal(ve, vl, close);
+            std::cout << std::format("n = {:>7}, {} 階, {} 点: 展開 {:.2f} ms / {:.1f} MB, 遅延 {:.2f} ms / {} B, 値の一致 {}\n",
+                                     n, order, std::size(xs), te, be / 1e6, tl, bl, same);
+        }
+        // 一部だけ見る: 先頭 1 段の記号的な形
+        std::shared_ptr<Expression> top;
+        auto bytes0 = g_alloc_bytes.load();
+        double tt = measure_ms([&] { top = make_derivative(f)->expand(); });
+        std::cout << std::format("           先頭 1 段の展開 {:.4f} ms / {} B (子 {} 個は未展開)\n",
+                                 tt, g_alloc_bytes.load() - bytes0, children_of(top.get()).size());
+    }
+}
+
+// 微分で増える a * b + c * d の形を Fma に融合したテープの速度と精度. 基準は long double での木の評価.
+// FMA 命令を使うには -mfma (または -march=native) でのコンパイルが要る. 無ければ std::fma はライブラリ呼び出し
+void bench_fma() {
+    std::cout << std::format("FMA 命令: {}\n",
+#ifdef FP_FAST_FMA
+                             "あり (FP_FAST_FMA 定義済み)"
+#else
+                             "なし (FP_FAST_FMA 未定義)"
+#endif
+    );
+    for (std::size_t n : {std::size_t{1} << 12, std::size_t{1} << 16}) {
+        auto df = bench_tree(n)->derivative();
+        auto plain = Tape::compile({df}, {}, FmaMode::Off);
+        auto fused = Tape::compile({df}, {}, FmaMode::Fuse);
+        auto fmas = std::ranges::count_if(fused.code, [](const Instr& in) { return in.op == Op::Fma; });
+
+        constexpr std::size_t kSamples = 4096;
+        std::vector<double> xs(kSamples);
+        for (std::size_t i = 0; i < kSamples; ++i) xs[i] = 0.3 + 0.4 * double(i) / kSamples;
+
+        // 精度: 相対誤差の最大と平均, どちらが基準に近いか
+        double max_p = 0, max_f = 0, sum_p = 0, sum_f = 0;
+        std::size_t closer = 0, farther = 0, counted = 0, same_as_tree = 0;
+        std::vector<double> vp, vf;
+        for (double x : xs) {
+            long double ref = evaluate_as<long double>(df.get(), x);
+            std::array<double, 1> in{x};
+            plain.forward(in, vp);
+            fused.forward(in, vf);
+            double p = vp[plain.outputs[0]], f = vf[fused.outputs[0]];
+            same_as_tree += p == df->evaluate(x);
+            if (!std::isfinite(p) || ref == 0) continue;
+            double ep = double(std::abs((p - ref) / ref)), ef = double(std::abs((f - ref) / ref));
+            max_p = std::max(max_p, ep), max_f = std::max(max_f, ef);
+            sum_p += ep, sum_f += ef, ++counted;
+            closer += ef < ep, farther += ef > ep;
+        }
+
+        // 速度: 1 点ずつの forward と 8 レーンのパック評価
+        std::vector<double> out(kSamples);
+        int reps = std::max<int>(1, int((std::size_t{1} << 22) / (n * kSamples / 64)));
+        auto scalar = [&](const Tape& t) {
+            std::vector<double> v;
+            return measure_ms([&] {
+                for (std::size_t i = 0; i < kSamples; i += 64) {
+                    std::array<double, 1> in{xs[i]};
+                    t.forward(in, v);
+                }
+            });
+        };
+        auto batch = [&](const Tape& t) {
+            return measure_ms([&] { for (int r = 0; r < reps; ++r) evaluate_batch<double>(t, xs, out); }) / reps;
+        };
+        double sp = scalar(plain), sf = scalar(fused), bp = batch(plain), bf = batch(fused);
+        double per_eval = double(kSamples) / 64;
+        std::cout << std::format("n = {:>6}: 命令 {} -> {} (Fma {}), forward {:.1f} / {:.1f} ns/命令, "
+                                 "パック評価 {:.2f} / {:.2f} ms ({} 点)\n",
+                                 n, plain.code.size(), fused.code.size(), fmas,
+                                 sp * 1e6 / per_eval / plain.code.size(), sf * 1e6 / per_eval / fused.code.size(), bp, bf, kSamples);
+        std::cout << std::format("           相対誤差 最大 {:.2e} / {:.2e}, 平均 {:.2e} / {:.2e}, 融合が近い {} 点, 遠い {} 点 ({} 点中), "
+                                 "融合なしと木の一致 {}/{}\n",
+                                 max_p, max_f, sum_p / counted, sum_f / counted, closer, farther, counted, same_as_tree, kSamples);
+    }
+}
+
+// 導関数の族 f, f', f'', f''' とそれらの和・積 (計 20 式) を同じ x で評価する. 各式は別々に
+// 微分して作るので, 木どうしでノードは共有されない. 式ごとの evaluate(), 式ごとのテープと,
+// 値番号付けで共通部分式をまとめた 1 本のテープ (1 点ずつ / 8 レーンのパック) を比べる.
+// 木の evaluate() は共有された部分木も毎回たどるので, 高階の導関数ほど不利になる
+void bench_multi_output() {
+    auto d = [](int k) {
+        auto e = bench_tree(std::size_t{1} << 8);
+        for (int i = 0; i < k; ++i) e = e->derivative();
+        return e;
+    };
+    std::vector<std::shared_ptr<Expression>> family;
+    for (int k = 0; k < 4; ++k) family.push_back(d(k));
+    for (int j = 0; j < 4; ++j)
+        for (int k = j; k < 4; ++k) family.push_back(make_mul(d(j), d(k)));
+    for (int j = 0; j < 4; ++j)
+        for (int k = j + 1; k < 4; ++k) family.push_back(make_add(d(j), d(k)));
+    std::size_t nodes = 0;
+    for (auto& e : family) nodes += count_nodes(e.get());
+
+    Tape tape;
+    double tc = measure_ms([&] { tape = Tape::compile(family, {"x"}); });
+    std::vector<Tape> tapes;
+    std::size_t separate_instrs = 0;
+    for (auto& e : family) {
+        tapes.push_back(Tape::compile({e}, {"x"}));
+        separate_instrs += tapes.back().code.size();
+    }
+    constexpr std::size_t kPoints = 1024;
+    std::vector<double> xs(kPoints), sep(kPoints * family.size()), one(sep.size()), all(sep.size());
+    for (std::size_t i = 0; i < kPoints; ++i) xs[i] = 0.3 + 0.4 * double(i) / kPoints;
+
+    double ts = measure_ms([&] {
+        for (std::size_t i = 0; i < kPoints; ++i)
+            for (std::size_t k = 0; k < family.size(); ++k) sep[i * family.size() + k] = family[k]->evaluate(xs[i]);
+    });
+    double tt = measure_ms([&] {
+        std::vector<double> v;
+        for (std::size_t i = 0; i < kPoints; ++i) {
+            std::array<double, 1> in{xs[i]};
+            for (std::size_t k = 0; k < family.size(); ++k) {
+                tapes[k].forward(in, v);
+                one[i * family.size() + k] = v[tapes[k].outputs[0]];
+            }
+        }
+    });
+    bool same_tapes = std::ranges::equal(sep, one, [](double a, double b) { return a == b || std::abs(a - b) <= 1e-12 * std::max(1.0, std::abs(b)); });
+    double t1 = measure_ms([&] {
+        std::vector<double> v;
+        for (std::size_t i = 0; i < kPoints; ++i) {
+            std::array<double, 1> in{xs[i]};
+            tape.forward(in, v);
+            for (std::size_t k = 0; k < family.size(); ++k) one[i * family.size() + k] = v[tape.outputs[k]];
+        }
+    });
+    double tb = measure_ms([&] { evaluate_batch_all<double>(tape, xs, all); });
+    auto close = [](double a, double b) { return a == b || std::abs(a - b) <= 1e-12 * std::max(1.0, std::abs(b)); };
+    std::cout << std::format("{} 式, 木 {} ノード -> 式ごとのテープ計 {} 命令 / 1 本のテープ {} 命令 (コンパイル {:.1f} ms), {} 点\n",
+                             family.size(), nodes, separate_instrs, tape.code.size(), tc, kPoints);
+    std::cout << std::format("式ごとの evaluate {:.1f} ms, 式ごとのテープ {:.2f} ms, 1 本のテープ {:.2f} ms, パック評価 {:.2f} ms, 値の一致 {} / {} / {}\n",
+                             ts, tt, t1, tb, same_tapes, std::ranges::equal(sep, one, close), std::ranges::equal(sep, all, close));
+}
+
+// 64 個の式 (bench_tree(256) を種違いで) を, 式ごとの呼び出し回数に偏りのある順序で評価したときの
+// 全体の時間. 木の evaluate だけ, 全てを先にテープ化, 全てを先にネイティブ化 (1 つの翻訳単位で
+// コンパイラを 1 回起動), 段階的な実行を比べる. 時間は翻訳も含む
+void bench_tiered() {
+    constexpr std::size_t kExprs = 64;
+    std::vector<std::shared_ptr<Expression>> exprs;
+    for (std::size_t i = 0; i < kExprs; ++i) exprs.push_back(bench_tree(256, i * 7 + 1));
+
+    auto run = [&](const char* name, const std::vector<std::uint64_t>& counts) {
+        std::vector<std::uint32_t> order;
+        for (std::uint32_t i = 0; i < kExprs; ++i) order.insert(order.end(), counts[i], i);
+        std::shuffle(order.begin(), order.end(), std::mt19937(42));
+        auto x_of = [](std::size_t k) { return 0.3 + double(k % 1000) * 1e-4; };
+
+        double tree_sum = 0, tape_sum = 0, native_sum = 0, tiered_sum = 0;
+        double t_tree = measure_ms([&] {
+            for (std::size_t k = 0; k < order.size(); ++k) tree_sum += exprs[order[k]]->evaluate(x_of(k));
+        });
+        double t_tape = measure_ms([&] {
+            std::vector<Tape> tapes;
+            for (auto& e : exprs) tapes.push_back(Tape::compile({e}));
+            std::vector<double> in, v;
+            for (std::size_t k = 0; k < order.size(); ++k) {
+                const Tape& t = tapes[order[k]];
+                in.assign(t.variables.size(), x_of(k));
+                t.forward(in, v);
+                tape_sum += v[t.outputs[0]];
+            }
+        });
+        double t_native = measure_ms([&] {
+            std::string src(codegen_detail::kPrelude);
+            std::vector<std::size_t> inputs;
+            for (std::size_t i = 0; i < kExprs; ++i) {
+                auto t = Tape::compile({exprs[i]});
+                inputs.push_back(t.variables.size());
+                src += emit_c_function(t, std::format("f{}", i));
+            }
+            auto m = NativeModule::compile(src);
+            std::vector<NativeFn> fns;
+            for (std::size_t i = 0; i < kExprs; ++i) fns.push_back(m->function(std::format("f{}", i)));
+            std::vector<double> in;
+            for (std::size_t k = 0; k < order.size(); ++k) {
+                in.assign(inputs[order[k]], x_of(k));
+                double out;
+                fns[order[k]](in.data(), &out);
+                native_sum += out;
+            }
+        });
+        std::array<std::size_t, 3> tiers{};
+        double t_tiered = measure_ms([&] {
+            std::vector<TieredFunction> fs;
+            for (auto& e : exprs) fs.emplace_back(e);
+            for (std::size_t k = 0; k < order.size(); ++k) tiered_sum += fs[order[k]](x_of(k));
+            for (auto& f : fs) ++tiers[static_cast<std::size_t>(f.tier())];
+        });
+        BackgroundCompiler::shared().drain();  // 次の計測に残りの翻訳を持ち越さない
+        std::cout << std::format("{} ({} 回, 最多 {} 回): 木 {:.1f} ms, 先にテープ {:.1f} ms, 先にネイティブ {:.1f} ms, "
+                                 "段階的 {:.1f} ms (終了時 木 {} / テープ {} / ネイティブ {}), 値の一致 {}\n",
+                                 name, order.size(), counts[0], t_tree, t_tape, t_native, t_tiered, tiers[0], tiers[1], tiers[2],
+                                 tree_sum == tape_sum && tree_sum == native_sum && tree_sum == tiered_sum);
+    };
+
+    // Zipf 分布: i 番目の式を 1 / (i + 1) に比例する回数呼ぶ
+    constexpr double kTotal = 1 << 22;
+    double h = 0;
+    for (std::size_t i = 0; i < kExprs; ++i) h += 1.0 / double(i + 1);
+    std::vector<std::uint64_t> zipf, few(kExprs, 8);
+    for (std::size_t i = 0; i < kExprs; ++i) zipf.push_back(static_cast<std::uint64_t>(kTotal / (double(i + 1) * h)));
+    run("偏りあり", zipf);
+    run("各 8 回", few);
+}
+
+// 大きな導関数のテープで, スロットをそのまま使う評価と, レジスタ割り付け (命令順そのまま /
+// schedule() で並べ替えた後) の作業領域と速度を比べる. パック評価は 8 レーン (1 値 64 バイト)
+void bench_register_tape() {
+    for (std::size_t n : {std::size_t{1} << 16, std::size_t{1} << 20}) {
+        auto df = bench_tree_distinct(n)->derivative();
+        auto tape = Tape::compile({df});
+        RegisterTape plain, scheduled;
+        double ta = measure_ms([&] { plain = RegisterTape::allocate(tape); });
+        double tsched = measure_ms([&] { scheduled = RegisterTape::allocate(tape.schedule()); });
+
+        std::vector<double> xs(64);
+        for (std::size_t i = 0; i < xs.size(); ++i) xs[i] = 0.3 + 0.4 * double(i) / double(xs.size());
+        std::vector<double> ref(xs.size()), out(xs.size());
+        auto scalar = [&](const auto& t) {
+            std::vector<double> v;
+            return measure_ms([&] {
+                for (std::size_t i = 0; i < xs.size(); ++i) {
+                    std::array<double, 1> in{xs[i]};
+                    t.forward(in, v);
+                    out[i] = v[t.outputs[0]];
+                }
+            }) / double(xs.size());
+        };
+        double s0 = scalar(tape);
+        ref = out;
+        double s1 = scalar(plain);
+        bool same = out == ref;
+        double s2 = scalar(scheduled);
+        same = same && out == ref;
+        int reps = std::max<int>(1, int((std::size_t{1} << 24) / (tape.code.size() * xs.size())));
+        auto batch = [&](const auto& t) {
+            return measure_ms([&] { for (int r = 0; r < reps; ++r) evaluate_batch<double>(t, xs, out); }) / reps;
+        };
+        double b0 = batch(tape), b1 = batch(plain), b2 = batch(scheduled);
+        same = same && out == ref;
+
+        auto mb = [](std::size_t values, std::size_t bytes) { return double(values * bytes) / (1 << 20); };
+        std::cout << std::format("n = {:>7}: {} 命令, 作業領域 {} 値 -> 割り付け {} 値 ({:.2f} ms) / 並べ替え後 {} 値 ({:.2f} ms)\n",
+                                 n, tape.code.size(), tape.code.size(), plain.registers, ta, scheduled.registers, tsched);
+        std::cout << std::format("           1 点 {:.2f} / {:.2f} / {:.2f} ms (作業領域 {:.2f} / {:.3f} / {:.3f} MB), "
+                                 "パック {:.2f} / {:.2f} / {:.2f} ms ({:.1f} / {:.3f} / {:.3f} MB), 値の一致 {}\n",
+                                 s0, s1, s2, mb(tape.code.size(), 8), mb(plain.registers, 8), mb(scheduled.registers, 8),
+                                 b0, b1, b2, mb(tape.code.size(), 64), mb(plain.registers, 64), mb(scheduled.registers, 64), same);
+    }
+}
+
+// 勾配 (変数 1024 個) を, 全スロットを持つ Tape::adjoint と, 作業領域の上限を変えた
+// checkpointed_gradient で求める. 共有のない木 (レジスタが少ない) と, その導関数 (部分木の共有で
+// 生きている値が多い) の 2 通り. bench_tree_distinct の形のままでは値が溢れて勾配が inf / NaN になるので,
+// 和を平均 0.5 * (l + r) に変え, 葉を (0, 1) に置いて値を (0, 1) に保つ.
+// RegisterTape は命令を並べ替えるので, 随伴の和の順序が変わり丸めだけ違いうる
+void bench_checkpointed_gradient() {
+    constexpr std::size_t n = std::size_t{1} << 20;
+    auto averaged_tree = [](auto&& self, std::size_t n, std::size_t seed) -> std::shared_ptr<Expression> {
+        if (n == 1) {
+            if (seed % 2 == 0) return C(0.5 + double(seed) * 1e-7);
+            return V(std::format("x{}", seed / 2 % 1024));
+        }
+        auto l = self(self, n / 2, seed * 2 + 1);
+        auto r = self(self, n - n / 2, seed * 2 + 2);
+        if (seed % 3 == 0) return make_mul(l, r);
+        return make_mul(C(0.5), make_add(l, r));
+    };
+    auto f = averaged_tree(averaged_tree, n, 0);
+    for (auto& [name, e] : {std::pair{"木", f}, std::pair{"導関数", f->derivative()}}) {
+        auto tape = Tape::compile({e});
+        auto rt = RegisterTape::allocate(tape);
+        std::vector<double> x(tape.variables.size());
+        for (std::size_t i = 0; i < x.size(); ++i) x[i] = 0.5 + double(i) / double(4 * x.size());
+        std::array<double, 1> seed{1.0};
+
+        std::vector<double> v, grad;
+        double t_full = measure_ms([&] {
+            tape.forward(x, v);
+            tape.adjoint(seed, v, grad);
+        });
+        std::size_t full_bytes = 2 * tape.code.size() * sizeof(double);
+        std::cout << std::format("{}: {} 命令, {} レジスタ, 全スロット {:.1f} MB / {:.1f} ms\n",
+                                 name, tape.code.size(), rt.registers, full_bytes / 1e6, t_full);
+        for (std::size_t div : {1, 2, 4, 16, 64, 256}) {
+            std::size_t cap = full_bytes / div;
+            try {
+                CheckpointedGradient g;
+                double t = measure_ms([&] { g = checkpointed_gradient(rt, x, seed, cap); });
+                double err = 0;
+                for (std::size_t i = 0; i < grad.size(); ++i)
+                    if (!(g.gradient[i] == grad[i]))
+                        err = std::max(err, std::abs(g.gradient[i] - grad[i]) / std::abs(grad[i]));
+                std::cout << std::format("  上限 {:>8.3f} MB: 使用 {:.3f} MB, {} 段 (区間 {}), 前進 {:.2f} 回分, {:.1f} ms, 相対誤差 {:.2e}\n",
+                                         cap / 1e6, g.peak_bytes / 1e6, g.levels, g.leaf,
+                                         double(g.forward_instructions) / double(tape.code.size()), t, err);
+            } catch (const std::runtime_error& err) {
+                std::cout << std::format("  上限 {:>8.3f} MB: {}\n", cap / 1e6, err.what());
+            }
+        }
+    }
+}
+
+void run_benchmarks() {
+    bench_derivative_alloc();
+    bench_nary();
+    bench_polynomial();
+    bench_pow();
+    bench_simplify_memo();
+    bench_fixpoint();
+    bench_rewrite_rules();
+    bench_factoring();
+    bench_cost_model();
+    bench_rebalance();
+    bench_jacobian_hessian();
+    bench_incremental();
+    bench_intern();
+    bench_scalar_types();
+    bench_interval();
+    bench_compile_time();
+    bench_streaming();
+    bench_disk_cache();
+    bench_soa_store();
+    bench_lazy_derivative();
+    bench_fma();
+    bench_multi_output();
+    bench_tiered();
+    bench_register_tape();
+    bench_checkpointed_gradient();
+}
+
+//-------------------------------------------------
+// 28. メイン (実行例)
+//-------------------------------------------------
+// 実行例の結果の検査. 食い違えば内容を出して異常終了する (NDEBUG でも外れない)
+void check(bool ok, std::string_view what) {
+    if (ok) return;
+    std::cerr << "検査失敗: " << what << "\n";
+    std::abort();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string(argv[1]) == "bench") {
+        run_benchmarks();
+        return 0;
+    }
+    if (argc > 2 && std::string(argv[1]) == "stream") {
+        bench_streaming(std::stoul(argv[2]));
+        return 0;
+    }
+
+    // f(x) = x + 2x
+    // (x + (2 * x))
+    auto f1 = make_add(V(), make_mul(C(2), V())); // ★ make_add, make_mul
+
+    std::cout << "--- パターン1: (x + 2x) をそのまま微分 -> 簡約化 ---\n";
+    std::cout << "f(x) = " << f1->to_string() << "\n";
+
+    auto df1 = f1->derivative();
+    std::cout << "f'(x) (微分直後) = " << df1->to_string() << "\n";
+
+    auto df1_simplified = df1->simplify();
+    std::cout << "f'(x) (簡約後)   = " << df1_simplified->to_string() << "\n";
+    
+    std::cout << "\n--- パターン2: (x + 2x) を先に簡約化 -> 微分 ---\n";
+    std::cout << "f(x) = " << f1->to_string() << "\n";
+
+    auto f1_simplified = f1->simplify();
+    std::cout << "f(x) (簡約後) = " << f1_simplified->to_string() << "\n";
+    
+    auto df1_pre_simplified = f1_simplified->derivative();
+    std::cout << "f'(x) (微分)    = " << df1_pre_simplified->to_string() << "\n";
+    
+    auto df1_final = df1_pre_simplified->simplify();
+    std::cout << "f'(x) (最終簡約) = " << df1_final->to_string() << "\n";
+
+    std::cout << "\n--- 別の例 (g(x) = x*x) ---\n";
+    // g(x) = x * x
+    auto g = make_mul(V(), V()); // ★ make_mul
+    std::cout << "g(x) = " << g->to_string() << "\n";
+    
+    auto dg = g->derivative();
+    std::cout << "g'(x) (微分直後) = " << dg->to_string() << "\n";
+    
+    auto dg_simplified = dg->simplify();
+    std::cout << "g'(x) (簡約後)   = " << dg_simplified->to_string() << "\n";
+    
+    std::cout << "g'(x) at x=5 (評価): " << dg_simplified->evaluate(5) << "\n";
+
+    std::cout << "\n--- n 項の和・積 (h(x) = 1x + 2x + 3x + 4, p(x) = 2 * x * x * x) ---\n";
+    auto h = flatten(make_add(make_add(make_add(make_mul(C(1), V()), make_mul(C(2), V())), make_mul(C(3), V())), C(4)));
+    std::cout << "h(x) = " << h->to_string() << "\n";
+    std::cout << "h(x) (簡約後) = " << h->simplify()->to_string() << "\n";
+    auto p = make_product({C(2), V(), V(), V()});
+    std::cout << "p(x) = " << p->to_string() << "\n";
+    std::cout << "p'(x) = " << p->derivative()->to_string() << "\n";
+    std::cout << "p'(x) at x=2 (評価): " << p->derivative()->evaluate(2) << "\n";
+
+    std::cout << "\n--- べき乗 (r(x) = x * x * x^3) ---\n";
+    auto r = make_mul(make_mul(V(), V()), make_pow(V(), 3));
+    std::cout << "r(x) = " << r->to_string() << "\n";
+    std::cout << "r(x) (簡約後) = " << r->simplify()->to_string() << "\n";
+    std::cout << "r'(x) = " << r->simplify()->derivative()->simplify()->to_string() << "\n";
+    {
+        auto d0 = make_pow(V(), 0)->derivative();
+        check(d0->evaluate(0) == 0, "Pow::derivative: (x^0)' = 0 at x = 0");
+        check(Tape::compile({d0}, {"x"}).evaluate(std::array{0.0})[0] == 0, "Pow::derivative: テープでも (x^0)' = 0 at x = 0");
+    }
+    // 指数をまとめると値が変わる式 (元の式が未定義の点) はそのまま残す
+    using Case = std::pair<std::shared_ptr<Expression>, double>;
+    for (auto& [e, x] : {Case{make_mul(make_pow(V(), 0.5), make_pow(V(), 0.5)), -1.0},
+                         Case{make_mul(make_pow(V(), -1), V()), 0.0},
+                         Case{make_product({make_pow(V(), -1), V()}), 0.0},
+                         Case{make_pow(make_pow(V(), 0.5), 2), -1.0}}) {
+        check(std::isnan(e->simplify()->evaluate(x)), std::format("simplify: {} は x = {} で NaN のまま", e->to_string(), x));
+    }
+
+    std::cout << "\n--- 不動点までの簡約 (s(x) = (2x + -1x) * (3x + -3x) + x) ---\n";
+    auto sx = make_add(make_mul(make_add(make_mul(C(2), V()), make_mul(C(-1), V())),
+                                make_add(make_mul(C(3), V()), make_mul(C(-3), V()))), V());
+    std::cout << "s(x) = " << sx->to_string() << "\n";
+    std::cout << "s(x) (simplify 1 回) = " << sx->simplify()->to_string() << "\n";
+    std::cout << "s(x) (不動点)        = " << simplify_fixpoint(sx)->to_string() << "\n";
+
+    std::cout << "\n--- 書き換え規則 DSL ---\n";
+    RuleSet rules{"(c1 * ?a) + (c2 * ?a) -> (c1 + c2) * ?a", "?a * 1 -> ?a", "?a * ?a -> ?a ^ 2"};
+    auto u = make_add(make_mul(C(2), make_mul(V(), V())), make_mul(C(5), make_mul(V(), make_mul(V(), C(1)))));
+    std::cout << "u(x) = " << u->to_string() << "\n";
+    std::cout << "u(x) (規則適用) = " << rules.rewrite_bottom_up(u)->to_string() << "\n";
+    std::cout << "u(x) (組み込み規則) = " << builtin_rules().rewrite_bottom_up(u->derivative())->to_string() << "\n";
+    check(structurally_equal(rules.rewrite_bottom_up(u).get(), make_mul(C(7), make_pow(V(), 2)).get()), "RuleSet: u(x) = 7 * x^2");
+    check(structurally_equal(builtin_rules().rewrite_bottom_up(u->derivative()).get(), make_mul(C(14), V()).get()),
+          "RuleSet: 組み込み規則で u'(x) = 14 * x");
+    {
+        // 同じ名前の ?a は構造的に等しい部分木にだけ一致する (別のノードでもよい)
+        RuleSet twice{"?a + ?a -> 2 * ?a"};
+        auto x3 = [] { return make_mul(V(), C(3)); };
+        std::array<std::shared_ptr<Expression>, 3> sums{make_add(V(), V()), make_add(x3(), x3()),
+                                                         make_add(x3(), make_mul(V(), C(4)))};
+        for (auto& e : sums) {
+            auto r = twice.rewrite(e.get()), lr = twice.rewrite_linear(e.get());
+            auto& kid = static_cast<const Add*>(e.get())->left;
+            bool same = structurally_equal(kid.get(), static_cast<const Add*>(e.get())->right.get());
+            check(same ? r && lr && structurally_equal(r.get(), make_mul(C(2), kid).get()) && structurally_equal(r.get(), lr.get())
+                       : !r && !lr,
+                  "RuleSet: ?a + ?a と " + e->to_string());
+        }
+        check(!twice.rewrite(make_add(V(), V("y")).get()), "RuleSet: ?a + ?a は x + y に一致しない");
+        for (auto src : {"?a + -> ?a", "?a ^ x -> ?a", "(?a * 1 -> ?a", "?a * 1 ?a", "?a * 1 -> ?b", "?a -> c1 * ?a",
+                         "?a * 1.2.3 -> ?a * 7", "?a * -. -> ?a"}) {
+            bool threw = false;
+            try {
+                RuleSet{src};
+            } catch (const std::runtime_error&) {
+                threw = true;
+            }
+            check(threw, std::format("RuleSet: 不正な規則 \"{}\" は例外", src));
+        }
+    }
+
+    std::cout << "\n--- 共通因数のくくり出し (v = 3x^2 y + 2x y^2 + x y + x) ---\n";
+    auto vy = make_sum({make_product({make_pow(V(), 2), V("y")}, 3), make_product({V(), make_pow(V("y"), 2)}, 2),
+                        make_product({V(), V("y")}), V()});
+    auto vf = factor_common(vy);
+    std::cout << std::format("v = {} (乗算 {})\n", vy->to_string(), count_ops(vy.get()).mul);
+    std::cout << std::format("v (くくり出し後) = {} (乗算 {})\n", vf->to_string(), count_ops(vf.get()).mul);
+    check(count_ops(vf.get()).mul < count_ops(vy.get()).mul, "factor_common: 乗算が減る");
+    for (double e : {1e300, std::numeric_limits<double>::infinity(), std::numeric_limits<double>::quiet_NaN()})
+        check(count_ops(make_pow(V(), e).get()).mul == 1, std::format("count_ops: x^{} は乗算 1", e));
+    {
+        auto tv = Tape::compile({vy, vf}, {"x", "y"});
+        for (auto xy : {std::array{2.0, 3.0}, std::array{-1.5, 0.25}, std::array{0.7, -4.0}}) {
+            auto r = tv.evaluate(xy);
+            check(std::abs(r[0] - r[1]) <= 1e-12 * std::max(1.0, std::abs(r[0])),
+                  std::format("factor_common: 値が変わらない at ({}, {})", xy[0], xy[1]));
+        }
+    }
+
+    // 被演算子 13 個 (分岐数 8 より多い) の左に偏った鎖
+    std::cout << "\n--- 鎖の平衡化 (w = (((x + 1) + 2x) + ... + 11x) + 12) ---\n";
+    std::shared_ptr<Expression> w = make_add(V(), C(1));
+    for (int i = 2; i <= 11; ++i) w = make_add(w, make_mul(C(i), V()));
+    w = make_add(w, C(12));
+    auto wb = rebalance(w);
+    std::cout << "w = " << w->to_string() << "\n";
+    std::cout << "w (順序保存) = " << rebalance(w, FloatOrder::Preserve)->to_string() << "\n";
+    std::cout << "w (平衡) = " << wb->to_string() << "\n";
+    std::cout << std::format("深さ: 鎖 {}, 平衡 {}\n", tree_depth(w.get()), tree_depth(wb.get()));
+    check(tree_depth(wb.get()) < tree_depth(w.get()), "rebalance: 深さが減る");
+    for (double x : {2.0, 0.3, -1.7})
+        check(std::abs(wb->evaluate(x) - w->evaluate(x)) <= 1e-12 * std::max(1.0, std::abs(w->evaluate(x))),
+              std::format("rebalance: 値が変わらない at x = {}", x));
+
+    std::cout << "\n--- ヤコビ行列・ヘッセ行列 (F = (x^2 y, y z + x), f = x^2 y + y z) ---\n";
+    auto jf = SparseJacobian({make_mul(make_pow(V(), 2), V("y")), make_add(make_mul(V("y"), V("z")), V())});
+    std::vector<double> at{1, 2, 3};
+    auto J = jf.evaluate(at);
+    std::cout << std::format("ヤコビ行列 (非零 {}, 掃引 {}) at (1, 2, 3):\n", J.nonzeros(), jf.color_count);
+    for (std::size_t i = 0; i < J.rows; ++i)
+        for (std::size_t k = J.row_ptr[i]; k < J.row_ptr[i + 1]; ++k)
+            std::cout << std::format("  dF{}/d{} = {}\n", i, jf.tape.variables[J.col_idx[k]], J.values[k]);
+    auto hf = SparseHessian(make_add(make_mul(make_pow(V(), 2), V("y")), make_mul(V("y"), V("z"))));
+    auto H = hf.evaluate(at);
+    std::cout << std::format("ヘッセ行列 (非零 {}, 掃引 {}) at (1, 2, 3):\n", H.nonzeros(), hf.color_count);
+    for (std::size_t i = 0; i < H.rows; ++i)
+        for (std::size_t k = H.row_ptr[i]; k < H.row_ptr[i + 1]; ++k)
+            std::cout << std::format("  d2f/d{}d{} = {}\n", hf.tape.variables[i], hf.tape.variables[H.col_idx[k]], H.values[k]);
+    // 密な中心差分と全要素で比べる (パターンの外は 0). ヘッセ行列は逆モードの勾配の差分
+    {
+        constexpr double h = 1e-5;
+        auto near = [](double a, double b) { return std::abs(a - b) <= 1e-6 * std::max(1.0, std::abs(b)); };
+        auto gradient = [&](const std::vector<double>& x) {
+            std::vector<double> v, g;
+            std::array<double, 1> seed{1.0};
+            hf.tape.forward(x, v);
+            hf.tape.adjoint(seed, v, g);
+            return g;
+        };
+        for (std::size_t j = 0; j < at.size(); ++j) {
+            auto lo = at, hi = at;
+            lo[j] -= h;
+            hi[j] += h;
+            auto fl = jf.tape.evaluate(lo), fh = jf.tape.evaluate(hi);
+            for (std::size_t i = 0; i < J.rows; ++i)
+                check(near(J.at(i, j), (fh[i] - fl[i]) / (2 * h)), std::format("SparseJacobian ({}, {})", i, j));
+            auto gl = gradient(lo), gh = gradient(hi);
+            for (std::size_t i = 0; i < H.rows; ++i)
+                check(near(H.at(i, j), (gh[i] - gl[i]) / (2 * h)), std::format("SparseHessian ({}, {})", i, j));
+        }
+    }
+    check(evaluate_at(partial_derivative(make_pow(V("y"), 0), "y").get(), {{"y", 0.0}}) == 0,
+          "partial_derivative: d(y^0)/dy = 0 at y = 0");
+    // 和の定数 0 は項が -0 のとき値を変える (0 + -0 = +0). テープも木と同じビット列を返す
+    {
+        auto sum = std::shared_ptr<Expression>(new Sum(0, {make_product({V(), V()}, -1)}));
+        auto tape = Tape::compile({sum, sum->derivative()});
+        for (double x : {0.0, -0.0}) {
+            std::array<double, 1> in{x};
+            auto y = tape.evaluate(in);
+            check(std::bit_cast<std::uint64_t>(y[0]) == std::bit_cast<std::uint64_t>(sum->evaluate(x)) &&
+                      std::bit_cast<std::uint64_t>(y[1]) == std::bit_cast<std::uint64_t>(sum->derivative()->evaluate(x)),
+                  std::format("Tape: 0 + -x * x の 0 の符号 at x = {}", x));
+        }
+    }
+
+    std::cout << "\n--- 差分による再評価 (F = (x y + z, z^2)) ---\n";
+    IncrementalEvaluator inc(Tape::compile({make_add(make_mul(V(), V("y")), V("z")), make_pow(V("z"), 2)}), std::vector<double>{1, 2, 3});
+    std::cout << std::format("(x, y, z) = (1, 2, 3): F = ({}, {})\n", inc.output(0), inc.output(1));
+    inc.set(0, 5);
+    auto fo = inc.update();
+    std::cout << std::format("x = 5 に変更: F = ({}, {}) (計算し直した命令 {} / {})\n", fo[0], fo[1], inc.recomputed, inc.tape.code.size());
+    check(fo == inc.tape.evaluate(inc.inputs), "IncrementalEvaluator: 全体の再評価と一致");
+    // +0.0 -> -0.0 の変更も伝播する (1 / x が +inf から -inf に変わる)
+    {
+        IncrementalEvaluator r(Tape::compile({make_pow(V(), -1)}), std::vector<double>{0.0});
+        r.set(0, -0.0);
+        check(r.update()[0] == -INFINITY, "IncrementalEvaluator: -0.0 の伝播");
+    }
+
+    std::cout << "\n--- 並行ハッシュコンス表 (2 スレッドで (x + 1) * (x + 1) を組み立てる) ---\n";
+    {
+        std::array<std::shared_ptr<Expression>, 2> built;
+        std::vector<std::thread> pool;
+        for (auto& b : built)
+            pool.emplace_back([&b] { b = shared_interner().intern(make_mul(make_add(V(), C(1)), make_add(V(), C(1)))); });
+        for (auto& th : pool) th.join();
+        auto m = as<Multiply>(built[0].get());
+        std::cout << std::format("{}: スレッド間で同一ノード {}, 左右の部分木も同一 {}\n",
+                                 built[0]->to_string(), built[0] == built[1], m->left == m->right);
+        check(built[0] == built[1] && m->left == m->right, "InternTable: 同値なノードの共有");
+
+        // 4 スレッドが同じ 64 個の式を別々の順で登録しても, 各式は同一ノードになり元の式と構造が等しい
+        constexpr std::size_t kExprs = 64, kThreads = 4;
+        auto tree = [](std::size_t i) {
+            return make_mul(make_add(V(), C(double(i % 8))), make_pow(make_add(V("y"), C(double(i / 8))), 2));
+        };
+        std::vector<std::vector<std::shared_ptr<Expression>>> got(kThreads, std::vector<std::shared_ptr<Expression>>(kExprs));
+        pool.clear();
+        for (std::size_t t = 0; t < kThreads; ++t)
+            pool.emplace_back([&, t] {
+                for (std::size_t k = 0; k < kExprs; ++k) {
+                    std::size_t i = (k * (2 * t + 1) + t) % kExprs;
+                    got[t][i] = shared_interner().intern(tree(i));
+                }
+            });
+        for (auto& th : pool) th.join();
+        for (std::size_t i = 0; i < kExprs; ++i) {
+            check(structurally_equal(got[0][i].get(), tree(i).get()), std::format("InternTable: 式 {} の構造", i));
+            for (std::size_t t = 1; t < kThreads; ++t)
+                check(got[t][i] == got[0][i], std::format("InternTable: 式 {} がスレッド間で別ノード", i));
+        }
+    }
+
+    std::cout << "\n--- スカラー型に依らない評価 (g(x) = (x + 1)^3 * x) ---\n";
+    auto gs = make_mul(make_pow(make_add(V(), C(1)), 3), V());
+    std::cout << std::format("float: {}, double: {}, long double: {}\n", evaluate_as(gs.get(), 0.1f), evaluate_as(gs.get(), 0.1),
+                             static_cast<double>(evaluate_as(gs.get(), 0.1L)));
+    auto gd = evaluate_as(gs.get(), Dual<double>(0.1, 1));
+    std::cout << std::format("二重数: g(0.1) = {}, g'(0.1) = {} (記号微分 {})\n", gd.v, gd.d, gs->derivative()->evaluate(0.1));
+    auto gi = evaluate_as(gs.get(), Interval(-0.5, 0.5));
+    std::cout << std::format("区間: g([-0.5, 0.5]) ⊆ [{}, {}]\n", gi.lo, gi.hi);
+    Pack<double, 4> xs;
+    xs.lane = {0, 0.5, 1, 2};
+    auto gp = evaluate_as(gs.get(), xs);
+    std::cout << std::format("パック (x = 0, 0.5, 1, 2): {}, {}, {}, {}\n", gp.lane[0], gp.lane[1], gp.lane[2], gp.lane[3]);
+
+    std::cout << "\n--- 区間による値域の保証 (k(x) = x^2 - 2x on [0, 3]) ---\n";
+    auto kx = make_add(make_pow(V(), 2), make_mul(C(-2), V()));
+    auto kdx = kx->derivative()->simplify();
+    auto kr = evaluate_as(kx.get(), Interval(0, 3));
+    auto kd = evaluate_as(kdx.get(), Interval(0, 3));
+    std::cout << std::format("k([0, 3]) ⊆ [{}, {}], k'([0, 3]) ⊆ [{}, {}]\n", kr.lo, kr.hi, kd.lo, kd.hi);
+    auto km = minimize_interval(kx, Interval(0, 3));
+    std::cout << std::format("min k ∈ [{:.12g}, {:.12g}] at x = {:.9g} (区間 {}, 枝刈り {})\n",
+                             km.value.lo, km.value.hi, km.argmin, km.boxes, km.pruned);
+    // 区間の像は部分区間の中の点での値を必ず含み, 最小値の区間は真の最小値 k(1) = -1 を含む
+    {
+        auto jx = make_add(make_pow(make_add(V(), C(1)), -1), make_mul(C(0.1), make_pow(V(), 2.5)));
+        for (auto& e : std::array<std::shared_ptr<Expression>, 3>{kx, kdx, jx})
+            for (int piece = 0; piece < 7; ++piece) {
+                Interval box(piece * 3.0 / 7, (piece + 1) * 3.0 / 7);
+                auto r = evaluate_as(e.get(), box);
+                for (int k = 0; k <= 100; ++k) {
+                    double x = box.lo + (box.hi - box.lo) * k / 100;
+                    check(r.contains(evaluate_as(e.get(), x)), std::format("Interval: {} at x = {}", e->to_string(), x));
+                }
+            }
+        check(km.value.contains(-1), "minimize_interval: 最小値を含む");
+
+        // 実数の指数の底が定義域の端 0 に触れても NaN にならない. 真の最小値は端点で f(1) = 1
+        auto rx = make_pow(make_add(V(), C(-1)), 0.5);
+        for (auto [e, box] : {std::pair{make_pow(make_add(V(), C(0)), 0.5), Interval(0, 1)}, std::pair{rx, Interval(1, 2)}}) {
+            auto r = evaluate_as(e.get(), box);
+            for (int k = 0; k <= 100; ++k) {
+                double x = box.lo + (box.hi - box.lo) * k / 100;
+                check(r.contains(evaluate_as(e.get(), x)), std::format("Interval: {} at x = {}", e->to_string(), x));
+            }
+        }
+        auto sm = minimize_interval(make_add(rx, V()), Interval(1, 2));
+        check(sm.value.contains(1), "minimize_interval: (x + -1)^0.5 + x on [1, 2] の最小値 1 を含む");
+    }
+
+    std::cout << "\n--- コンパイル時の式 (ct: f(x) = x * x + 3x) ---\n";
+    {
+        using namespace ct;
+        constexpr auto cf = x * x + c<3.0> * x;
+        constexpr auto cdf = derivative(cf);
+        static_assert(cf(2.0) == 10.0 && cdf(2.0) == 7.0);
+        static_assert(std::is_same_v<decltype(derivative(c<3.0> * x)), Const<3.0>>);
+        std::cout << "f(x) = " << to_runtime(cf)->to_string() << "\n";
+        std::cout << "f'(x) (コンパイル時に微分・簡約) = " << to_runtime(cdf)->to_string() << "\n";
+        std::cout << std::format("f'(2) = {} (実行時の木: {})\n", cdf(2.0), to_runtime(cf)->derivative()->evaluate(2.0));
+    }
+
+    std::cout << "\n--- 列ファイルの逐次評価 (q(x) と q'(x), x = 0, 1, 2, 3) ---\n";
+    {
+        auto in_path = (std::filesystem::temp_directory_path() / "expr_demo_in.bin").string();
+        auto out_path = (std::filesystem::temp_directory_path() / "expr_demo_out.bin").string();
+        {
+            auto in = MappedFile::create(in_path, 4 * sizeof(double));
+            std::ranges::copy(std::array{0.0, 1.0, 2.0, 3.0}, reinterpret_cast<double*>(in.data()));
+        }
+        auto qs = make_product({make_add(V(), C(1)), make_add(V(), C(2)), make_add(V(), C(3))});
+        auto st = stream_evaluate(Tape::compile({qs, qs->derivative()}), in_path, ColumnType::Float64, out_path);
+        auto out = MappedFile::open_read(out_path);
+        auto* r = reinterpret_cast<const double*>(out.data());
+        for (std::size_t i = 0; i < st.samples; ++i) std::cout << std::format("x = {}: q = {}, q' = {}\n", i, r[2 * i], r[2 * i + 1]);
+        std::filesystem::remove(in_path);
+        std::filesystem::remove(out_path);
+    }
+
+    std::cout << "\n--- ディスク上の結果キャッシュ (d/dx (x + 1)^3 * x) ---\n";
+    {
+        auto dir = std::filesystem::temp_directory_path() / "expr_demo_cache";
+        std::filesystem::remove_all(dir);
+        auto fx = [] { return make_mul(make_pow(make_add(V(), C(1)), 3), V()); };
+        for (int run = 1; run <= 2; ++run) {
+            DiskCache cache(dir);
+            auto d = cache.simplify(cache.derivative(fx()));
+            std::cout << std::format("{} 回目: {} (ヒット {}, ミス {})\n", run, d->to_string(), cache.hits, cache.misses);
+            check(structurally_equal(d.get(), fx()->derivative()->simplify().get()), "DiskCache: 計算し直した結果と一致");
+            check(run == 1 ? cache.misses == 2 : cache.hits == 2, "DiskCache: 2 回目はすべてヒット");
+        }
+        std::cout << std::format("構造ハッシュ {}, 二進形式 {} バイト\n", structural_hash(fx()).hex(), serialize(fx()).size());
+        // キャッシュの鍵はディスクに残るので, 標準ライブラリやビルドが変わっても同じ値になること
+        check(structural_hash(V()).hex() == "80d64e2e6202612ea7f253764c5cdaf6", "structural_hash: 変数名のハッシュが固定");
+
+        // 同じ子を何度も持つ式 (V() は 1 つしかない) も読み戻せて, 2 回目はキャッシュに当たる
+        std::array<std::shared_ptr<Expression>, 3> repeated{make_product({V(), V(), V()}), make_add(V(), V()),
+                                                            make_product({C(2), V(), V(), V()})};
+        for (auto& e : repeated) {
+            check(structurally_equal(deserialize(serialize(e)).get(), e.get()), "deserialize: " + e->to_string());
+            std::filesystem::remove_all(dir);
+            for (int run = 1; run <= 2; ++run) {
+                DiskCache cache(dir);
+                auto r = cache.cached("copy", e, [&] { return e; });
+                check(structurally_equal(r.get(), e.get()) && cache.hits == (run == 2 ? 1u : 0u),
+                      "DiskCache: 2 回目はヒット: " + e->to_string());
+            }
+        }
+        std::filesystem::remove_all(dir);
+    }
+
+    std::cout << "\n--- SoA 式ストア (f(x) = (x + 1)^3 * x) ---\n";
+    {
+        ExprStore store;
+        auto root = store.import(make_mul(make_pow(make_add(V(), C(1)), 3), V()));
+        auto d = store.simplify(store.derivative(root));
+        std::cout << std::format("ノード {} 個, {} バイト\n", store.size(), store.bytes());
+        std::cout << "f'(x) = " << store.to_expression(d)->to_string() << "\n";
+        std::cout << std::format("f'(2) = {}\n", store.evaluate(d, 2));
+        // f'(2) = 3 * 3^2 * 2 + 3^3 = 81. 微分の途中で作った死んだノードは評価しない
+        auto dc = store.cone(d);
+        std::cout << std::format("f' の根から届くノード {} / {} 個\n", dc.size(), std::size_t{d} + 1);
+        check(store.evaluate(d, 2) == 81 && store.evaluate(root, 2) == 54, "ExprStore::evaluate");
+        check(dc.size() < std::size_t{d} + 1, "ExprStore::cone: 死んだノードを含まない");
+        check(store.evaluate(store.derivative(store.import(make_pow(V(), 0))), 0) == 0, "ExprStore::derivative: (x^0)' = 0 at x = 0");
+        check(std::isnan(store.evaluate(store.simplify(store.import(make_mul(make_pow(V(), -1), V()))), 0)),
+              "ExprStore::simplify: x^-1 * x は x = 0 で NaN のまま");
+        // 和の定数 0 は項が -0 のとき値を変える (0 + -0 = +0)
+        auto sum = std::shared_ptr<Expression>(new Sum(0, {make_product({V(), V()}, -1)}));
+        check(std::bit_cast<std::uint64_t>(store.evaluate(store.import(sum), 0)) == std::bit_cast<std::uint64_t>(sum->evaluate(0)),
+              "ExprStore::import: 0 + -x * x at x = 0");
+    }
+
+    std::cout << "\n--- 遅延微分ノード (f(x) = (x + 1)^3 * x) ---\n";
+    {
+        auto f = make_mul(make_pow(make_add(V(), C(1)), 3), V());
+        auto lazy = make_derivative(f);
+        std::cout << "d/dx f = " << lazy->to_string() << "\n";
+        std::cout << "1 段展開 = " << lazy->expand()->to_string() << "\n";
+        std::cout << "簡約 = " << lazy->simplify()->to_string() << "\n";
+        std::cout << std::format("f'(2) = {} (前進モード, 展開なし), f''(2) = {} (展開した木: {}, {})\n",
+                                 lazy->evaluate(2), lazy->derivative()->evaluate(2),
+                                 f->derivative()->evaluate(2), f->derivative()->derivative()->evaluate(2));
+        // 遅延ノードを重ねた高階微分 (前進モードの段数の上限を超える 6 階まで) が, 展開した木の値と一致する
+        check(lazy->evaluate(2) == 81 && lazy->derivative()->evaluate(2) == 90, "Derivative: f'(2), f''(2)");
+        std::shared_ptr<Expression> nested = f, expanded = f;
+        for (int order = 1; order <= 6; ++order) {
+            nested = make_derivative(nested);
+            expanded = expanded->derivative();
+            for (double x : {-1.5, 0.3, 2.0}) {
+                double a = nested->evaluate(x), b = expanded->evaluate(x);
+                check(std::abs(a - b) <= 1e-12 * std::max(1.0, std::abs(b)), std::format("Derivative: {} 階 at x = {}", order, x));
+            }
+        }
+        check(make_derivative(make_pow(V(), 0))->expand()->evaluate(0) == 0, "Derivative::expand: (x^0)' = 0 at x = 0");
+        // テープとハッシュコンスは展開した木を扱い, 直列化と構造ハッシュは遅延ノードのまま扱う
+        auto nested_tape = Tape::compile({nested}, {"x"});
+        auto interned = shared_interner().intern(nested);
+        for (double x : {-1.5, 0.3, 2.0}) {
+            double b = expanded->evaluate(x);
+            for (double a : {nested_tape.evaluate(std::array{x})[0], interned->evaluate(x)})
+                check(std::abs(a - b) <= 1e-12 * std::max(1.0, std::abs(b)), std::format("Derivative: テープ, intern at x = {}", x));
+        }
+        auto back = deserialize(serialize(nested));
+        check(as<Derivative>(back.get()) && structural_hash(back) == structural_hash(nested), "Derivative: 直列化しても遅延ノードのまま");
+        auto dxx = count_ops(make_derivative(make_mul(V(), V())).get());
+        check(dxx.mul == 2 && dxx.add == 1, "count_ops: d/dx (x * x) は展開した 1 * x + x * 1 を数える");
+    }
+
+    std::cout << "\n--- 積和融合とコード生成 (q'(x), q(x) = (x + 1) * (x + 2) * (x + 3)) ---\n";
+    {
+        auto dq = make_mul(make_mul(make_add(V(), C(1)), make_add(V(), C(2))), make_add(V(), C(3)))->derivative();
+        auto plain = Tape::compile({dq}, {}, FmaMode::Off);
+        auto fused = Tape::compile({dq}, {}, FmaMode::Fuse);
+        std::array<double, 1> x{2.0};
+        std::cout << std::format("命令 {} -> {}, q'(2) = {} / {}\n", plain.code.size(), fused.code.size(),
+                                 plain.evaluate(x)[0], fused.evaluate(x)[0]);
+        std::cout << emit_c(fused, "dq");
+    }
+
+    std::cout << "\n--- 多出力テープ (f, f', f'' を別々に微分して作り, 1 回の走査で評価) ---\n";
+    {
+        auto f = [] { return make_mul(make_pow(make_add(V(), C(1)), 3), V()); };
+        std::vector<std::shared_ptr<Expression>> family{f(), f()->derivative(), f()->derivative()->derivative()};
+        std::size_t nodes = 0;
+        for (auto& e : family) nodes += count_nodes(e.get());
+        // 融合すると丸めが変わるので, ビルドに依らず Off を明示する
+        auto tape = Tape::compile(family, {"x"}, FmaMode::Off);
+        std::array<double, 5> xs{1.0, 2.0, 0.3, -1.7, 2.718281828459045};
+        std::array<double, 15> out;
+        evaluate_batch_all<double>(tape, xs, out);
+        std::cout << std::format("木 {} ノード -> {} 命令\n", nodes, tape.code.size());
+        for (std::size_t i = 0; i < 2; ++i)
+            std::cout << std::format("x = {}: f = {}, f' = {}, f'' = {}\n", xs[i], out[3 * i], out[3 * i + 1], out[3 * i + 2]);
+        // 部分式をまとめても各出力は木の評価とビット単位で同じ
+        for (std::size_t i = 0; i < xs.size(); ++i)
+            for (std::size_t k = 0; k < family.size(); ++k)
+                check(std::bit_cast<std::uint64_t>(out[3 * i + k]) == std::bit_cast<std::uint64_t>(family[k]->evaluate(xs[i])),
+                      std::format("多出力テープ: 出力 {} at x = {}", k, xs[i]));
+        // -0.0 と 0.0 は別の定数, 同じビット列の NaN は 1 つの定数
+        auto signs = Tape::compile({make_pow(make_add(V(), C(0.0)), -1), make_pow(make_add(V(), C(-0.0)), -1)});
+        auto inv = signs.evaluate(std::array{-0.0});
+        check(inv[0] == INFINITY && inv[1] == -INFINITY, "Tape::compile: -0.0 と 0.0 の定数");
+        auto nans = Tape::compile({make_add(V(), C(NAN)), make_mul(V(), C(NAN))});
+        check(std::ranges::count(nans.code, Op::Const, &Instr::op) == 1, "Tape::compile: NaN の定数");
+    }
+
+    std::cout << "\n--- 段階的な実行 (q(x) を呼ぶたびに木 -> テープ -> ネイティブ) ---\n";
+    {
+        auto q = make_mul(make_mul(make_add(V(), C(1)), make_add(V(), C(2))), make_add(V(), C(3)));
+        // テープは 9 命令なので, 4 回目の呼び出しでネイティブ化を始める
+        TieredFunction f(q, {.bytecode_after = 2, .native_work = 36});
+        constexpr const char* names[] = {"木", "テープ", "ネイティブ"};
+        for (int i = 1; i <= 6; ++i) {
+            double y = f(i);
+            std::cout << std::format("{} 回目: q({}) = {} ({})\n", i, i, y, names[static_cast<int>(f.tier())]);
+            BackgroundCompiler::shared().drain();  // 表示を決定的にするため翻訳の完了を待つ
+        }
+
+        // 同じ入力を木, テープ, ネイティブの各段で評価し, 結果のビット列が一致することを確かめる.
+        // 1 組目の最後の呼び出しでテープを, 2 組目の最後の呼び出しでネイティブ化を始めるように閾値を置く
+        auto e = make_mul(make_pow(make_add(V(), C(0.1)), 3), make_add(V(), C(1.0 / 3)))->derivative();
+        std::vector<double> xs;
+        for (int k = 0; k < 16; ++k) xs.push_back(-2.7 + 0.37 * k);
+        std::size_t size = Tape::compile({e}, {}, FmaMode::Off).code.size();
+        TieredFunction g(e, {.bytecode_after = xs.size(), .native_work = 2 * xs.size() * size});
+        std::vector<std::uint64_t> reference;
+        for (double x : xs) reference.push_back(std::bit_cast<std::uint64_t>(e->evaluate(x)));
+        for (Tier tier : {Tier::Tree, Tier::Bytecode, Tier::Native}) {
+            // C コンパイラが無ければネイティブの段には上がらない
+            if (g.tier() != tier) break;
+            for (std::size_t i = 0; i < xs.size(); ++i)
+                check(std::bit_cast<std::uint64_t>(g(xs[i])) == reference[i],
+                      std::format("TieredFunction: {}の段 at x = {}", names[static_cast<int>(tier)], xs[i]));
+            BackgroundCompiler::shared().drain();
+        }
+        std::cout << std::format("各段の値のビット列が一致 ({} 点, 最後の段: {})\n", xs.size(), names[static_cast<int>(g.tier())]);
+
+        // テープが扱えないノード (利用者が足した種類) を含む式は, テープ化に失敗しても木の段で評価を続ける
+        struct Abs : Expression {
+            double evaluate(double x) const override { return std::abs(x); }
+            std::shared_ptr<Expression> derivative() const override { throw std::runtime_error("Abs: 微分しない"); }
+            std::shared_ptr<Expression> simplify_uncached() const override { return self(); }
+            std::string to_string() const override { return "|x|"; }
+        };
+        auto opaque = make_add(std::make_shared<Abs>(), C(1));
+        TieredFunction h(opaque, {.bytecode_after = 2, .native_work = 1});
+        for (int i = 1; i <= 4; ++i) {
+            check(h(-i) == i + 1, std::format("TieredFunction: |x| + 1 at x = {}", -i));
+            BackgroundCompiler::shared().drain();
+        }
+        check(h.tier() == Tier::Tree, "TieredFunction: テープにできない式は木の段に留まる");
+    }
+
+    std::cout << "\n--- レジスタ割り付けしたテープ (q'(x)) ---\n";
+    {
+        auto dq = make_mul(make_mul(make_add(V(), C(1)), make_add(V(), C(2))), make_add(V(), C(3)))->derivative();
+        auto tape = Tape::compile({dq});
+        auto plain = RegisterTape::allocate(tape);
+        auto scheduled = RegisterTape::allocate(tape.schedule());
+        std::array<double, 1> x{2.0};
+        std::cout << std::format("{} スロット -> {} レジスタ (並べ替え後 {}), q'(2) = {} / {} / {}\n",
+                                 tape.code.size(), plain.registers, scheduled.registers,
+                                 tape.evaluate(x)[0], plain.evaluate(x)[0], scheduled.evaluate(x)[0]);
+
+        // 多出力・多変数で部分式の共有が多い族でも, レジスタを使い回したテープは Tape とビット単位で同じ値を返す.
+        // パック評価 (8 レーン) も確かめる
+        auto g = make_add(make_mul(make_pow(make_add(V(), V("y")), 3), V("y")), make_mul(V(), make_pow(V("y"), -2)));
+        auto family = Tape::compile({g, g->derivative(), g->derivative()->derivative()});
+        auto bits = [](std::span<const double> v) {
+            std::vector<std::uint64_t> b;
+            for (double d : v) b.push_back(std::bit_cast<std::uint64_t>(d));
+            return b;
+        };
+        for (auto& rt : {RegisterTape::allocate(family), RegisterTape::allocate(family.schedule())}) {
+            check(rt.registers < family.code.size(), "RegisterTape: スロットより少ないレジスタ");
+            for (double u : {-1.25, 0.5, 3.0})
+                for (double w : {0.75, 2.0}) {
+                    std::array<double, 2> xy{u, w};
+                    check(bits(rt.evaluate(xy)) == bits(family.evaluate(xy)), std::format("RegisterTape at ({}, {})", u, w));
+                }
+        }
+        // 13 点 (8 レーンのパック 1 つと端数)
+        std::vector<double> xs(13), by_tape(xs.size() * 2), by_registers(xs.size() * 2);
+        for (std::size_t i = 0; i < xs.size(); ++i) xs[i] = -1.5 + 0.31 * double(i);
+        auto pair = Tape::compile({dq, dq->derivative()});
+        evaluate_batch_all<double>(pair, xs, by_tape);
+        evaluate_batch_all<double>(RegisterTape::allocate(pair.schedule()), xs, by_registers);
+        check(bits(by_tape) == bits(by_registers), "RegisterTape: パック評価");
+    }
+
+    std::cout << "\n--- メモリ上限つきの逆モード (g(x, y) = (x + 1)^3 * y + x * y) ---\n";
+    {
+        auto g = make_add(make_mul(make_pow(make_add(V(), C(1)), 3), V("y")), make_mul(V(), V("y")));
+        auto tape = Tape::compile({g});
+        auto rt = RegisterTape::allocate(tape);
+        std::array<double, 2> xy{2.0, 3.0}, seed{1.0, 0.0};
+        std::cout << std::format("{} 命令, {} レジスタ\n", rt.code.size(), rt.registers);
+        for (std::size_t cap : {1024, 96}) {
+            try {
+                auto r = checkpointed_gradient(rt, xy, std::span(seed).first(1), cap);
+                std::cout << std::format("上限 {} バイト: g = {}, dg/dx = {}, dg/dy = {} ({} 段, {} バイト, 前進 {} 命令)\n",
+                                         cap, r.outputs[0], r.gradient[0], r.gradient[1], r.levels, r.peak_bytes, r.forward_instructions);
+            } catch (const std::runtime_error& err) {
+                std::cout << err.what() << "\n";
+            }
+        }
+        auto r = checkpointed_gradient(rt, xy, std::span(seed).first(1), 1024);
+        check(r.outputs == std::vector<double>{87} && r.gradient == std::vector<double>{84, 29}, "checkpointed_gradient: g, dg/dx, dg/dy");
+
+        // 多出力に重みを付けた勾配を, 上限を直前の使用量のすぐ下まで絞りながら (収まる最小の段数が 1 つずつ深くなる) Tape::adjoint と比べる.
+        // 命令の順は同じなので随伴の和の順も同じで, ビット単位で一致する. 生きている値の少ない長い鎖
+        // h = g + Σ (x + k / 10)^2 * y を使う (短い式ではレジスタが支配的で段を増やしても縮まない)
+        std::shared_ptr<Expression> h = g;
+        for (int k = 1; k <= 64; ++k) h = make_add(h, make_mul(make_pow(make_add(V(), C(k / 10.0)), 2), V("y")));
+        auto family = Tape::compile({h, h->derivative(), h->derivative()->derivative()});
+        auto frt = RegisterTape::allocate(family);
+        std::array<double, 3> weights{1.0, -0.5, 0.25};
+        std::vector<double> v, reference;
+        family.forward(xy, v);
+        family.adjoint(weights, v, reference);
+        std::size_t deepest = 0;
+        for (std::size_t cap = 16 * family.code.size();;) {
+            CheckpointedGradient c;
+            try {
+                c = checkpointed_gradient(frt, xy, weights, cap);
+            } catch (const std::runtime_error&) {
+                break;
+            }
+            check(c.peak_bytes <= cap, "checkpointed_gradient: 上限を守る");
+            check(c.gradient == reference && c.outputs == family.evaluate(xy), std::format("checkpointed_gradient: 上限 {} バイト", cap));
+            deepest = std::max(deepest, c.levels);
+            cap = c.peak_bytes - 1;
+        }
+        std::cout << std::format("h, h', h'' の重み付き勾配 ({} 命令, {} レジスタ): 二分 {} 段まで Tape::adjoint と一致\n",
+                                 family.code.size(), frt.registers, deepest);
+        check(deepest >= 2, "checkpointed_gradient: 二分の段を使う上限まで試す");
+    }
+
+    std::cout << "\n--- 評価速度のための簡約 (q(x) = (x + 1) * (x + 2) * (x + 3) の微分) ---\n";
+    auto dq = make_mul(make_mul(make_add(V(), C(1)), make_add(V(), C(2))), make_add(V(), C(3)))->derivative();
+    auto dq_cost = CostModel{}.estimate(dq.get());
+    auto dq_fast = simplify_for_speed(dq);
+    auto dq_fast_cost = CostModel{}.estimate(dq_fast.get());
+    std::cout << std::format("q'(x) = {} (予測 {:.1f} ns, {} ノード, 深さ {})\n",
+                             dq->to_string(), dq_cost.latency, dq_cost.nodes, dq_cost.depth);
+    std::cout << std::format("q'(x) (速度優先) = {} (予測 {:.1f} ns, {} ノード, 深さ {})\n",
+                             dq_fast->to_string(), dq_fast_cost.latency, dq_fast_cost.nodes, dq_fast_cost.depth);
+    // 多変数の式でも候補はすべて元の式と同値 (x * y + y に x だけの多項式の候補を作らない)
+    {
+        auto e = make_add(make_mul(V(), V("y")), V("y"));
+        std::array<double, 2> xy{2.0, 3.0};
+        for (auto& c : speed_candidates(e, CostModel{}))
+            check(Tape::compile({c.expr}, {"x", "y"}).evaluate(xy)[0] == 9.0, "speed_candidates: " + c.form);
+    }
+
+    std::cout << "\n--- 多項式正規形 (q(x) = (x + 1) * (x + 2) * (x + 3)) ---\n";
+    auto q = make_product({make_add(V(), C(1)), make_add(V(), C(2)), make_add(V(), C(3))});
+    auto qp = Polynomial::from_expression(*q);
+    std::cout << "q(x) = " << qp.to_string() << "\n";
+    std::cout << "q'(x) = " << qp.derivative().to_string() << "\n";
+    std::cout << "q'(x) (式に戻す) = " << qp.derivative().to_expression()->to_string() << "\n";
+    std::cout << "q(x) at x=2 (Horner / Estrin): " << qp.evaluate(2) << " / " << qp.evaluate_estrin(2) << "\n";
 
     return 0;
 }